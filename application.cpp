@@ -2,6 +2,7 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <random>
 #include "application.hpp"
 
 #include "chessbot/zobrist.hpp"
@@ -10,6 +11,12 @@
 
 #include "chessbot/util/wdl_model.hpp"
 #include "chessbot/util/pgn_parser.hpp"
+#include "chessbot/util/pgn_scorer.hpp"
+#include "chessbot/util/opening_index.hpp"
+#include "chessbot/nnue/training/training_data.hpp"
+#include "chessbot/nnue/training/training_nnue.hpp"
+#include "chessbot/nnue/training/training.hpp"
+#include "chessbot/nnue/training/dataset_stats.hpp"
 
 application::application()
 {
@@ -169,11 +176,174 @@ int application::test_incremental_updates()
 
 
 
+int application::test_training_acculumators()
+{
+    std::cout << "Testing trainer acculumators" << std::endl;
+
+    std::shared_ptr<training_weights> weights = std::make_shared<training_weights>();
+
+    std::mt19937 gen(1);
+    std::normal_distribution<float> nd(0.0f, 0.05f);
+
+    for (int i = 0; i < weights->perspective_weights.num_of_weights(); i++) {
+        weights->perspective_weights.weights[i] = nd(gen);
+    }
+    for (int i = 0; i < weights->perspective_weights.num_of_biases(); i++) {
+        weights->perspective_weights.biases[i] = nd(gen) + 0.5f;
+    }
+    weights->layer1_weights.zero(0, 1);
+    weights->layer2_weights.zero(0, 1);
+    weights->output_weights.zero(0, 1);
+
+    training_network incremental(weights);
+    training_network full(weights);
+    full.incremental_acculumators = false;
+
+    board_state state;
+    float max_error = 0.0f;
+
+    for (int game = 0; game < 200; game++) {
+        state.set_initial_state();
+
+        for (int ply = 0; ply < 200; ply++) {
+            std::vector<chess_move> moves = state.get_all_legal_moves(state.get_turn());
+            if (moves.empty()) {
+                break;
+            }
+            chess_move m = moves[rand() % moves.size()];
+
+            training_position tp(state, m, 0, 0.5f);
+
+            //Factorizer changes every input, which must fall back to full refresh
+            incremental.use_factorizer = (ply % 50 != 49);
+            full.use_factorizer = incremental.use_factorizer;
+
+            incremental.evaluate(tp);
+            full.evaluate(tp);
+
+            for (size_t i = 0; i < num_perspective_neurons + num_perspective_psqt; i++) {
+                max_error = std::max(max_error, std::abs(incremental.white_side.acculumator[i] - full.white_side.acculumator[i]));
+                max_error = std::max(max_error, std::abs(incremental.black_side.acculumator[i] - full.black_side.acculumator[i]));
+            }
+
+            state.make_move(m);
+        }
+    }
+
+    bool failed = (max_error > 1e-4f || incremental.white_side.incremental_updates == 0);
+
+    std::cout << "Incremental updates: " << incremental.white_side.incremental_updates + incremental.black_side.incremental_updates
+              << "  Refreshes: " << incremental.white_side.refreshes + incremental.black_side.refreshes
+              << "  Max error: " << max_error << std::endl;
+
+    if (failed) {
+        std::cout << "Trainer acculumators failed!!!" << std::endl;
+    } else {
+        std::cout << "Passed" << std::endl;
+    }
+    return failed;
+}
+
+
+
+int application::test_san_resolver()
+{
+    std::cout << "Testing SAN resolver... ";
+
+    board_state state;
+    size_t moves_tested = 0;
+    int errors = 0;
+
+    for (int game = 0; game < 200 && errors == 0; game++) {
+        state.set_initial_state();
+
+        std::vector<chess_move> played;
+
+        for (int ply = 0; ply < 200; ply++) {
+            std::vector<chess_move> moves = state.get_all_legal_moves(state.get_turn());
+            if (moves.empty()) {
+                break;
+            }
+
+            for (chess_move mov : moves) {
+                chess_move resolved = pgn_parser::parse_san(state, pgn_parser::generate_san(state, mov));
+                moves_tested++;
+
+                if (resolved != mov || resolved.encoded_pieces != mov.encoded_pieces) {
+                    std::cout << "\nFEN: " << state.generate_fen() << " move " << mov.to_uci() << " resolved as " << resolved.to_uci();
+                    errors++;
+                }
+            }
+
+            chess_move m = moves[rand() % moves.size()];
+            played.push_back(m);
+            state.make_move(m);
+        }
+
+        //Whole game through the tokenizer
+        if (pgn_parser::parse_moves(pgn_parser::generate_pgn({}, played)) != played) {
+            std::cout << "\nGame " << game << " did not survive PGN round trip";
+            errors++;
+        }
+    }
+
+    if (errors > 0) {
+        std::cout << "\nSAN resolver failed!!!" << std::endl;
+    } else {
+        std::cout << moves_tested << " moves. Passed" << std::endl;
+    }
+    return (errors > 0);
+}
+
+
+
+int application::test_opening_positions()
+{
+    std::cout << "Testing opening positions... ";
+
+    board_state state;
+    board_state loaded;
+    int errors = 0;
+
+    for (int game = 0; game < 50 && errors == 0; game++) {
+        state.load_fen(game % 2 == 0 ? "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - " : "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+
+        for (int ply = 0; ply < 100; ply++) {
+            opening_position(state).load(loaded);
+
+            if (loaded.generate_fen() != state.generate_fen() || loaded.zhash != state.zhash || loaded.structure_hash != state.structure_hash ||
+                loaded.half_move_clock != state.half_move_clock) {
+                std::cout << "\nFEN: " << state.generate_fen() << " loaded as " << loaded.generate_fen();
+                errors++;
+                break;
+            }
+
+            std::vector<chess_move> moves = state.get_all_legal_moves(state.get_turn());
+            if (moves.empty()) {
+                break;
+            }
+            state.make_move(moves[rand() % moves.size()]);
+        }
+    }
+
+    if (errors > 0) {
+        std::cout << "\nOpening positions failed!!!" << std::endl;
+    } else {
+        std::cout << "Passed" << std::endl;
+    }
+    return (errors > 0);
+}
+
+
+
 void application::run_tests()
 {
     int fails = 0;
 
     fails += test_incremental_updates();
+    fails += test_training_acculumators();
+    fails += test_san_resolver();
+    fails += test_opening_positions();
 
     fails += perft_test("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1 ",                       {0, 20, 400,  8902,  197281,   4865609});
     fails += perft_test("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - ",               {0, 48, 2039, 97862, 4085603,  193690690});
@@ -210,6 +380,10 @@ uint64_t application::bench_position(std::string position_fen, int depth)
 void application::run_benchmark()
 {
     uint64_t total_nodes = 0;
+
+    nnue_update_stats &nnue_stats = alphabeta->get_nnue(0)->stats;
+    nnue_stats.reset();
+
     auto start_time = std::chrono::high_resolution_clock::now();
 
     for (int i = 0; i < 1; i++) {
@@ -241,6 +415,263 @@ void application::run_benchmark()
 
     std::cout << "Time: " << ms << "ms   Nodes: " << total_nodes << "  Speed: " << total_nodes / ms << "Knps" << std::endl;
 
+    uint64_t avoided = nnue_stats.plies > nnue_stats.materialized ? nnue_stats.plies - nnue_stats.materialized : 0;
+    std::cout << "Acculumators computed: " << nnue_stats.materialized << " / " << nnue_stats.plies
+              << "  Avoided: " << (avoided * 100) / std::max<uint64_t>(nnue_stats.plies, 1) << "%"
+              << "  Refreshes built: " << nnue_stats.refreshes_materialized << " / " << nnue_stats.refreshes
+              << "  Refresh shortcuts: " << nnue_stats.refresh_shortcuts << std::endl;
+}
+
+
+static uint64_t replay_nnue_trace(nnue_network &net, const nnue_trace &trace, std::vector<board_state> &positions, bool evaluate, int &mismatches)
+{
+    board_state kings; //Refresh reads only king squares from state
+    kings.set_initial_state();
+
+    size_t position_index = 0;
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    for (const nnue_trace_event &e : trace.events) {
+        switch (e.op) {
+            case TRACE_RESET_STACK:
+                net.reset_acculumator_stack();
+                break;
+            case TRACE_PUSH:
+                net.push_acculumator();
+                break;
+            case TRACE_POP:
+                net.pop_acculumator();
+                break;
+            case TRACE_SET:
+                net.set_piece(piece((piece_player_type_t)e.piece0), square_index(e.sq0));
+                break;
+            case TRACE_UNSET:
+                net.unset_piece(piece((piece_player_type_t)e.piece0), square_index(e.sq0));
+                break;
+            case TRACE_MOVE:
+                net.move_piece(piece((piece_player_type_t)e.piece0), piece((piece_player_type_t)e.piece1), square_index(e.sq0), square_index(e.sq1));
+                break;
+            case TRACE_REFRESH:
+                kings.white_king_square = square_index(e.sq0);
+                kings.black_king_square = square_index(e.sq1);
+                net.refresh(kings, (player_type_t)e.piece0);
+                break;
+            case TRACE_EVALUATE:
+                if (evaluate && net.evaluate((player_type_t)e.piece0) != e.value) {
+                    mismatches++;
+                }
+                break;
+            case TRACE_EVALUATE_FULL:
+                //Refresh from board and evaluation are one call, only replayed with evaluations
+                if (evaluate) {
+                    net.evaluate(positions[position_index++]);
+                }
+                break;
+        }
+    }
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count();
+}
+
+
+void application::run_nnue_benchmark(int depth)
+{
+    std::vector<std::string> positions = {"2rq1r1k/pp3ppp/3n4/n2p4/1Q6/2PBBP1P/P4P2/2KR2R1 w - - 0 19",
+                                          "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+                                          "5rk1/1b2bpp1/p3pn1p/1p1q4/3B4/1P1NPP1P/P1rNQ1P1/R1R3K1 b - -",
+                                          "8/4b1k1/8/p4Q2/1p2N1Pp/1P1K3P/P5q1/8 w - -",
+                                          "r3k2r/pp1q1pb1/2npb1p1/2pN3p/2PnPB2/2NP3P/PP2B1P1/R2Q1RK1 b kq -",
+                                          "8/1p3pk1/6p1/7p/8/PR4P1/1P2K2P/2r5 b - -"};
+
+    //Record network operations of main search thread
+    nnue_trace trace;
+    std::shared_ptr<nnue_network> search_nnue = alphabeta->get_nnue(0);
+
+    alphabeta->new_game();
+    search_nnue->trace = &trace;
+    for (const std::string &fen : positions) {
+        bench_position(fen, depth);
+    }
+    search_nnue->trace = nullptr;
+
+    uint64_t evaluations = 0;
+    uint64_t updates = 0;
+    for (const nnue_trace_event &e : trace.events) {
+        if (e.op == TRACE_EVALUATE || e.op == TRACE_EVALUATE_FULL) {
+            evaluations++;
+        } else if (e.op != TRACE_EVALUATE_FULL && e.op != TRACE_RESET_STACK) {
+            updates++;
+        }
+    }
+
+    std::vector<board_state> full_positions(trace.fens.size());
+    for (size_t i = 0; i < trace.fens.size(); i++) {
+        full_positions[i].load_fen(trace.fens[i]);
+    }
+
+    std::cout << "Recorded " << trace.events.size() << " operations: " << evaluations << " evaluations, " << updates << " updates" << std::endl;
+
+    nnue_network net(search_nnue->weights);
+    int mismatches = 0;
+
+    //Without evaluations updates are only recorded to update tables, acculumators are materialized inside evaluate
+    uint64_t record_ns = replay_nnue_trace(net, trace, full_positions, false, mismatches);
+    uint64_t total_ns = replay_nnue_trace(net, trace, full_positions, true, mismatches);
+
+    //Profiled replay splits evaluate into acculumator materialization and layers
+    nnue_profile profile;
+    net.profile = &profile;
+    replay_nnue_trace(net, trace, full_positions, true, mismatches);
+    net.profile = nullptr;
+
+    uint64_t u = std::max<uint64_t>(updates, 1);
+    uint64_t n = std::max<uint64_t>(profile.evaluations, 1);
+    uint64_t layers_ns = profile.activation_ns + profile.layer1_ns + profile.output_layers_ns;
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Replay: " << total_ns / 1000000 << "ms" << std::endl;
+    std::cout << "Update:   " << (double)(record_ns + profile.acculumator_ns) / u << " ns/op" << std::endl;
+    std::cout << "  Recording:           " << (double)record_ns / u << " ns" << std::endl;
+    std::cout << "  Acculumator updates: " << (double)profile.acculumator_ns / u << " ns" << std::endl;
+    std::cout << "Evaluate: " << (double)layers_ns / n << " ns/eval" << std::endl;
+    std::cout << "  Activations:         " << (double)profile.activation_ns / n << " ns" << std::endl;
+    std::cout << "  Layer 1:             " << (double)profile.layer1_ns / n << " ns" << std::endl;
+    std::cout << "  Layer 2 + output:    " << (double)profile.output_layers_ns / n << " ns" << std::endl;
+    std::cout << std::defaultfloat;
+
+    if (mismatches > 0) {
+        std::cout << mismatches << " replayed evaluations differ from search!!!" << std::endl;
+    }
+}
+
+
+int application::run_nnue_fuzz(int games)
+{
+    std::cout << "Fuzzing acculumator updates over " << games << " random games" << std::endl;
+
+    std::shared_ptr<nnue_weights> weights = nnue_weights::get_shared_weights();
+
+    std::shared_ptr<nnue_network> incremental_net = std::make_shared<nnue_network>(weights);
+    nnue_network refresh_table_net(weights);
+    nnue_network full_net(weights);
+
+    auto acculumators_equal = [&](nnue_network &a, nnue_network &b) {
+        for (player_type_t p : {WHITE, BLACK}) {
+            if (std::memcmp(a.get_perspective(p).acculumator, b.get_perspective(p).acculumator, quantized_acculumator_width*sizeof(int16_t)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    board_state state;
+    std::vector<std::pair<chess_move, unmake_restore>> move_stack;
+
+    uint64_t positions = 0;
+    int fails = 0;
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    for (int game = 0; game < games && fails == 0; game++) {
+        state.nnue = nullptr;
+        state.set_initial_state();
+        state.nnue = incremental_net;
+        incremental_net->reset_acculumator_stack();
+        incremental_net->evaluate(state);
+
+        move_stack.clear();
+
+        while (move_stack.size() < MAX_DEPTH - 8 && state.half_move_clock < 100) {
+            std::vector<chess_move> legal_moves = state.get_all_legal_moves(state.get_turn());
+            if (legal_moves.size() == 0) {
+                break;
+            }
+            chess_move mov = legal_moves[rand() % legal_moves.size()];
+            move_stack.push_back(std::pair(mov, state.make_move(mov)));
+
+            //Take backs leave lazy update chains that cross popped plies
+            if (rand() % 8 == 0 && move_stack.size() > 1) {
+                int unmake = (rand() % std::min<int>(move_stack.size()-1, 4)) + 1;
+                for (int i = 0; i < unmake; i++) {
+                    state.unmake_move(move_stack.back().first, move_stack.back().second);
+                    move_stack.pop_back();
+                }
+            }
+
+            //Evaluate only some plies so pending updates are chained over several plies
+            if (rand() % 3 == 0) {
+                continue;
+            }
+
+            int16_t incremental_eval = incremental_net->evaluate(state.get_turn());
+            int16_t refresh_table_eval = refresh_table_net.evaluate(state);
+            int16_t full_eval = full_net.evaluate_full(state);
+
+            positions++;
+
+            if (incremental_eval != full_eval || refresh_table_eval != full_eval ||
+                !acculumators_equal(*incremental_net, full_net) || !acculumators_equal(refresh_table_net, full_net)) {
+
+                std::cout << "Acculumator mismatch in game " << game << " at " << state.generate_fen() << std::endl;
+                std::cout << "Incremental: " << incremental_eval << "  Refresh table: " << refresh_table_eval << "  Full: " << full_eval << std::endl;
+                fails++;
+                break;
+            }
+
+            //Children evaluated together from parent acculumator must match full evaluation
+            if (rand() % 4 == 0) {
+                std::vector<chess_move> children = state.get_all_legal_moves(state.get_turn());
+                board_state child_states[max_speculative_children];
+                int num_of_children = 0;
+
+                for (size_t i = 0; i < children.size() && num_of_children < max_speculative_children; i++) {
+                    unmake_restore restore = state.make_move(children[i]);
+                    if (incremental_net->stage_speculative_child(state.get_turn())) {
+                        child_states[num_of_children] = state;
+                        child_states[num_of_children].nnue = nullptr;
+                        num_of_children++;
+                    }
+                    state.unmake_move(children[i], restore);
+                }
+
+                int16_t speculative_evals[max_speculative_children];
+                incremental_net->evaluate_speculative_children(speculative_evals);
+
+                for (int i = 0; i < num_of_children; i++) {
+                    int16_t full_eval = full_net.evaluate_full(child_states[i]);
+                    positions++;
+
+                    if (speculative_evals[i] != full_eval) {
+                        std::cout << "Speculative evaluation mismatch in game " << game << " at " << child_states[i].generate_fen() << std::endl;
+                        std::cout << "Speculative: " << speculative_evals[i] << "  Full: " << full_eval << std::endl;
+                        fails++;
+                        break;
+                    }
+                }
+                if (fails) {
+                    break;
+                }
+            }
+        }
+
+        if ((game+1) % 10000 == 0) {
+            std::cout << game+1 << " games, " << positions << " positions" << std::endl;
+        }
+    }
+
+    state.nnue = nullptr;
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+    uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+
+    std::cout << "Positions compared: " << positions << "  Time: " << ms << "ms" << std::endl;
+    if (fails == 0) {
+        std::cout << "Passed" << std::endl;
+    }
+    return fails;
 }
 
 
@@ -373,6 +804,28 @@ float application::game_accuracy(std::vector<position_analysis_result> &analysis
 
 
 
+static const char *command_usage(const std::string &command)
+{
+    static const std::pair<const char*, const char*> usages[] = {
+        {"nnuebench", "nnuebench [depth]"},
+        {"nnuefuzz", "nnuefuzz [games]"},
+        {"pgnconvert", "pgnconvert <output folder> <file size MB> <pgn directories...>"},
+        {"pgnscore", "pgnscore <pgn folder> <output file> <max elo diff> <min elo> <nodes>"},
+        {"rescore", "rescore <input .bin> <output .bin, may be the input> <depth> <nodes> [threads]"},
+        {"datadedup", "datadedup <output folder> <max copies of a position> <dataset directories...>"},
+        {"trainbench", "trainbench [steps] [max threads] [dataset directories...]"},
+    };
+
+    for (const auto &usage : usages) {
+        if (command == usage.first) {
+            return usage.second;
+        }
+    }
+
+    return nullptr;
+}
+
+
 void application::run()
 {
     uci->start();
@@ -380,37 +833,89 @@ void application::run()
     while (!uci->exit()) {
         std::string cmd;
         while (uci->get_non_uci_cmd(cmd)) {
-            if (cmd == "eval") {
-                eval_trace(game->get_state().generate_fen());
-            } else if (cmd == "bench") {
-                run_benchmark();
-            } else if (cmd == "test") {
-                run_tests();
-            } else if (cmd == "analyze") {
-                std::string pgn_text = pgn_lines;
-
-                pgn_lines = "";
-
-                std::vector<pgn_comment> comments;
-
-                std::vector<pgn_tag> tags = pgn_parser::parse_tags(pgn_text);
-
-                std::string startpos_fen = pgn_parser::get_tag_value(tags, "FEN");
-
-                std::vector<chess_move> moves = pgn_parser::parse_moves(pgn_text, startpos_fen, &comments);
-
-                std::vector<position_analysis_result> result = analyze_game(startpos_fen, moves, 100000, 12);
-
-                float white_accuracy = game_accuracy(result, WHITE);
-                float black_accuracy = game_accuracy(result, BLACK);
-
-                std::cout << "Moves: " << moves.size() / 2 << std::endl;
-
-                std::cout << "White accuracy: " << white_accuracy << "%" << std::endl;
-                std::cout << "Black accuracy: " << black_accuracy << "%" << std::endl;
-
-            } else if (pgn_lines.size() < 64*1024) {
-                pgn_lines += "\n" + cmd;
+            std::vector<std::string> args = split_string(cmd, ' ');
+
+            try {
+                if (cmd == "eval") {
+                    eval_trace(game->get_state().generate_fen());
+                } else if (cmd == "bench") {
+                    run_benchmark();
+                } else if (cmd == "test") {
+                    run_tests();
+                } else if (args[0] == "nnuebench") {
+                    run_nnue_benchmark(args.size() > 1 ? std::stoi(args[1]) : 12);
+                } else if (args[0] == "nnuefuzz") {
+                    run_nnue_fuzz(args.size() > 1 ? std::stoi(args[1]) : 10000);
+                } else if (args[0] == "pgnconvert" && args.size() > 3) {
+                    //pgnconvert <output folder> <file size MB> <pgn directories...>
+                    training_data_utility::convert_training_data(std::vector<std::string>(args.begin() + 3, args.end()), args[1], std::stoi(args[2]));
+                } else if (args[0] == "chainconvert" && args.size() == 3) {
+                    training_data_utility::convert_to_chains({args[1]}, args[2]);
+                } else if (args[0] == "pgnscore" && args.size() == 6) {
+                    //pgnscore <pgn folder> <output file> <max elo diff> <min elo> <nodes>
+                    pgn_scorer::create_dataset(args[1], args[2], std::stof(args[3]), std::stof(args[4]), std::stoi(args[5]));
+                } else if (args[0] == "rescore" && args.size() >= 5) {
+                    //rescore <input .bin> <output .bin, may be the input> <depth> <nodes> [threads]
+                    pgn_scorer::rescore_dataset(args[1], args[2], std::stoi(args[3]), std::stoi(args[4]), args.size() > 5 ? std::stoi(args[5]) : 0);
+                } else if (args[0] == "wdlhist" && args.size() > 2) {
+                    //wdlhist <output file> <dataset directories...>
+                    wdl_histogram histogram;
+                    wdl_model::build_histogram(std::vector<std::string>(args.begin() + 2, args.end()), histogram);
+                    if (!histogram.save(args[1])) {
+                        std::cout << "Cannot write file " << args[1] << std::endl;
+                    }
+                } else if (args[0] == "wdlfit" && args.size() == 2) {
+                    //wdlfit <histogram file or dataset directory>
+                    wdl_model::fit_model(args[1]);
+                } else if (args[0] == "pgnbench" && args.size() > 1) {
+                    pgn_parser::benchmark(std::vector<std::string>(args.begin() + 1, args.end()));
+                } else if (args[0] == "datastats" && args.size() > 1) {
+                    //datastats <dataset directories...>
+                    dataset_stats::scan(std::vector<std::string>(args.begin() + 1, args.end()));
+                } else if (args[0] == "datadedup" && args.size() > 3) {
+                    //datadedup <output folder> <max copies of a position> <dataset directories...>
+                    dataset_stats::scan(std::vector<std::string>(args.begin() + 3, args.end()), args[1], std::stoi(args[2]));
+                } else if (args[0] == "databench" && args.size() > 1) {
+                    training_data_utility::benchmark_decoding(std::vector<std::string>(args.begin() + 1, args.end()));
+                } else if (args[0] == "trainbench") {
+                    //trainbench [steps] [max threads] [dataset directories...]
+                    int steps = args.size() > 1 ? std::stoi(args[1]) : 20;
+                    int max_threads = args.size() > 2 ? std::stoi(args[2]) : std::max(8, (int)std::thread::hardware_concurrency());
+                    std::vector<std::string> dirs(args.begin() + std::min<size_t>(args.size(), 3), args.end());
+                    nnue_trainer::benchmark(dirs, steps, max_threads);
+                } else if (cmd == "analyze") {
+                    std::string pgn_text = pgn_lines;
+
+                    pgn_lines = "";
+
+                    std::vector<pgn_comment> comments;
+
+                    std::vector<pgn_tag> tags = pgn_parser::parse_tags(pgn_text);
+
+                    std::string startpos_fen = pgn_parser::get_tag_value(tags, "FEN");
+
+                    std::vector<chess_move> moves = pgn_parser::parse_moves(pgn_text, startpos_fen, &comments);
+
+                    std::vector<position_analysis_result> result = analyze_game(startpos_fen, moves, 100000, 12);
+
+                    float white_accuracy = game_accuracy(result, WHITE);
+                    float black_accuracy = game_accuracy(result, BLACK);
+
+                    std::cout << "Moves: " << moves.size() / 2 << std::endl;
+
+                    std::cout << "White accuracy: " << white_accuracy << "%" << std::endl;
+                    std::cout << "Black accuracy: " << black_accuracy << "%" << std::endl;
+
+                } else if (pgn_lines.size() < 64*1024) {
+                    pgn_lines += "\n" + cmd;
+                }
+            } catch (const std::exception &e) {
+                //Malformed numeric arguments (std::stoi/std::stof) must not take down the engine
+                std::cout << "Invalid command \"" << cmd << "\": " << e.what() << std::endl;
+                const char *usage = args.empty() ? nullptr : command_usage(args[0]);
+                if (usage) {
+                    std::cout << "Usage: " << usage << std::endl;
+                }
             }
         }
 
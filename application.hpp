@@ -29,6 +29,8 @@ public:
     void run();
     void run_tests();
     void run_benchmark();
+    void run_nnue_benchmark(int depth);
+    int run_nnue_fuzz(int games);
     void eval_trace(std::string fen);
 
     std::vector<position_analysis_result> analyze_game(std::string startpos, std::vector<chess_move> &moves, int min_nodes, int min_depth);
@@ -42,6 +44,9 @@ public:
 private:
     int perft_test(std::string position_fen, std::vector<int> expected_results);
     int test_incremental_updates();
+    int test_training_acculumators();
+    int test_san_resolver();
+    int test_opening_positions();
 
     uint64_t bench_position(std::string position_fen, int depth);
 
@@ -27,6 +27,11 @@ public:
 
         allocate_data(size, true);
     }
+    cache(int size_MB) {
+        size = MB_to_size(size_MB);
+
+        allocate_data(size, true);
+    }
     ~cache() {
         free_data();
     }
@@ -72,6 +77,10 @@ public:
     uint64_t get_size_MB() {
         return size_to_MB(size);
     }
+
+    uint64_t get_memory_usage() {
+        return size * sizeof(T);
+    }
 private:
 
     void allocate_data(int s, bool construct)
@@ -102,6 +102,11 @@ struct nnue_layer
         delete [] neurons_buffer;
     }
 
+    //Heap buffers allocated by constructor
+    static constexpr size_t buffer_memory_usage() {
+        return (OUT+64) * sizeof(int16_t);
+    }
+
 
     void reset() {
         int16_t *neuron = (int16_t*)__builtin_assume_aligned(neurons, 64);
@@ -2,6 +2,16 @@
 #include "../state.hpp"
 #include <algorithm>
 #include "compression.hpp"
+#include <map>
+#include <mutex>
+#include <chrono>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 void nnue_network::reset_nnue()
@@ -26,63 +36,147 @@ void nnue_network::reset_nnue()
 
 }
 
+void nnue_network::set_weights(std::shared_ptr<nnue_weights> w)
+{
+    weights = w;
+
+    white_side.set_weights(&w->perspective_weights);
+    black_side.set_weights(&w->perspective_weights);
+    layer1.weights = &w->layer1_weights;
+    layer2.weights = &w->layer2_weights;
+    output_layer.weights = &w->output_weights;
+
+    white_side.reset_stack();
+    black_side.reset_stack();
+    reset_nnue();
+}
+
+size_t nnue_network::memory_usage() const
+{
+    constexpr size_t acculumator_buffer_size = (quantized_acculumator_width+64) * sizeof(int16_t);
+
+    size_t usage = sizeof(nnue_network);
+    usage += white_side.buffer_memory_usage() + black_side.buffer_memory_usage();
+    usage += layer1.buffer_memory_usage() + layer2.buffer_memory_usage() + output_layer.buffer_memory_usage();
+    usage += 2 * BOARD_SQUARES * acculumator_buffer_size;                //Refresh tables
+    usage += max_speculative_children * 2 * acculumator_buffer_size;   //Speculative acculumators
+    return usage;
+}
+
 void nnue_network::refresh(const board_state &s, player_type_t stm)
 {
+    if (trace) {
+        trace->record(TRACE_REFRESH, stm, 0, s.white_king_square.index, s.black_king_square.index);
+    }
+
     current_state->white_king_sq = s.white_king_square.index;
     current_state->black_king_sq = s.black_king_square.index;
 
+    //Acculumator is rebuilt from refresh table when it is needed. Updates recorded before refresh are obsolete.
+    nnue_perspective<num_perspective_inputs, num_perspective_neurons, quantized_perspective_psqt> &side = get_perspective(stm);
+
+    side.update_table->clear(side.acculumator, false);
+    side.update_table->pending_refresh = true;
+
+    stats.refreshes++;
+}
+
+int nnue_network::count_refresh_updates(player_type_t stm, int ply)
+{
+    const nnue_board_state *ply_state = &state_stack[ply];
+    const acculumator_refresh_table_entry *entry = (stm == WHITE) ? &white_refresh_table[ply_state->white_king_sq] :
+                                                                    &black_refresh_table[ply_state->black_king_sq];
+    int count = 0;
+    for (int i = PAWN; i <= KING; i++) {
+        for (int j = 0; j < 2; j++) {
+            count += pop_count(ply_state->bb[i][j] ^ entry->state.bb[i][j]);
+        }
+    }
+    return count;
+}
+
+void nnue_network::refresh_acculumator(player_type_t stm, int ply)
+{
+    const nnue_board_state *ply_state = &state_stack[ply];
+
     if (stm == WHITE) {
-        int white_king_sq = s.white_king_square.index;
+        int white_king_sq = ply_state->white_king_sq;
 
-        acculumator_refresh_table_entry *entry = &white_refresh_table[s.white_king_square.index];
+        acculumator_refresh_table_entry *entry = &white_refresh_table[ply_state->white_king_sq];
+        acculumator_update_table *table = white_side.get_update_table(ply);
 
-        white_side.update_table->clear(white_side.acculumator, true);
-        white_side.update_table->refresh = true;
-        white_side.acculumator_copy(white_side.acculumator, entry->acculumator);
+        table->clear(table->acculumator, true);
+        table->refresh = true;
+        white_side.acculumator_copy(table->acculumator, entry->acculumator);
         for (int i = PAWN; i <= KING; i++) {
             for (int j = 0; j < 2; j++) {
-                uint64_t add =   current_state->bb[i][j]  & (~entry->state.bb[i][j]);
-                uint64_t sub = (~current_state->bb[i][j]) &   entry->state.bb[i][j];
+                uint64_t add =   ply_state->bb[i][j]  & (~entry->state.bb[i][j]);
+                uint64_t sub = (~ply_state->bb[i][j]) &   entry->state.bb[i][j];
 
                 while (add) {
                     int sq_index = bit_scan_forward_clear(add);
-                    white_side.update_table->op_add(encode_input_with_buckets(i, ((j != 0) ? BLACK : WHITE), sq_index, white_king_sq));
+                    table->op_add(encode_input_with_buckets(i, ((j != 0) ? BLACK : WHITE), sq_index, white_king_sq));
                 }
                 while (sub) {
                     int sq_index = bit_scan_forward_clear(sub);
-                    white_side.update_table->op_sub(encode_input_with_buckets(i, ((j != 0) ? BLACK : WHITE), sq_index, white_king_sq));
+                    table->op_sub(encode_input_with_buckets(i, ((j != 0) ? BLACK : WHITE), sq_index, white_king_sq));
                 }
             }
         }
     } else {
-        int black_king_sq = s.black_king_square.index ^ 56;
+        int black_king_sq = ply_state->black_king_sq ^ 56;
 
-        acculumator_refresh_table_entry *entry = &black_refresh_table[s.black_king_square.index];
+        acculumator_refresh_table_entry *entry = &black_refresh_table[ply_state->black_king_sq];
+        acculumator_update_table *table = black_side.get_update_table(ply);
 
-        black_side.update_table->clear(black_side.acculumator, true);
-        black_side.update_table->refresh = true;
-        black_side.acculumator_copy(black_side.acculumator, entry->acculumator);
+        table->clear(table->acculumator, true);
+        table->refresh = true;
+        black_side.acculumator_copy(table->acculumator, entry->acculumator);
         for (int i = PAWN; i <= KING; i++) {
             for (int j = 0; j < 2; j++) {
-                uint64_t add =   current_state->bb[i][j]  & (~entry->state.bb[i][j]);
-                uint64_t sub = (~current_state->bb[i][j]) &   entry->state.bb[i][j];
+                uint64_t add =   ply_state->bb[i][j]  & (~entry->state.bb[i][j]);
+                uint64_t sub = (~ply_state->bb[i][j]) &   entry->state.bb[i][j];
 
                 while (add) {
                     int sq_index = bit_scan_forward_clear(add);
-                    black_side.update_table->op_add(encode_input_with_buckets(i, ((j != 0) ? WHITE : BLACK), sq_index ^ 56, black_king_sq));
+                    table->op_add(encode_input_with_buckets(i, ((j != 0) ? WHITE : BLACK), sq_index ^ 56, black_king_sq));
                 }
                 while (sub) {
                     int sq_index = bit_scan_forward_clear(sub);
-                    black_side.update_table->op_sub(encode_input_with_buckets(i, ((j != 0) ? WHITE : BLACK), sq_index ^ 56, black_king_sq));
+                    table->op_sub(encode_input_with_buckets(i, ((j != 0) ? WHITE : BLACK), sq_index ^ 56, black_king_sq));
                 }
             }
         }
     }
 }
 
+void nnue_network::prepare_update_chain(player_type_t stm)
+{
+    nnue_perspective<num_perspective_inputs, num_perspective_neurons, quantized_perspective_psqt> &side = get_perspective(stm);
+
+    int start = side.find_chain_start();
+    int current = side.get_update_table_index();
+
+    if (side.get_update_table(start)->pending_refresh) {
+        //Refresh of ancestor was deferred. Build it now, acculumators after it are computed from it.
+        refresh_acculumator(stm, start);
+        stats.refreshes_materialized++;
+    } else if (start != current) {
+        //Refreshing current acculumator from refresh table is cheaper than applying long chain of updates
+        int pending = side.count_pending_updates(start);
+        if (pending > refresh_shortcut_min_updates && count_refresh_updates(stm, current) + 1 < pending) {
+            refresh_acculumator(stm, current);
+            stats.refresh_shortcuts++;
+        }
+    }
+}
 
 void nnue_network::set_piece(piece p, square_index sq)
 {
+    if (trace) {
+        trace->record(TRACE_SET, p.d, 0, sq.get_index());
+    }
+
     int type = p.get_type();
     int color = p.get_player();
 
@@ -101,6 +195,10 @@ void nnue_network::set_piece(piece p, square_index sq)
 
 void nnue_network::unset_piece(piece p, square_index sq)
 {
+    if (trace) {
+        trace->record(TRACE_UNSET, p.d, 0, sq.get_index());
+    }
+
     int type = p.get_type();
     int color = p.get_player();
 
@@ -119,6 +217,10 @@ void nnue_network::unset_piece(piece p, square_index sq)
 
 void nnue_network::move_piece(piece p, piece old_p, square_index from_sq, square_index to_sq)
 {
+    if (trace) {
+        trace->record(TRACE_MOVE, p.d, old_p.d, from_sq.get_index(), to_sq.get_index());
+    }
+
     int type = p.get_type();
     int color = p.get_player();
 
@@ -162,51 +264,200 @@ void nnue_network::move_piece(piece p, piece old_p, square_index from_sq, square
 }
 
 
-int16_t nnue_network::evaluate(player_type_t stm)
+int nnue_network::get_output_bucket(const nnue_board_state *s)
 {
-    uint64_t non_pawn_pieces = current_state->bb[BISHOP][0] | current_state->bb[BISHOP][1] |
-                               current_state->bb[KNIGHT][0] | current_state->bb[KNIGHT][1] |
-                               current_state->bb[ROOK][0]   | current_state->bb[ROOK][1]   |
-                               current_state->bb[QUEEN][0]  | current_state->bb[QUEEN][1];
+    uint64_t non_pawn_pieces = s->bb[BISHOP][0] | s->bb[BISHOP][1] |
+                               s->bb[KNIGHT][0] | s->bb[KNIGHT][1] |
+                               s->bb[ROOK][0]   | s->bb[ROOK][1]   |
+                               s->bb[QUEEN][0]  | s->bb[QUEEN][1];
 
-    int output_bucket = encode_output_bucket(non_pawn_pieces);
+    return encode_output_bucket(non_pawn_pieces);
+}
 
-    if (white_side.apply_all_updates()) {
+void nnue_network::update_acculumators()
+{
+    prepare_update_chain(WHITE);
+    prepare_update_chain(BLACK);
+
+    bool white_refresh, black_refresh;
+    stats.materialized += nnue_perspective<num_perspective_inputs, num_perspective_neurons, quantized_perspective_psqt>::apply_all_updates(white_side, black_side, white_refresh, black_refresh);
+
+    if (white_refresh) {
         white_refresh_table[current_state->white_king_sq].save(&white_side, current_state);
     }
-    if (black_side.apply_all_updates()) {
+    if (black_refresh) {
         black_refresh_table[current_state->black_king_sq].save(&black_side, current_state);
-    }
-
-    int32_t our_psqt;
+    }
+}
+
+int16_t nnue_network::evaluate_output(player_type_t stm, int output_bucket)
+{
+    std::chrono::high_resolution_clock::time_point t1, t2, t3, t4;
+    if (profile) {
+        t1 = std::chrono::high_resolution_clock::now();
+    }
+
+    int32_t our_psqt;
     int32_t their_psqt;
 
     white_side.update_activations();
     black_side.update_activations();
-    if (stm == WHITE) {
-        our_psqt = white_side.get_psqt_vec()[output_bucket];
+
+    if (profile) {
+        t2 = std::chrono::high_resolution_clock::now();
+    }
+
+    if (stm == WHITE) {
+        our_psqt = white_side.get_psqt_vec()[output_bucket];
         their_psqt = black_side.get_psqt_vec()[output_bucket];
         layer1.update(output_bucket, white_side.neurons, white_side.outputs_idx, white_side.num_of_outputs, black_side.neurons, black_side.outputs_idx, black_side.num_of_outputs);
-    } else {
-        our_psqt = black_side.get_psqt_vec()[output_bucket];
+    } else {
+        our_psqt = black_side.get_psqt_vec()[output_bucket];
         their_psqt = white_side.get_psqt_vec()[output_bucket];
         layer1.update(output_bucket, black_side.neurons, black_side.outputs_idx, black_side.num_of_outputs, white_side.neurons, white_side.outputs_idx, white_side.num_of_outputs);
     }
+
+    if (profile) {
+        t3 = std::chrono::high_resolution_clock::now();
+    }
+
     layer2.update(output_bucket, layer1.neurons);
-    output_layer.update(output_bucket, layer2.neurons);
-
-
-    int32_t ls_out = (output_layer.out * 100) / output_quantization_fractions;
-    int32_t psqt_out = ((our_psqt - their_psqt)*50) / psqt_quantization_fractions;
-
-    last_pos_eval = ls_out;
-    last_psqt_eval = psqt_out;
+    output_layer.update(output_bucket, layer2.neurons);
+
+    if (profile) {
+        t4 = std::chrono::high_resolution_clock::now();
+
+        profile->activation_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
+        profile->layer1_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(t3 - t2).count();
+        profile->output_layers_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count();
+        profile->evaluations += 1;
+    }
+
+
+    int32_t ls_out = (output_layer.out * 100) / output_quantization_fractions;
+    int32_t psqt_out = ((our_psqt - their_psqt)*50) / psqt_quantization_fractions;
+
+    last_pos_eval = ls_out;
+    last_psqt_eval = psqt_out;
 
     return ls_out + psqt_out;
 }
 
+int16_t nnue_network::evaluate(player_type_t stm)
+{
+    std::chrono::high_resolution_clock::time_point t0;
+    if (profile) {
+        t0 = std::chrono::high_resolution_clock::now();
+    }
+
+    update_acculumators();
+
+    if (profile) {
+        profile->acculumator_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - t0).count();
+    }
+
+    int16_t eval = evaluate_output(stm, get_output_bucket(current_state));
+
+    if (trace) {
+        trace->record(TRACE_EVALUATE, stm, 0, 0, 0, eval);
+    }
+
+    return eval;
+}
+
+bool nnue_network::stage_speculative_child(player_type_t stm)
+{
+    if (num_of_speculative_children >= max_speculative_children) {
+        return false;
+    }
+    speculative_child &child = speculative_children[num_of_speculative_children];
+
+    for (int side = 0; side < 2; side++) {
+        const acculumator_update_table *table = (side == 0 ? white_side.update_table : black_side.update_table);
+
+        //Children with refresh are not derived from parent
+        if (table->pending_refresh || table->num_of_updates > max_speculative_updates) {
+            return false;
+        }
+        child.num_of_updates[side] = table->num_of_updates;
+        for (int i = 0; i < table->num_of_updates; i++) {
+            child.updates[side][i] = table->updates[i];
+        }
+    }
+    child.stm = stm;
+    child.output_bucket = get_output_bucket(current_state);
+
+    num_of_speculative_children++;
+
+    return true;
+}
+
+int nnue_network::evaluate_speculative_children(int16_t *evals)
+{
+    int n = num_of_speculative_children;
+    num_of_speculative_children = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    update_acculumators();
+
+    int16_t *white_dst[max_speculative_children];
+    int16_t *black_dst[max_speculative_children];
+    const int16_t *white_updates[max_speculative_children];
+    const int16_t *black_updates[max_speculative_children];
+    int white_num_of_updates[max_speculative_children] = {};
+    int black_num_of_updates[max_speculative_children] = {};
+
+    for (int i = 0; i < n; i++) {
+        white_dst[i] = speculative_acculumators[i][0].acculumator;
+        black_dst[i] = speculative_acculumators[i][1].acculumator;
+        white_updates[i] = speculative_children[i].updates[0];
+        black_updates[i] = speculative_children[i].updates[1];
+        white_num_of_updates[i] = speculative_children[i].num_of_updates[0];
+        black_num_of_updates[i] = speculative_children[i].num_of_updates[1];
+    }
+
+    white_side.apply_sibling_updates(white_side.acculumator, white_dst, white_updates, white_num_of_updates, n);
+    black_side.apply_sibling_updates(black_side.acculumator, black_dst, black_updates, black_num_of_updates, n);
+
+    //Layers read acculumators through perspectives, point them to children for output pass
+    int16_t *white_acculumator = white_side.acculumator;
+    int16_t *black_acculumator = black_side.acculumator;
+
+    for (int i = 0; i < n; i++) {
+        white_side.acculumator = white_dst[i];
+        black_side.acculumator = black_dst[i];
+
+        evals[i] = evaluate_output(speculative_children[i].stm, speculative_children[i].output_bucket);
+    }
+
+    white_side.acculumator = white_acculumator;
+    black_side.acculumator = black_acculumator;
+
+    return n;
+}
+
+int16_t nnue_network::evaluate_full(const board_state &s)
+{
+    white_side.reset_stack();
+    black_side.reset_stack();
+    reset_nnue();
+
+    return evaluate(s);
+}
+
 int16_t nnue_network::evaluate(const board_state &s)
 {
+    //Refresh and evaluate below are part of this operation, don't record them separately
+    nnue_trace *t = trace;
+    if (t) {
+        t->record(TRACE_EVALUATE_FULL);
+        t->fens.push_back(s.generate_fen());
+        trace = nullptr;
+    }
+
     for (int i = PAWN; i <= KING; i++) {
         for (int j = 0; j < 2; j++) {
             current_state->bb[i][j] = s.bitboards[i][j];
@@ -218,7 +469,11 @@ int16_t nnue_network::evaluate(const board_state &s)
     refresh(s, WHITE);
     refresh(s, BLACK);
 
-    return evaluate(s.get_turn());
+    int16_t eval = evaluate(s.get_turn());
+
+    trace = t;
+
+    return eval;
 }
 
 
@@ -230,14 +485,39 @@ unsigned char* embedded_weights_data = _binary_embedded_weights_nnue_start;
 
 
 nnue_weights::nnue_weights()
-{
-
-    rescale_factor0 = 1;
-    rescale_factor1 = 1;
+{
+
+    rescale_factor0 = 1;
+    rescale_factor1 = 1;
+
+    valid = load(embedded_weights_data, embedded_weights_size);
+}
+
+nnue_weights::nnue_weights(const std::string &path)
+{
+    rescale_factor0 = 1;
+    rescale_factor1 = 1;
+
+    valid = load(path);
+}
+
+
+bool nnue_weights::load(uint8_t *encoded_data, size_t encoded_size)
+{
+    size_t total_params = perspective_weights.num_of_biases() + perspective_weights.num_of_weights() +
+                          layer1_weights.num_of_biases() + layer1_weights.num_of_weights() +
+                          layer2_weights.num_of_biases() + layer2_weights.num_of_weights() +
+                          output_weights.num_of_biases() + output_weights.num_of_weights();
 
     uint8_t *decoded_data;
     int decoded_size;
-    nnue_compressor::decode(embedded_weights_data, embedded_weights_size, decoded_data, decoded_size);
+    nnue_compressor::decode(encoded_data, encoded_size, decoded_data, decoded_size);
+
+    if ((size_t)decoded_size < total_params*sizeof(int16_t)) {
+        std::cout << "Invalid network: expected " << total_params << " parameters, got " << decoded_size / sizeof(int16_t) << std::endl;
+        delete [] decoded_data;
+        return false;
+    }
 
     size_t index = 0;
     perspective_weights.load((int16_t*)decoded_data, index);
@@ -246,11 +526,41 @@ nnue_weights::nnue_weights()
     output_weights.load((int16_t*)decoded_data, index);
 
     delete [] decoded_data;
+
+    return true;
 }
 
 
-void nnue_weights::load(std::string path)
+bool nnue_weights::load(std::string path)
 {
+    bool success = false;
+#ifdef __linux__
+    //Map file instead of copying it to heap. Decoder reads it once sequentially.
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cout << "Failed to open file: " << path << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t fsize = st.st_size;
+    void *mapping = mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        std::cout << "Failed to map file: " << path << std::endl;
+        return false;
+    }
+    madvise(mapping, fsize, MADV_SEQUENTIAL);
+
+    success = load((uint8_t*)mapping, fsize);
+
+    munmap(mapping, fsize);
+#else
     std::ifstream file(path.c_str(), std::ios::binary);
     if (file.is_open()) {
         file.seekg(0, std::ios::end);
@@ -262,22 +572,39 @@ void nnue_weights::load(std::string path)
 
         file.read((char*)encoded_data, fsize);
 
-        uint8_t *decoded_data;
-        int decoded_size;
-        nnue_compressor::decode(encoded_data, fsize, decoded_data, decoded_size);
-
-        size_t index = 0;
-        perspective_weights.load((int16_t*)decoded_data, index);
-        layer1_weights.load((int16_t*)decoded_data, index);
-        layer2_weights.load((int16_t*)decoded_data, index);
-        output_weights.load((int16_t*)decoded_data, index);
+        success = load(encoded_data, fsize);
 
         delete [] encoded_data;
-        delete [] decoded_data;
-    } else {
-        std::cout << "Failed to open file: " << path << std::endl;
+    } else {
+        std::cout << "Failed to open file: " << path << std::endl;
     }
     file.close();
+#endif
+    return success;
+}
+
+
+std::shared_ptr<nnue_weights> nnue_weights::get_shared_weights(const std::string &path)
+{
+    if (path == "" || path == "<embedded>") {
+        return get_shared_weights();
+    }
+
+    static std::mutex registry_lock;
+    static std::map<std::string, std::weak_ptr<nnue_weights>> registry;
+
+    std::lock_guard<std::mutex> lock(registry_lock);
+
+    std::shared_ptr<nnue_weights> w = registry[path].lock();
+    if (!w) {
+        w = std::make_shared<nnue_weights>(path);
+        if (!w->valid) {
+            registry.erase(path);
+            return nullptr;
+        }
+        registry[path] = w;
+    }
+    return w;
 }
 
 void nnue_weights::save(std::string path)
@@ -6,6 +6,8 @@
 #include <iostream>
 #include <algorithm>
 #include <math.h>
+#include <vector>
+#include <string>
 
 #include "layer.hpp"
 #include "perspective.hpp"
@@ -21,6 +23,7 @@ struct square_index;
 struct nnue_weights
 {
     nnue_weights();
+    nnue_weights(const std::string &path);
 
     nnue_perspective_weights<num_perspective_inputs, quantized_acculumator_width> perspective_weights;
     nnue_layer_weights<num_perspective_neurons, layer1_neurons, layer_stack_size> layer1_weights;
@@ -30,8 +33,15 @@ struct nnue_weights
     int rescale_factor0;
     int rescale_factor1;
 
-    void load(std::string path);
-    void save(std::string path);
+    bool load(std::string path);
+    bool load(uint8_t *encoded_data, size_t encoded_size);
+    void save(std::string path);
+
+    bool valid;
+
+    //Returns weights loaded from path. Each file is loaded only once and shared by every network using it.
+    //Empty path or "<embedded>" returns embedded weights. Returns nullptr if file can't be loaded.
+    static std::shared_ptr<nnue_weights> get_shared_weights(const std::string &path);
 
     static std::shared_ptr<nnue_weights> get_shared_weights() {
         static std::shared_ptr<nnue_weights> shared_weights;
@@ -45,6 +55,91 @@ struct nnue_weights
 };
 
 
+enum nnue_trace_op_t: uint8_t {TRACE_RESET_STACK, TRACE_PUSH, TRACE_POP, TRACE_SET, TRACE_UNSET, TRACE_MOVE, TRACE_REFRESH, TRACE_EVALUATE, TRACE_EVALUATE_FULL};
+
+struct nnue_trace_event
+{
+    nnue_trace_op_t op;
+    uint8_t piece0;
+    uint8_t piece1;
+    uint8_t sq0;
+    uint8_t sq1;
+    int16_t value;
+};
+
+//Network operations recorded from search, so search paths can be replayed without search
+struct nnue_trace
+{
+    std::vector<nnue_trace_event> events;
+    std::vector<std::string> fens; //Position of each TRACE_EVALUATE_FULL
+
+    void record(nnue_trace_op_t op, uint8_t piece0 = 0, uint8_t piece1 = 0, uint8_t sq0 = 0, uint8_t sq1 = 0, int16_t value = 0)
+    {
+        events.push_back({op, piece0, piece1, sq0, sq1, value});
+    }
+};
+
+//Time spent in each part of evaluate
+struct nnue_profile
+{
+    nnue_profile() {
+        reset();
+    }
+
+    void reset() {
+        acculumator_ns = 0;
+        activation_ns = 0;
+        layer1_ns = 0;
+        output_layers_ns = 0;
+        evaluations = 0;
+    }
+
+    uint64_t acculumator_ns;
+    uint64_t activation_ns;
+    uint64_t layer1_ns;
+    uint64_t output_layers_ns;
+    uint64_t evaluations;
+};
+
+
+//Acculumator work done and avoided by lazy updates. Counted per perspective.
+struct nnue_update_stats
+{
+    nnue_update_stats() {
+        reset();
+    }
+
+    void reset() {
+        plies = 0;
+        materialized = 0;
+        refreshes = 0;
+        refreshes_materialized = 0;
+        refresh_shortcuts = 0;
+    }
+
+    uint64_t plies;
+    uint64_t materialized;
+    uint64_t refreshes;
+    uint64_t refreshes_materialized;
+    uint64_t refresh_shortcuts;
+};
+
+//Pending chain must have more updates than this before refreshing from refresh table is considered
+constexpr int refresh_shortcut_min_updates = 8;
+
+//Limits of children evaluated together from one parent acculumator
+constexpr int max_speculative_children = 8;
+constexpr int max_speculative_updates = 4;
+
+struct speculative_child
+{
+    int16_t updates[2][max_speculative_updates];
+    int num_of_updates[2];
+    player_type_t stm;
+    int output_bucket;
+};
+
+
 struct nnue_board_state
 {
     uint64_t bb[8][2];
@@ -74,6 +169,21 @@ private:
     int16_t *acculumator_buffer;
 };
 
+struct speculative_acculumator
+{
+    speculative_acculumator() {
+        acculumator_buffer = new int16_t[quantized_acculumator_width+64];
+        acculumator = align_ptr(acculumator_buffer);
+    }
+    ~speculative_acculumator() {
+        delete [] acculumator_buffer;
+    }
+    int16_t *acculumator;
+
+private:
+    int16_t *acculumator_buffer;
+};
+
 struct nnue_network
 {
     nnue_network(std::shared_ptr<nnue_weights> w): weights(w),
@@ -81,10 +191,16 @@ struct nnue_network
                                                    white_side(&w->perspective_weights),
                                                    layer1(&w->layer1_weights),
                                                    layer2(&w->layer2_weights),
-                                                   output_layer(&w->output_weights) { reset_nnue(); };
+                                                   output_layer(&w->output_weights) { trace = nullptr; profile = nullptr; num_of_speculative_children = 0; reset_nnue(); };
 
+    //Rebinds network to another weights without reallocating acculumators. Resets acculumator stack and refresh tables.
+    void set_weights(std::shared_ptr<nnue_weights> w);
 
-    int16_t evaluate(const board_state &s);
+
+    int16_t evaluate(const board_state &s);
+
+    //Evaluates from scratch without using refresh tables
+    int16_t evaluate_full(const board_state &s);
 
     void refresh(const board_state &s, player_type_t stm);
     int16_t evaluate(player_type_t stm);
@@ -92,8 +208,19 @@ struct nnue_network
     void set_piece(piece p, square_index sq);
     void unset_piece(piece p, square_index sq);
     void move_piece(piece p, piece captured_p, square_index from_sq, square_index to_sq);
+
+    //Stages current position as child of previous ply. Must be called after move was made on network and before it is undone.
+    //Returns false when child can't be derived from parent (king bucket change, too many updates, batch full).
+    bool stage_speculative_child(player_type_t stm);
+
+    //Evaluates all staged children from parent acculumator in single pass. Must be called at parent ply.
+    //Returns number of evaluations written to evals.
+    int evaluate_speculative_children(int16_t *evals);
 
 
+    //Network with its acculumator stacks, refresh tables and speculative acculumators. Weights are shared and not counted
+    size_t memory_usage() const;
+
     int16_t last_pos_eval;
     int16_t last_psqt_eval;
 
@@ -105,6 +232,9 @@ struct nnue_network
 
     void reset_acculumator_stack()
     {
+        if (trace) {
+            trace->record(TRACE_RESET_STACK);
+        }
         white_side.reset_stack();
         black_side.reset_stack();
 
@@ -114,15 +244,23 @@ struct nnue_network
 
     void push_acculumator()
     {
+        if (trace) {
+            trace->record(TRACE_PUSH);
+        }
         black_side.push_acculumator();
         white_side.push_acculumator();
 
+        stats.plies += 2;
+
         current_state[1] = current_state[0];
         current_state += 1;
     }
 
     void pop_acculumator()
     {
+        if (trace) {
+            trace->record(TRACE_POP);
+        }
         black_side.pop_acculumator();
         white_side.pop_acculumator();
 
@@ -139,10 +277,23 @@ struct nnue_network
         }
     }
 
-    const std::shared_ptr<nnue_weights> weights;
+    std::shared_ptr<nnue_weights> weights;
+
+    nnue_trace *trace;
+    nnue_profile *profile;
+
+    nnue_update_stats stats;
 private:
     void reset_nnue();
 
+    int count_refresh_updates(player_type_t stm, int ply);
+    void refresh_acculumator(player_type_t stm, int ply);
+    void prepare_update_chain(player_type_t stm);
+
+    int get_output_bucket(const nnue_board_state *s);
+    void update_acculumators();
+    int16_t evaluate_output(player_type_t stm, int output_bucket);
+
 
     nnue_perspective<num_perspective_inputs, num_perspective_neurons, quantized_perspective_psqt> black_side;
     nnue_perspective<num_perspective_inputs, num_perspective_neurons, quantized_perspective_psqt> white_side;
@@ -155,4 +306,8 @@ private:
 
     acculumator_refresh_table_entry white_refresh_table[BOARD_SQUARES];
     acculumator_refresh_table_entry black_refresh_table[BOARD_SQUARES];
+
+    speculative_child speculative_children[max_speculative_children];
+    speculative_acculumator speculative_acculumators[max_speculative_children][2];
+    int num_of_speculative_children;
 };
@@ -8,6 +8,13 @@
     #define USE_AVX2 0
 #endif
 
+//Float training kernels only, quantized inference stays on AVX2
+#if defined(__AVX512F__)
+    #define USE_AVX512 1
+#else
+    #define USE_AVX512 0
+#endif
+
 constexpr size_t inputs_per_bucket = 64*12;
 constexpr size_t num_of_king_buckets = 16;
 
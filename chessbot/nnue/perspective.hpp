@@ -56,7 +56,6 @@ struct nnue_perspective_weights
     int16_t *biases_buffer;
 };
 
-enum fused_update_type_t {FU_NONE, FU_ADDSUB, FU_ADDSUBSUB};
 
 struct acculumator_update_table
 {
@@ -64,25 +63,21 @@ struct acculumator_update_table
     int16_t num_of_updates;
     bool is_clean;
     bool refresh;
+    bool pending_refresh;
     int16_t *acculumator;
 
-    fused_update_type_t fused;
-
     void op_add(int index)
     {
-        fused = FU_NONE;
         updates[num_of_updates++] = index+1;
     }
 
     void op_sub(int index)
     {
-        fused = FU_NONE;
         updates[num_of_updates++] = -index-1;
     }
 
     void op_addsub(int add_index, int sub_index)
     {
-        fused = (num_of_updates == 0 ? FU_ADDSUB : FU_NONE);
         updates[num_of_updates+0] = add_index+1;
         updates[num_of_updates+1] = -sub_index-1;
 
@@ -91,7 +86,6 @@ struct acculumator_update_table
 
     void op_addsubsub(int add_index, int sub_index0, int sub_index1)
     {
-        fused = (num_of_updates == 0 ? FU_ADDSUBSUB : FU_NONE);
         updates[num_of_updates+0] = add_index+1;
         updates[num_of_updates+1] = -sub_index0-1;
         updates[num_of_updates+2] = -sub_index1-1;
@@ -101,9 +95,9 @@ struct acculumator_update_table
 
     void clear(int16_t *acc, bool clean)
     {
-        fused = FU_NONE;
         num_of_updates = 0;
         refresh = false;
+        pending_refresh = false;
         acculumator = acc;
         is_clean = clean;
     }
@@ -147,6 +141,11 @@ struct nnue_perspective
         update_table = &update_tables[update_table_index];
     }
 
+    void set_weights(nnue_perspective_weights<INPUTS, NEURONS+PSQT> *w)
+    {
+        weights = w;
+    }
+
     int16_t *get_psqt_vec()
     {
         return &acculumator[NEURONS];
@@ -159,6 +158,11 @@ struct nnue_perspective
         delete [] outputs_idx_buffer;
     }
 
+    //Heap buffers allocated by constructor, shared shuffle table is not counted
+    static constexpr size_t buffer_memory_usage() {
+        return ((NEURONS+PSQT+64) + ((NEURONS+PSQT)*130+64) + ((NEURONS+PSQT)+64)) * sizeof(int16_t);
+    }
+
     void reset_stack()
     {
         acculumator = align_ptr(acculumator_buffer);
@@ -209,265 +213,246 @@ struct nnue_perspective
         #endif // USE_AVX2
     }
 
-    void acculumator_add(int16_t *src, int16_t *dst, int index)
-    {
-        const int16_t* __restrict weight = &weights->weights[index*(NEURONS+PSQT)];
-
-        #if USE_AVX2
-
-        int i = 0;
-        for (; i < NEURONS+PSQT - 32; i += 32) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i b0 = _mm256_load_si256((__m256i*)&weight[i]);
-
-            __m256i a1 = _mm256_load_si256((__m256i*)&src[i+16]);
-            __m256i b1 = _mm256_load_si256((__m256i*)&weight[i+16]);
-
-
-            a0 = _mm256_add_epi16(a0, b0);
-            a1 = _mm256_add_epi16(a1, b1);
-
-            _mm256_store_si256((__m256i*)&dst[i], a0);
-            _mm256_store_si256((__m256i*)&dst[i+16], a1);
-        }
-        for (; i < NEURONS+PSQT; i += 16) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i b0 = _mm256_load_si256((__m256i*)&weight[i]);
-
-            _mm256_store_si256((__m256i*)&dst[i], _mm256_add_epi16(a0, b0));
-        }
-
-        #else
-
-        for (int i = 0; i < NEURONS+PSQT; i += 16) {
-            __m128i a0 = _mm_load_si128((__m128i*)&src[i]);
-            __m128i b0 = _mm_load_si128((__m128i*)&weight[i]);
-
-            __m128i a1 = _mm_load_si128((__m128i*)&src[i+8]);
-            __m128i b1 = _mm_load_si128((__m128i*)&weight[i+8]);
-
-
-            a0 = _mm_add_epi16(a0, b0);
-            a1 = _mm_add_epi16(a1, b1);
-
-            _mm_store_si128((__m128i*)&dst[i], a0);
-            _mm_store_si128((__m128i*)&dst[i+8], a1);
-        }
-
-        #endif // USE_AVX2
-    }
-
-    void acculumator_sub(int16_t *src, int16_t *dst, int index)
-    {
-        const int16_t* __restrict weight = &weights->weights[index*(NEURONS+PSQT)];
-
-        #if USE_AVX2
-
-        int i = 0;
-        for (; i < NEURONS+PSQT - 32; i += 32) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i b0 = _mm256_load_si256((__m256i*)&weight[i]);
-
-            __m256i a1 = _mm256_load_si256((__m256i*)&src[i+16]);
-            __m256i b1 = _mm256_load_si256((__m256i*)&weight[i+16]);
-
-
-            a0 = _mm256_sub_epi16(a0, b0);
-            a1 = _mm256_sub_epi16(a1, b1);
-
-            _mm256_store_si256((__m256i*)&dst[i], a0);
-            _mm256_store_si256((__m256i*)&dst[i+16], a1);
-        }
-        for (; i < NEURONS+PSQT; i += 16) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i b0 = _mm256_load_si256((__m256i*)&weight[i]);
-
-            _mm256_store_si256((__m256i*)&dst[i], _mm256_sub_epi16(a0, b0));
-        }
-        #else
-
-        for (int i = 0; i < NEURONS+PSQT; i += 16) {
-            __m128i a0 = _mm_load_si128((__m128i*)&src[i]);
-            __m128i b0 = _mm_load_si128((__m128i*)&weight[i]);
-
-            __m128i a1 = _mm_load_si128((__m128i*)&src[i+8]);
-            __m128i b1 = _mm_load_si128((__m128i*)&weight[i+8]);
-
-
-            a0 = _mm_sub_epi16(a0, b0);
-            a1 = _mm_sub_epi16(a1, b1);
-
-            _mm_store_si128((__m128i*)&dst[i], a0);
-            _mm_store_si128((__m128i*)&dst[i+8], a1);
-        }
-
-        #endif
-    }
-
-    void acculumator_addsub(int16_t *src, int16_t *dst, int add_index, int sub_index)
-    {
-        const int16_t* __restrict add_weight = &weights->weights[add_index*(NEURONS+PSQT)];
-        const int16_t* __restrict sub_weight = &weights->weights[sub_index*(NEURONS+PSQT)];
-
-        #if USE_AVX2
-
-        int i = 0;
-        for (; i < NEURONS+PSQT - 32; i += 32) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i a1 = _mm256_load_si256((__m256i*)&src[i+16]);
-
-            __m256i sub0 = _mm256_load_si256((__m256i*)&sub_weight[i]);
-            __m256i sub1 = _mm256_load_si256((__m256i*)&sub_weight[i+16]);
-
-            __m256i add0 = _mm256_load_si256((__m256i*)&add_weight[i]);
-            __m256i add1 = _mm256_load_si256((__m256i*)&add_weight[i+16]);
-
-            a0 = _mm256_add_epi16(_mm256_sub_epi16(a0, sub0), add0);
-            a1 = _mm256_add_epi16(_mm256_sub_epi16(a1, sub1), add1);
-
-            _mm256_store_si256((__m256i*)&dst[i], a0);
-            _mm256_store_si256((__m256i*)&dst[i+16], a1);
-        }
-
-        for (; i < NEURONS+PSQT; i += 16) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i sub0 = _mm256_load_si256((__m256i*)&sub_weight[i]);
-            __m256i add0 = _mm256_load_si256((__m256i*)&add_weight[i]);
-
-            _mm256_store_si256((__m256i*)&dst[i], _mm256_add_epi16(_mm256_sub_epi16(a0, sub0), add0));
-        }
-
-
-        #else
-
-        for (int i = 0; i < NEURONS+PSQT; i += 16) {
-            __m128i a0 = _mm_load_si128((__m128i*)&src[i]);
-            __m128i a1 = _mm_load_si128((__m128i*)&src[i+8]);
-
-            __m128i sub0 = _mm_load_si128((__m128i*)&sub_weight[i]);
-            __m128i sub1 = _mm_load_si128((__m128i*)&sub_weight[i+8]);
-
-            __m128i add0 = _mm_load_si128((__m128i*)&add_weight[i]);
-            __m128i add1 = _mm_load_si128((__m128i*)&add_weight[i+8]);
-
-            a0 = _mm_add_epi16(_mm_sub_epi16(a0, sub0), add0);
-            a1 = _mm_add_epi16(_mm_sub_epi16(a1, sub1), add1);
-
-            _mm_store_si128((__m128i*)&dst[i], a0);
-            _mm_store_si128((__m128i*)&dst[i+8], a1);
-        }
-
-        #endif // USE_AVX2
-    }
-
-    void acculumator_addsubsub(int16_t *src, int16_t *dst, int add_index, int sub_index0, int sub_index1)
-    {
-        const int16_t* __restrict add_weight = &weights->weights[add_index*(NEURONS+PSQT)];
-        const int16_t* __restrict sub_weight0 = &weights->weights[sub_index0*(NEURONS+PSQT)];
-        const int16_t* __restrict sub_weight1 = &weights->weights[sub_index1*(NEURONS+PSQT)];
-
-
-        #if USE_AVX2
-        int i = 0;
-        for (; i < NEURONS+PSQT - 32; i += 32) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i a1 = _mm256_load_si256((__m256i*)&src[i+16]);
-
-            __m256i sub00 = _mm256_load_si256((__m256i*)&sub_weight0[i]);
-            __m256i sub01 = _mm256_load_si256((__m256i*)&sub_weight0[i+16]);
-
-            __m256i sub10 = _mm256_load_si256((__m256i*)&sub_weight1[i]);
-            __m256i sub11 = _mm256_load_si256((__m256i*)&sub_weight1[i+16]);
-
-            __m256i add0 = _mm256_load_si256((__m256i*)&add_weight[i]);
-            __m256i add1 = _mm256_load_si256((__m256i*)&add_weight[i+16]);
-
-            a0 = _mm256_add_epi16(_mm256_sub_epi16(_mm256_sub_epi16(a0, sub00), sub10), add0);
-            a1 = _mm256_add_epi16(_mm256_sub_epi16(_mm256_sub_epi16(a1, sub01), sub11), add1);
-
-            _mm256_store_si256((__m256i*)&dst[i], a0);
-            _mm256_store_si256((__m256i*)&dst[i+16], a1);
-        }
-        for (; i < NEURONS+PSQT; i += 16) {
-            __m256i a0 = _mm256_load_si256((__m256i*)&src[i]);
-            __m256i sub00 = _mm256_load_si256((__m256i*)&sub_weight0[i]);
-            __m256i sub10 = _mm256_load_si256((__m256i*)&sub_weight1[i]);
-            __m256i add0 = _mm256_load_si256((__m256i*)&add_weight[i]);
-
-            _mm256_store_si256((__m256i*)&dst[i], _mm256_add_epi16(_mm256_sub_epi16(_mm256_sub_epi16(a0, sub00), sub10), add0));
-        }
-
-        #else
-
-        for (int i = 0; i < NEURONS+PSQT; i += 16) {
-            __m128i a0 = _mm_load_si128((__m128i*)&src[i]);
-            __m128i a1 = _mm_load_si128((__m128i*)&src[i+8]);
-
-            __m128i sub00 = _mm_load_si128((__m128i*)&sub_weight0[i]);
-            __m128i sub01 = _mm_load_si128((__m128i*)&sub_weight0[i+8]);
-
-            __m128i sub10 = _mm_load_si128((__m128i*)&sub_weight1[i]);
-            __m128i sub11 = _mm_load_si128((__m128i*)&sub_weight1[i+8]);
-
-            __m128i add0 = _mm_load_si128((__m128i*)&add_weight[i]);
-            __m128i add1 = _mm_load_si128((__m128i*)&add_weight[i+8]);
-
-            a0 = _mm_add_epi16(_mm_sub_epi16(_mm_sub_epi16(a0, sub00), sub10), add0);
-            a1 = _mm_add_epi16(_mm_sub_epi16(_mm_sub_epi16(a1, sub01), sub11), add1);
-
-            _mm_store_si128((__m128i*)&dst[i], a0);
-            _mm_store_si128((__m128i*)&dst[i+8], a1);
-        }
-
-        #endif
-    }
-
-
-    void apply_updates(acculumator_update_table *table, int16_t *src_acc)
-    {
-        if (table->fused == FU_ADDSUB) {
-            acculumator_addsub(src_acc, table->acculumator, table->updates[0]-1, -table->updates[1]-1);
-        } else if (table->fused == FU_ADDSUBSUB) {
-            acculumator_addsubsub(src_acc, table->acculumator, table->updates[0]-1, -table->updates[1]-1, -table->updates[2]-1);
-        } else {
-            for (int i = 0; i < table->num_of_updates; i++) {
-                int op = table->updates[i];
-                int index = std::abs(op)-1;
-
-                if (op > 0) {
-                    acculumator_add(src_acc, table->acculumator, index);
-                } else {
-                    acculumator_sub(src_acc, table->acculumator, index);
-                }
-                src_acc = table->acculumator;
-            }
-        }
-        table->clear(table->acculumator, true);
-    }
+    struct update_chain
+    {
+        const int16_t *weights;
+        int16_t *src;
+        acculumator_update_table *tables;
+        int length;
+    };
+
+    //Index of nearest table that is clean or waits for refresh. Acculumators after it are computed from it.
+    int find_chain_start()
+    {
+        int start = update_table_index;
+        while (update_tables[start].is_clean == false && update_tables[start].pending_refresh == false && start > 0) {
+            start--;
+        }
+        return start;
+    }
+
+    int count_pending_updates(int start)
+    {
+        int count = 0;
+        for (int i = start; i <= update_table_index; i++) {
+            count += update_tables[i].num_of_updates;
+        }
+        return count;
+    }
 
+    int get_update_table_index()
+    {
+        return update_table_index;
+    }
 
-    int apply_all_updates()
+    acculumator_update_table *get_update_table(int index)
+    {
+        return &update_tables[index];
+    }
+
+    //Collects update tables from last clean acculumator to current one. Returns true if chain contains refresh.
+    //Pending refresh at start of chain must be materialized before.
+    bool get_update_chain(update_chain &chain)
     {
         bool is_refresh = false;
 
-        int start = update_table_index;
-        while (update_tables[start].is_clean == false && start > 0) {
-            start--;
-        }
-        int16_t *prev_acculumator = update_tables[start].acculumator;
-
-        start += (update_tables[start].num_of_updates == 0);
+        int start = find_chain_start();
+
+        chain.weights = weights->weights;
+        chain.src = update_tables[start].acculumator;
+
+        start += (update_tables[start].num_of_updates == 0);
+
+        chain.tables = &update_tables[start];
+        chain.length = update_table_index - start + 1;
 
         for (int i = start; i <= update_table_index; i++) {
             is_refresh |= update_tables[i].refresh;
+        }
+        return is_refresh;
+    }
 
-            apply_updates(&update_tables[i], prev_acculumator);
-
-            prev_acculumator = update_tables[i].acculumator;
+    //Applies all chains in single pass over acculumator width. Tile of acculumator is kept in registers while
+    //updates of every ply are applied, so intermediate acculumators are stored once and never loaded back.
+    static void apply_update_chains(update_chain *chains, int num_of_chains)
+    {
+        constexpr int WIDTH = NEURONS+PSQT;
+
+        #if USE_AVX2
+        constexpr int TILE_REGS = 7;
+        constexpr int TILE = TILE_REGS*16;
+        static_assert(WIDTH % TILE == 0, "Acculumator width must be multiple of update tile");
+
+        for (int i = 0; i < WIDTH; i += TILE) {
+            for (int c = 0; c < num_of_chains; c++) {
+                const update_chain &chain = chains[c];
+
+                __m256i acc[TILE_REGS];
+                for (int r = 0; r < TILE_REGS; r++) {
+                    acc[r] = _mm256_load_si256((__m256i*)&chain.src[i + r*16]);
+                }
+                for (int t = 0; t < chain.length; t++) {
+                    const acculumator_update_table &table = chain.tables[t];
+                    for (int u = 0; u < table.num_of_updates; u++) {
+                        int op = table.updates[u];
+                        if (op > 0) {
+                            const int16_t* __restrict weight = &chain.weights[(op-1)*WIDTH + i];
+                            for (int r = 0; r < TILE_REGS; r++) {
+                                acc[r] = _mm256_add_epi16(acc[r], _mm256_load_si256((__m256i*)&weight[r*16]));
+                            }
+                        } else {
+                            const int16_t* __restrict weight = &chain.weights[(-op-1)*WIDTH + i];
+                            for (int r = 0; r < TILE_REGS; r++) {
+                                acc[r] = _mm256_sub_epi16(acc[r], _mm256_load_si256((__m256i*)&weight[r*16]));
+                            }
+                        }
+                    }
+                    for (int r = 0; r < TILE_REGS; r++) {
+                        _mm256_store_si256((__m256i*)&table.acculumator[i + r*16], acc[r]);
+                    }
+                }
+            }
         }
 
-        return is_refresh;
-    }
+        #else
+
+        constexpr int TILE_REGS = 7;
+        constexpr int TILE = TILE_REGS*8;
+        static_assert(WIDTH % TILE == 0, "Acculumator width must be multiple of update tile");
+
+        for (int i = 0; i < WIDTH; i += TILE) {
+            for (int c = 0; c < num_of_chains; c++) {
+                const update_chain &chain = chains[c];
+
+                __m128i acc[TILE_REGS];
+                for (int r = 0; r < TILE_REGS; r++) {
+                    acc[r] = _mm_load_si128((__m128i*)&chain.src[i + r*8]);
+                }
+                for (int t = 0; t < chain.length; t++) {
+                    const acculumator_update_table &table = chain.tables[t];
+                    for (int u = 0; u < table.num_of_updates; u++) {
+                        int op = table.updates[u];
+                        if (op > 0) {
+                            const int16_t* __restrict weight = &chain.weights[(op-1)*WIDTH + i];
+                            for (int r = 0; r < TILE_REGS; r++) {
+                                acc[r] = _mm_add_epi16(acc[r], _mm_load_si128((__m128i*)&weight[r*8]));
+                            }
+                        } else {
+                            const int16_t* __restrict weight = &chain.weights[(-op-1)*WIDTH + i];
+                            for (int r = 0; r < TILE_REGS; r++) {
+                                acc[r] = _mm_sub_epi16(acc[r], _mm_load_si128((__m128i*)&weight[r*8]));
+                            }
+                        }
+                    }
+                    for (int r = 0; r < TILE_REGS; r++) {
+                        _mm_store_si128((__m128i*)&table.acculumator[i + r*8], acc[r]);
+                    }
+                }
+            }
+        }
+
+        #endif // USE_AVX2
+
+        for (int c = 0; c < num_of_chains; c++) {
+            for (int t = 0; t < chains[c].length; t++) {
+                chains[c].tables[t].clear(chains[c].tables[t].acculumator, true);
+            }
+        }
+    }
+
+
+    //Updates both perspectives in same pass. Returns number of acculumators computed.
+    static int apply_all_updates(nnue_perspective &p0, nnue_perspective &p1, bool &p0_refresh, bool &p1_refresh)
+    {
+        update_chain chains[2];
+        p0_refresh = p0.get_update_chain(chains[0]);
+        p1_refresh = p1.get_update_chain(chains[1]);
+
+        apply_update_chains(chains, 2);
+
+        return chains[0].length + chains[1].length;
+    }
+
+    //Computes acculumators of several children from same parent. Parent tile is loaded once and updates of
+    //each child are applied on register copy of it.
+    void apply_sibling_updates(const int16_t *src, int16_t **dst, const int16_t **updates, const int *num_of_updates, int num_of_children)
+    {
+        constexpr int WIDTH = NEURONS+PSQT;
+        const int16_t *w = weights->weights;
+
+        #if USE_AVX2
+        constexpr int TILE_REGS = 7;
+        constexpr int TILE = TILE_REGS*16;
+        static_assert(WIDTH % TILE == 0, "Acculumator width must be multiple of update tile");
+
+        for (int i = 0; i < WIDTH; i += TILE) {
+            __m256i parent[TILE_REGS];
+            for (int r = 0; r < TILE_REGS; r++) {
+                parent[r] = _mm256_load_si256((__m256i*)&src[i + r*16]);
+            }
+            for (int c = 0; c < num_of_children; c++) {
+                __m256i acc[TILE_REGS];
+                for (int r = 0; r < TILE_REGS; r++) {
+                    acc[r] = parent[r];
+                }
+                for (int u = 0; u < num_of_updates[c]; u++) {
+                    int op = updates[c][u];
+                    if (op > 0) {
+                        const int16_t* __restrict weight = &w[(op-1)*WIDTH + i];
+                        for (int r = 0; r < TILE_REGS; r++) {
+                            acc[r] = _mm256_add_epi16(acc[r], _mm256_load_si256((__m256i*)&weight[r*16]));
+                        }
+                    } else {
+                        const int16_t* __restrict weight = &w[(-op-1)*WIDTH + i];
+                        for (int r = 0; r < TILE_REGS; r++) {
+                            acc[r] = _mm256_sub_epi16(acc[r], _mm256_load_si256((__m256i*)&weight[r*16]));
+                        }
+                    }
+                }
+                for (int r = 0; r < TILE_REGS; r++) {
+                    _mm256_store_si256((__m256i*)&dst[c][i + r*16], acc[r]);
+                }
+            }
+        }
+
+        #else
+
+        constexpr int TILE_REGS = 7;
+        constexpr int TILE = TILE_REGS*8;
+        static_assert(WIDTH % TILE == 0, "Acculumator width must be multiple of update tile");
+
+        for (int i = 0; i < WIDTH; i += TILE) {
+            __m128i parent[TILE_REGS];
+            for (int r = 0; r < TILE_REGS; r++) {
+                parent[r] = _mm_load_si128((__m128i*)&src[i + r*8]);
+            }
+            for (int c = 0; c < num_of_children; c++) {
+                __m128i acc[TILE_REGS];
+                for (int r = 0; r < TILE_REGS; r++) {
+                    acc[r] = parent[r];
+                }
+                for (int u = 0; u < num_of_updates[c]; u++) {
+                    int op = updates[c][u];
+                    if (op > 0) {
+                        const int16_t* __restrict weight = &w[(op-1)*WIDTH + i];
+                        for (int r = 0; r < TILE_REGS; r++) {
+                            acc[r] = _mm_add_epi16(acc[r], _mm_load_si128((__m128i*)&weight[r*8]));
+                        }
+                    } else {
+                        const int16_t* __restrict weight = &w[(-op-1)*WIDTH + i];
+                        for (int r = 0; r < TILE_REGS; r++) {
+                            acc[r] = _mm_sub_epi16(acc[r], _mm_load_si128((__m128i*)&weight[r*8]));
+                        }
+                    }
+                }
+                for (int r = 0; r < TILE_REGS; r++) {
+                    _mm_store_si128((__m128i*)&dst[c][i + r*8], acc[r]);
+                }
+            }
+        }
+
+        #endif // USE_AVX2
+    }
 
     void update_activations() {
         const int16_t* __restrict accul = (int16_t*)__builtin_assume_aligned(acculumator, 64);
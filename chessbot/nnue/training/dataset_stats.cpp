@@ -0,0 +1,409 @@
+#include "dataset_stats.hpp"
+#include "training_data.hpp"
+#include "../nnue_defs.hpp"
+#include "../../cache.hpp"
+#include "../../zobrist.hpp"
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <filesystem>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+
+void hyperloglog::merge(const hyperloglog &other)
+{
+    for (size_t i = 0; i < num_of_registers; i++) {
+        registers[i] = std::max(registers[i], other.registers[i]);
+    }
+}
+
+double hyperloglog::estimate() const
+{
+    double m = (double)num_of_registers;
+    double sum = 0;
+    size_t zeros = 0;
+
+    for (size_t i = 0; i < num_of_registers; i++) {
+        sum += std::ldexp(1.0, -registers[i]);
+        zeros += (registers[i] == 0);
+    }
+
+    double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double e = alpha * m * m / sum;
+
+    //Linear counting is more accurate for small sets
+    if (e <= 2.5 * m && zeros > 0) {
+        e = m * std::log(m / zeros);
+    }
+    return e;
+}
+
+
+
+count_min_sketch::count_min_sketch(size_t size_MB, uint64_t num_of_items)
+{
+    size_t max_counters = std::max(size_MB, (size_t)1) * 1024 * 1024 / sizeof(uint32_t);
+
+    shift = 64;
+    width = 1;
+    while (width * 2 * depth <= max_counters && width < 8 * num_of_items) {
+        width *= 2;
+        shift -= 1;
+    }
+
+    //Sketch is read at random, huge pages save most TLB misses
+    allocation_size = width * depth * sizeof(uint32_t);
+
+    mapped = false;
+
+#if USE_HUGEPAGES==1
+    void *memory = mmap(NULL, allocation_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        if (allocation_size > 4*1024*1024) {
+            madvise(memory, allocation_size, MADV_HUGEPAGE);
+        }
+        counters = static_cast<uint32_t*>(memory);
+        mapped = true;
+    }
+#endif
+
+    if (!mapped) {
+        counters = new uint32_t[width * depth]();
+    }
+}
+
+count_min_sketch::~count_min_sketch()
+{
+#if USE_HUGEPAGES==1
+    if (mapped) {
+        munmap(counters, allocation_size);
+        return;
+    }
+#endif
+    delete [] counters;
+}
+
+double count_min_sketch::get_collision_rate(uint64_t num_of_distinct_items) const
+{
+    return std::pow(1.0 - std::exp(-(double)num_of_distinct_items / width), depth);
+}
+
+uint32_t count_min_sketch::add(uint64_t hash)
+{
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < depth; row++) {
+        uint32_t count = __atomic_add_fetch(&counters[row * width + get_column(hash, row)], 1, __ATOMIC_RELAXED);
+        estimate = std::min(estimate, count);
+    }
+    return estimate;
+}
+
+
+
+//Zobrist hash of pieces and side to move, castling and en passant are ignored. King squares are found in the same pass
+static uint64_t get_position_hash(const training_position &pos, int &white_king_sq, int &black_king_sq)
+{
+    uint64_t h = (pos.get_turn() == WHITE ? 0 : hashgen.get_turn_hash());
+
+    uint64_t occ = pos.occupation;
+    int index = 0;
+    int sq_index;
+    for (int i = 0; i < pos.count_pieces(); i++) {
+        uint8_t p = pos.iterate_pieces(occ, index, sq_index);
+        h ^= hashgen.get_piece_hash(sq_index, p);
+
+        white_king_sq = (p == WHITE_KING ? sq_index : white_king_sq);
+        black_king_sq = (p == BLACK_KING ? sq_index : black_king_sq);
+    }
+    return h;
+}
+
+
+void dataset_stats::add_block(const training_position *block, size_t num, count_min_sketch &frequencies, uint32_t *frequencies_out)
+{
+    uint64_t hashes[block_size];
+    int white_king_squares[block_size];
+    int black_king_squares[block_size];
+
+    for (size_t i = 0; i < num; i++) {
+        white_king_squares[i] = 0;
+        black_king_squares[i] = 0;
+        hashes[i] = get_position_hash(block[i], white_king_squares[i], black_king_squares[i]);
+        frequencies.prefetch(hashes[i]);
+    }
+    for (size_t i = 0; i < num; i++) {
+        frequencies_out[i] = add(block[i], hashes[i], frequencies);
+
+        white_king_buckets[get_king_bucket(white_king_squares[i])]++;
+        black_king_buckets[get_king_bucket(black_king_squares[i] ^ 56)]++;
+    }
+}
+
+
+uint32_t dataset_stats::add(const training_position &pos, uint64_t hash, count_min_sketch &frequencies)
+{
+    distinct.add(hash);
+
+    uint32_t frequency = frequencies.add(hash);
+    for (int i = 0; i < num_of_repeat_levels; i++) {
+        repeated[i] += (frequency == repeat_levels[i]);
+    }
+    if (frequency > max_frequency) {
+        max_frequency = frequency;
+        most_frequent = pos;
+    }
+
+    positions++;
+    skipped += skip_position(pos);
+
+    float wdl = pos.get_wdl_relative_to_stm();
+    if (wdl == 1.0f) {
+        wins++;
+    } else if (wdl == 0.5f) {
+        draws++;
+    } else {
+        losses++;
+    }
+    white_to_move += (pos.get_turn() == WHITE);
+
+    piece_counts[std::min(pos.count_pieces(), max_pieces)]++;
+
+    return frequency;
+}
+
+
+void dataset_stats::merge(const dataset_stats &other)
+{
+    positions += other.positions;
+    skipped += other.skipped;
+    wins += other.wins;
+    draws += other.draws;
+    losses += other.losses;
+    white_to_move += other.white_to_move;
+
+    for (int i = 0; i <= max_pieces; i++) {
+        piece_counts[i] += other.piece_counts[i];
+    }
+    for (int i = 0; i < num_of_king_buckets; i++) {
+        white_king_buckets[i] += other.white_king_buckets[i];
+        black_king_buckets[i] += other.black_king_buckets[i];
+    }
+    for (int i = 0; i < num_of_repeat_levels; i++) {
+        repeated[i] += other.repeated[i];
+    }
+    if (other.max_frequency > max_frequency) {
+        max_frequency = other.max_frequency;
+        most_frequent = other.most_frequent;
+    }
+
+    distinct.merge(other.distinct);
+}
+
+
+void dataset_stats::print(const count_min_sketch &frequencies) const
+{
+    if (positions == 0) {
+        std::cout << "Empty dataset" << std::endl;
+        return;
+    }
+
+    auto percent = [this] (uint64_t n) {
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(2) << 100.0 * n / positions << "%";
+        return ss.str();
+    };
+
+    uint64_t distinct_positions = std::min((uint64_t)distinct.estimate(), positions);
+
+    std::cout << std::endl << "Positions: " << positions << std::endl;
+    std::cout << "Distinct positions: ~" << distinct_positions << "  duplicates: ~" << percent(positions - distinct_positions)
+              << "  (HyperLogLog, +-" << std::setprecision(2) << 104.0 / std::sqrt((double)hyperloglog::num_of_registers) << "%)" << std::endl;
+
+    //Count-min estimates overcount by at most e*N/width with 98% probability
+    std::cout << "Positions repeated";
+    for (int i = 0; i < num_of_repeat_levels; i++) {
+        std::cout << "  " << repeat_levels[i] << "+ times: ~" << repeated[i];
+    }
+    std::cout << "  (count-min, overcount <= " << (uint64_t)std::ceil(std::exp(1.0) * positions / frequencies.get_width()) << ")" << std::endl;
+    std::cout << "Most frequent: " << most_frequent.to_fen() << "  ~" << max_frequency << " times" << std::endl;
+
+    std::cout << "Results (side to move): W " << percent(wins) << "  D " << percent(draws) << "  L " << percent(losses) << std::endl;
+    std::cout << "White to move: " << percent(white_to_move) << std::endl;
+    std::cout << "Left out by skip_position: " << percent(skipped) << std::endl;
+
+    std::cout << std::endl << "Pieces  Positions" << std::endl;
+    for (int i = 0; i <= max_pieces; i++) {
+        if (piece_counts[i] > 0) {
+            std::cout << std::setw(6) << i << "  " << std::setw(8) << percent(piece_counts[i]) << std::endl;
+        }
+    }
+
+    std::cout << std::endl << "King bucket  White    Black" << std::endl;
+    for (int i = 0; i < num_of_king_buckets; i++) {
+        std::cout << std::setw(11) << i << "  " << std::setw(7) << percent(white_king_buckets[i])
+                  << "  " << std::setw(7) << percent(black_king_buckets[i]) << std::endl;
+    }
+}
+
+
+void dataset_stats::scan(const std::vector<std::string> &directories, const std::string &output_folder, uint32_t max_copies, size_t sketch_MB, int threads)
+{
+    bool write_copy = (output_folder != "");
+
+    if (write_copy) {
+        std::filesystem::create_directories(output_folder);
+        for (const std::string &directory : directories) {
+            std::error_code ec;
+            if (std::filesystem::equivalent(directory, output_folder, ec)) {
+                std::cout << "Error: output folder is one of the input folders" << std::endl;
+                return;
+            }
+        }
+    }
+
+    data_reader reader(directories);
+    reader.set_access_pattern(data_reader::ACCESS_SEQUENTIAL);
+
+    if (reader.get_num_of_chain_blocks() > 0) {
+        std::cout << "Chain shards are not scanned" << std::endl;
+    }
+
+    //Copies of shards from several directories are prefixed with directory index, shards of different directories
+    //may have the same name
+    std::vector<std::string> output_files;
+    if (write_copy) {
+        std::set<std::string> used_names;
+
+        for (size_t i = 0; i < reader.get_num_of_shards(); i++) {
+            std::filesystem::path shard_path(reader.get_shard_name(i));
+            std::string filename = shard_path.filename().string();
+
+            if (directories.size() > 1) {
+                for (size_t d = 0; d < directories.size(); d++) {
+                    if ((std::filesystem::path(directories[d]) / filename) == shard_path) {
+                        filename = std::to_string(d) + "_" + filename;
+                        break;
+                    }
+                }
+            }
+
+            if (!used_names.insert(filename).second) {
+                std::cout << "Error: shards " << reader.get_shard_name(i) << " and another input shard map to the same copy "
+                          << filename << ", is a directory given twice?" << std::endl;
+                return;
+            }
+            output_files.push_back(output_folder + "/" + filename);
+        }
+    }
+
+    //Ranges of shards are scanned in parallel, copies need whole shards
+    constexpr size_t range_size = 1 << 20;
+
+    struct work_item
+    {
+        size_t shard;
+        size_t first;
+        size_t last;
+    };
+    std::vector<work_item> work;
+
+    for (size_t i = 0; i < reader.get_num_of_shards(); i++) {
+        size_t shard_size = reader.get_shard<training_position>(i).size();
+        size_t step = (write_copy ? std::max(shard_size, (size_t)1) : range_size);
+        for (size_t first = 0; first < shard_size || (write_copy && first == 0); first += step) {
+            work.push_back({i, first, std::min(first + step, shard_size)});
+        }
+    }
+
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, std::max((int)work.size(), 1));
+
+    count_min_sketch frequencies(sketch_MB, reader.get_size<training_position>());
+    std::vector<dataset_stats> stats(threads);
+
+    std::atomic<size_t> next_item = 0;
+    std::atomic<size_t> items_done = 0;
+    std::atomic<size_t> bytes_done = 0;
+    std::atomic<uint64_t> kept = 0;
+
+    auto scan_items = [&] (dataset_stats &s) {
+        while (true) {
+            size_t item = next_item++;
+            if (item >= work.size()) {
+                break;
+            }
+            const work_item &w = work[item];
+            auto shard = reader.get_shard<training_position>(w.shard);
+
+            std::unique_ptr<training_data_writer> writer;
+            if (write_copy) {
+                writer = std::make_unique<training_data_writer>(output_files[w.shard]);
+            }
+
+            uint32_t block_frequencies[block_size];
+            for (size_t first = w.first; first < w.last; first += block_size) {
+                size_t n = std::min(block_size, w.last - first);
+                s.add_block(shard.first + first, n, frequencies, block_frequencies);
+
+                if (writer) {
+                    for (size_t i = 0; i < n; i++) {
+                        if (block_frequencies[i] <= max_copies) {
+                            writer->add(shard.first[first + i]);
+                        }
+                    }
+                }
+            }
+
+            if (writer) {
+                kept += writer->get_num_of_positions();
+                writer->close();
+            }
+
+            bytes_done += (w.last - w.first) * sizeof(training_position);
+            items_done++;
+        }
+    };
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(scan_items, std::ref(stats[i]));
+    }
+
+    auto report = [&] () {
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+        std::cout << "\rScanning " << items_done << "/" << work.size() << "  "
+                  << (size_t)(bytes_done / std::max(seconds, 1e-3) / (1024*1024)) << " MB/s   " << std::flush;
+    };
+
+    while (items_done < work.size()) {
+        report();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    dataset_stats total;
+    for (int i = 0; i < threads; i++) {
+        workers[i].join();
+        total.merge(stats[i]);
+    }
+    report();
+    std::cout << std::endl;
+
+    total.print(frequencies);
+
+    if (write_copy) {
+        std::cout << std::endl << "Copy in " << output_folder << ": " << kept << " positions, at most " << max_copies
+                  << " of each  (" << std::fixed << std::setprecision(2) << 100.0 * kept / std::max(total.positions, (uint64_t)1) << "% kept)" << std::endl;
+
+        //Sketch collisions make some positions look seen before they are
+        std::cout << "Positions dropped by sketch collisions: <" << std::setprecision(3)
+                  << 100.0 * frequencies.get_collision_rate((uint64_t)total.distinct.estimate()) << "%" << std::endl;
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "training_position.hpp"
+
+
+//Distinct count estimate of 64 bit hashes, standard error 1.04/sqrt(2^precision)
+struct hyperloglog
+{
+    static constexpr int precision = 16;
+    static constexpr size_t num_of_registers = size_t(1) << precision;
+
+    hyperloglog() : registers(num_of_registers, 0) {}
+
+    void add(uint64_t hash) {
+        uint8_t &r = registers[hash >> (64 - precision)];
+        uint8_t rank = __builtin_clzll((hash << precision) | (uint64_t(1) << (precision - 1))) + 1;
+        r = std::max(r, rank);
+    }
+
+    void merge(const hyperloglog &other);
+
+    double estimate() const;
+
+private:
+    std::vector<uint8_t> registers;
+};
+
+
+//Shared frequency estimate of 64 bit hashes. Threads update it with relaxed atomics, estimates never undercount
+struct count_min_sketch
+{
+    static constexpr int depth = 4;
+
+    //Width is 8 counters per item, limited by size_MB
+    count_min_sketch(size_t size_MB, uint64_t num_of_items);
+    ~count_min_sketch();
+
+    count_min_sketch(const count_min_sketch&) = delete;
+    count_min_sketch &operator=(const count_min_sketch&) = delete;
+
+    //Returns frequency estimate including this occurrence
+    uint32_t add(uint64_t hash);
+
+    void prefetch(uint64_t hash) const {
+        for (int row = 0; row < depth; row++) {
+            __builtin_prefetch(&counters[row * width + get_column(hash, row)]);
+        }
+    }
+
+    size_t get_width() const {
+        return width;
+    }
+
+    //Chance that an item not seen before gets estimate above zero
+    double get_collision_rate(uint64_t num_of_distinct_items) const;
+
+private:
+    size_t get_column(uint64_t hash, int row) const {
+        //Rows use different multipliers, zobrist hashes are already uniform
+        static constexpr uint64_t multipliers[depth] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL};
+        return (shift < 64 ? (hash * multipliers[row]) >> shift : 0);
+    }
+
+    size_t width;
+    int shift;
+
+    uint32_t *counters;
+    size_t allocation_size;
+    bool mapped;  //Huge page mapping, otherwise heap array
+};
+
+
+//Counts of one pass over .bin shards
+struct dataset_stats
+{
+    static constexpr int num_of_king_buckets = 16;
+    static constexpr int max_pieces = 32;
+
+    uint64_t positions = 0;
+    uint64_t skipped = 0;
+
+    //Relative to side to move
+    uint64_t wins = 0;
+    uint64_t draws = 0;
+    uint64_t losses = 0;
+    uint64_t white_to_move = 0;
+
+    uint64_t piece_counts[max_pieces + 1] = {};
+
+    //Black king is mirrored, same as the network's king buckets
+    uint64_t white_king_buckets[num_of_king_buckets] = {};
+    uint64_t black_king_buckets[num_of_king_buckets] = {};
+
+    //Distinct positions seen at least 2, 16 and 256 times
+    static constexpr int num_of_repeat_levels = 3;
+    static constexpr uint32_t repeat_levels[num_of_repeat_levels] = {2, 16, 256};
+    uint64_t repeated[num_of_repeat_levels] = {};
+
+    //Most frequent position
+    uint32_t max_frequency = 0;
+    training_position most_frequent;
+
+    hyperloglog distinct;
+
+    //Counts up to block_size positions and returns their frequency estimates. Hashes and sketch prefetches of the
+    //whole block are issued first, so sketch misses overlap
+    static constexpr size_t block_size = 64;
+    void add_block(const training_position *block, size_t num, count_min_sketch &frequencies, uint32_t *frequencies_out);
+
+    void merge(const dataset_stats &other);
+
+    void print(const count_min_sketch &frequencies) const;
+
+    //Scans .bin shards of directories. With output folder, every shard is copied there with positions seen more
+    //than max_copies times left out. Sketch false positives drop some unique positions from the copy.
+    static void scan(const std::vector<std::string> &directories, const std::string &output_folder = "", uint32_t max_copies = 1,
+                     size_t sketch_MB = 1024, int threads = 0);
+
+private:
+    uint32_t add(const training_position &pos, uint64_t hash, count_min_sketch &frequencies);
+};
@@ -1,5 +1,6 @@
 #include "training.hpp"
 #include "training_nnue.hpp"
+#include "training_checkpoint.hpp"
 #include <memory>
 #include <math.h>
 #include <condition_variable>
@@ -8,6 +9,11 @@
 #include <random>
 #include "../nnue.hpp"
 #include <iomanip>
+#include <filesystem>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 
 
@@ -28,6 +34,9 @@ struct trainer_params
     bool enable_position_skipping;
 
     float learning_rate_decay;
+
+    //Steps between checkpoints, checkpoint is also saved with net at end of every epoch
+    int checkpoint_interval;
 };
 
 
@@ -141,35 +150,46 @@ void loss(float pred, float target, float &loss, float &loss_delta)
     loss_delta = exponent * s * std::pow(d, exponent - 1.0f);
 }
 
-bool skip_position(training_position &pos)
+
+//Step when each perspective weight row was last updated. Row is owned by worker (input % pool size), so workers
+//don't need locking when updating rows.
+struct perspective_row_state
+{
+    perspective_row_state(): last_step(num_of_rows, 0) {}
+
+    static constexpr int num_of_rows = num_perspective_inputs + factorizer_inputs;
+
+    std::vector<int> last_step;
+};
+
+
+size_t get_resident_memory()
 {
-    constexpr int max_eval_error = 200;
+    size_t resident_pages = 0;
 
-    int32_t eval = pos.eval;
-    float wdl = pos.get_wdl_relative_to_stm();
+    #ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t total_pages;
+    statm >> total_pages >> resident_pages;
 
-    return ((eval > max_eval_error && wdl < 0.25f) ||
-            (eval < -max_eval_error && wdl > 0.75f));
+    return resident_pages * sysconf(_SC_PAGESIZE);
+    #else
+    return resident_pages;
+    #endif
 }
 
 
-enum worker_operation {WORK_BACKPROP, WORK_GRAD_CALC, WORK_RMSPROP};
+enum worker_operation {WORK_BACKPROP, WORK_REDUCE};
 struct optimizer_worker
 {
     optimizer_worker(std::shared_ptr<training_weights> weights,
-                      std::shared_ptr<training_weights> g,
-                      std::shared_ptr<training_weights> g_sq,
-                      std::shared_ptr<training_weights> m0,
-                      std::shared_ptr<training_weights> m1,
-                      std::shared_ptr<training_weights> cm0,
-                      std::shared_ptr<training_weights> cm1, int tid, int tc) :
+                      std::shared_ptr<training_moments> m0,
+                      std::shared_ptr<training_moments> m1,
+                      std::shared_ptr<perspective_row_state> rs, int tid, int tc) :
                       net(weights),
-                      gradient(g),
-                      gradient_sq(g_sq),
                       first_moment(m0),
                       second_moment(m1),
-                      corrected_first_moment(cm0),
-                      corrected_second_moment(cm1)
+                      row_state(rs)
     {
         thread_id = tid;
         pool_size = tc;
@@ -179,25 +199,32 @@ struct optimizer_worker
         cost = 0;
         non_skipped_positions = 0;
 
+        forward_time = 0.0;
+        backward_time = 0.0;
+        reduce_time = 0.0;
+
         t = std::thread(&optimizer_worker::thread_entry, this);
     }
 
     ~optimizer_worker()
     {
+        //Wake thread so it sees the flag instead of waiting for next operation
         running = false;
+        begin_signal.signal();
         t.join();
     }
 
     void thread_entry() {
-        while (running) {
+        while (true) {
             thread_wait();
+            if (!running) {
+                break;
+            }
 
             if (operation == WORK_BACKPROP) {
                 do_backprop();
-            } else if (operation == WORK_GRAD_CALC) {
-                do_grad_calc();
-            } else if (operation == WORK_RMSPROP) {
-                do_rmsprop();
+            } else if (operation == WORK_REDUCE) {
+                do_reduce();
             }
 
             thread_signal_ready();
@@ -219,20 +246,14 @@ struct optimizer_worker
         begin_signal.signal();
     }
 
-    void start_grad_calc(std::vector<training_weights*> grads, int t)
+    void start_reduce(std::vector<training_gradients*> grads, int t)
     {
-        operation = WORK_GRAD_CALC;
+        operation = WORK_REDUCE;
         grads_to_add = grads;
         step = t;
         begin_signal.signal();
     }
 
-    void start_rmsprop()
-    {
-        operation = WORK_RMSPROP;
-        begin_signal.signal();
-    }
-
 
     void wait() {
         finish_signal.wait();
@@ -243,11 +264,16 @@ struct optimizer_worker
     float cost;
     size_t non_skipped_positions;
 
-    training_weights backprop_gradient;
+    //Seconds spent in each part of last step
+    double forward_time;
+    double backward_time;
+    double reduce_time;
+
+    training_gradients backprop_gradient;
 private:
     training_network net;
 
-    std::vector<training_weights*> grads_to_add;
+    std::vector<training_gradients*> grads_to_add;
 
     trainer_params params;
 
@@ -262,14 +288,10 @@ private:
     semaphore begin_signal;
     semaphore finish_signal;
 
-    std::shared_ptr<training_weights> gradient;
-    std::shared_ptr<training_weights> gradient_sq;
-
-    std::shared_ptr<training_weights> first_moment;
-    std::shared_ptr<training_weights> second_moment;
+    std::shared_ptr<training_moments> first_moment;
+    std::shared_ptr<training_moments> second_moment;
 
-    std::shared_ptr<training_weights> corrected_first_moment;
-    std::shared_ptr<training_weights> corrected_second_moment;
+    std::shared_ptr<perspective_row_state> row_state;
 
     void thread_wait()
     {
@@ -287,12 +309,18 @@ private:
 
         backprop_gradient.zero();
 
+        //Weights were updated since last batch
+        net.invalidate_acculumators();
+
         cost = 0;
         non_skipped_positions = 0;
 
         psqt_portion = 0.0f;
         ff_sparsity = 0.0f;
 
+        forward_time = 0.0;
+        backward_time = 0.0;
+
         int per_thread = params.batch_size / pool_size;
         int start = per_thread * thread_id;
 
@@ -301,10 +329,6 @@ private:
         for (size_t i = start; i < start + per_thread; i++) {
             training_position sample = batch[i];
 
-            if (params.enable_position_skipping && skip_position(sample)) {
-                continue;
-            }
-
             non_skipped_positions += 1;
 
             float num_of_pieces = pop_count(sample.occupation);
@@ -314,7 +338,10 @@ private:
 
             float result = sample.get_wdl_relative_to_stm();
 
+            auto t0 = std::chrono::steady_clock::now();
             float pred_p = net.evaluate(sample);
+            forward_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
             float eval_p = static_cast<float>(sample.eval) / 100.0f;
 
             float pred = sigmoid(pred_p / 4.0f);
@@ -353,7 +380,9 @@ private:
                 continue;
             }
 
+            auto t1 = std::chrono::steady_clock::now();
             net.back_propagate(backprop_gradient, loss_delta*sigmoid_delta, sample.get_turn(), params.freeze_perspective);
+            backward_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
 
             cost += loss;
         }
@@ -364,34 +393,82 @@ private:
         backprop_gradient.divide(non_skipped_positions*pool_size);
     }
 
-    void do_grad_calc()
+    //Each worker reduces gradients of its own shard of parameters and updates them right away, so summed gradient
+    //and bias corrected moments are never stored.
+    void do_reduce()
     {
-        gradient->zero(thread_id, pool_size);
-        for (int i = 0; i < grads_to_add.size(); i++) {
-            gradient->add(*grads_to_add[i], thread_id, pool_size);
+        auto t0 = std::chrono::steady_clock::now();
+
+        adam_step_params p;
+        p.beta1 = params.beta1;
+        p.beta2 = params.beta2;
+        p.m_correction = 1.0f / (1.0f - std::pow(params.beta1, step));
+        p.v_correction = 1.0f / (1.0f - std::pow(params.beta2, step));
+        p.learning_rate = params.learning_rate;
+        p.weight_decay = params.weight_decay;
+        p.rounding_seed = rounding_noise(step, 0x9e3779b9);
+
+        reduce_layer(&training_weights::output_weights, &training_moments::output_weights, &training_gradients::output_weights, p, true);
+        reduce_layer(&training_weights::layer2_weights, &training_moments::layer2_weights, &training_gradients::layer2_weights, p, true);
+        reduce_layer(&training_weights::layer1_weights, &training_moments::layer1_weights, &training_gradients::layer1_weights, p, !params.freeze_l1_weights);
+
+        if (!params.freeze_perspective) {
+            reduce_perspective(p);
         }
 
-        gradient_sq->squared(*gradient, thread_id, pool_size);
+        reduce_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
 
-        first_moment->exponential_smoothing(*gradient, params.beta1, thread_id, pool_size);
-        second_moment->exponential_smoothing(*gradient_sq, params.beta2, thread_id, pool_size);
+    template <typename T>
+    void reduce_layer(T training_weights::*layer, typename T::moments training_moments::*moment_layer, T training_gradients::*grad_layer,
+                      const adam_step_params &p, bool update_weights)
+    {
+        std::vector<const T*> grads;
+        for (size_t i = 0; i < grads_to_add.size(); i++) {
+            grads.push_back(&(grads_to_add[i]->*grad_layer));
+        }
 
-        corrected_first_moment->mult(*first_moment, 1.0f / (1.0f - std::pow(params.beta1, step)), thread_id, pool_size);
-        corrected_second_moment->mult(*second_moment, 1.0f / (1.0f - std::pow(params.beta2, step)), thread_id, pool_size);
+        ((*net.weights).*layer).adam_update(grads, &((*first_moment).*moment_layer), &((*second_moment).*moment_layer), p, update_weights, thread_id, pool_size);
     }
 
-    void do_rmsprop()
+    //Only rows active in batch are visited. Row is summed from workers which have it and updated lazily.
+    void reduce_perspective(const adam_step_params &p)
     {
-        net.weights->output_weights.rmsprop(&corrected_first_moment->output_weights, &corrected_second_moment->output_weights, params.learning_rate, params.weight_decay, thread_id, pool_size);
+        std::vector<const float*> row_grads;
+
+        for (size_t i = 0; i < grads_to_add.size(); i++) {
+            const auto &src = grads_to_add[i]->perspective_weights;
 
-        net.weights->layer2_weights.rmsprop(&corrected_first_moment->layer2_weights, &corrected_second_moment->layer2_weights, params.learning_rate, params.weight_decay, thread_id, pool_size);
+            for (int slot = 0; slot < src.num_of_rows; slot++) {
+                int row = src.rows[slot];
+                if (row % pool_size != thread_id || row_state->last_step[row] == step) {
+                    continue;
+                }
+
+                //Workers before this one don't have the row, otherwise it would be updated already
+                row_grads.clear();
+                for (size_t j = i; j < grads_to_add.size(); j++) {
+                    const float *grad = grads_to_add[j]->perspective_weights.find_row(row);
+                    if (grad) {
+                        row_grads.push_back(grad);
+                    }
+                }
+
+                int skipped_steps = (row_state->last_step[row] == 0 ? 0 : step - row_state->last_step[row] - 1);
 
-        if (!params.freeze_l1_weights) {
-            net.weights->layer1_weights.rmsprop(&corrected_first_moment->layer1_weights, &corrected_second_moment->layer1_weights, params.learning_rate, params.weight_decay, thread_id, pool_size);
+                net.weights->perspective_weights.adam_update_row(row, row_grads.data(), row_grads.size(),
+                                                                 &first_moment->perspective_weights, &second_moment->perspective_weights, skipped_steps, p);
+
+                row_state->last_step[row] = step;
+            }
         }
 
-        if (!params.freeze_perspective) {
-            net.weights->perspective_weights.rmsprop(&corrected_first_moment->perspective_weights, &corrected_second_moment->perspective_weights, params.learning_rate, params.weight_decay, thread_id, pool_size);
+        if (thread_id == 0) {
+            row_grads.clear();
+            for (size_t i = 0; i < grads_to_add.size(); i++) {
+                row_grads.push_back(grads_to_add[i]->perspective_weights.biases);
+            }
+            net.weights->perspective_weights.adam_update_biases(row_grads.data(), row_grads.size(), &first_moment->perspective_weights, &second_moment->perspective_weights, p);
         }
     }
 
@@ -401,19 +478,35 @@ private:
 };
 
 
+//Accumulated over steps. Worker times are summed over workers, phase times are wall time including barrier waits.
+struct optimizer_timings
+{
+    double forward;
+    double backward;
+    double reduce;
+
+    double backprop_phase;
+    double reduce_phase;
+
+    void reset() {
+        forward = backward = reduce = 0.0;
+        backprop_phase = reduce_phase = 0.0;
+    }
+};
+
+
 struct optimizer
 {
     optimizer(int num_of_workers,   std::shared_ptr<training_weights> weights,
-                                    std::shared_ptr<training_weights> gradient,
-                                    std::shared_ptr<training_weights> gradient_sq,
-                                    std::shared_ptr<training_weights> first_moment,
-                                    std::shared_ptr<training_weights> second_moment,
-                                    std::shared_ptr<training_weights> corrected_first_moment,
-                                    std::shared_ptr<training_weights> corrected_second_moment) {
+                                    std::shared_ptr<training_moments> first_moment,
+                                    std::shared_ptr<training_moments> second_moment) {
+        row_state = std::make_shared<perspective_row_state>();
+
         for (int i = 0; i < num_of_workers; i++) {
-            workers.push_back(new optimizer_worker(weights, gradient, gradient_sq, first_moment, second_moment, corrected_first_moment, corrected_second_moment, i, num_of_workers));
+            workers.push_back(new optimizer_worker(weights, first_moment, second_moment, row_state, i, num_of_workers));
         }
         steps = 0;
+        timings.reset();
     }
 
     ~optimizer()
@@ -433,9 +526,11 @@ struct optimizer
         ff_sparsity = 0;
         steps++;
 
+        auto t0 = std::chrono::steady_clock::now();
+
         std::for_each(workers.begin(), workers.end(), [&] (auto p) {p->set_params(params); });
         std::for_each(workers.begin(), workers.end(), [&] (auto p) {p->start_backprop(batch); });
-        std::vector<training_weights*> grads_to_add;
+        std::vector<training_gradients*> grads_to_add;
         for (size_t i = 0; i < workers.size(); i++) {
             workers[i]->wait();
 
@@ -445,23 +540,58 @@ struct optimizer
             non_skipped_positions += workers[i]->non_skipped_positions;
             psqt_portion += workers[i]->psqt_portion / workers.size();
             ff_sparsity += workers[i]->ff_sparsity / workers.size();
+
+            timings.forward += workers[i]->forward_time;
+            timings.backward += workers[i]->backward_time;
         }
         avg_cost /= non_skipped_positions;
 
-        std::for_each(workers.begin(), workers.end(), [&] (auto p) {p->start_grad_calc(grads_to_add, steps);});
-        std::for_each(workers.begin(), workers.end(), [] (auto p) {p->wait();});
-        std::for_each(workers.begin(), workers.end(), [] (auto p) {p->start_rmsprop();});
-        std::for_each(workers.begin(), workers.end(), [] (auto p) {p->wait();});
+        auto t1 = std::chrono::steady_clock::now();
+
+        std::for_each(workers.begin(), workers.end(), [&] (auto p) {p->start_reduce(grads_to_add, steps);});
+        std::for_each(workers.begin(), workers.end(), [&] (auto p) {p->wait(); timings.reduce += p->reduce_time;});
+
+        auto t2 = std::chrono::steady_clock::now();
+        timings.backprop_phase += std::chrono::duration<double>(t1 - t0).count();
+        timings.reduce_phase += std::chrono::duration<double>(t2 - t1).count();
 
         return non_skipped_positions;
     }
 
+    optimizer_timings &get_timings() {
+        return timings;
+    }
+
     int get_pool_size() {
         return workers.size();
     }
+
+    int get_steps() {
+        return steps;
+    }
+
+    void set_steps(int t) {
+        steps = t;
+    }
+
+    //Step when each perspective row was last updated, part of optimizer state
+    std::vector<int> &get_row_steps() {
+        return row_state->last_step;
+    }
+
+    //Memory of worker gradients used in last step
+    size_t gradient_memory_usage() {
+        size_t bytes = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            bytes += workers[i]->backprop_gradient.memory_usage();
+        }
+        return bytes;
+    }
 private:
     std::vector<optimizer_worker*> workers;
+    std::shared_ptr<perspective_row_state> row_state;
     int steps;
+    optimizer_timings timings;
 };
 
 void nnue_trainer::test_nets(std::string training_net_file, std::string quantized_net_file, const std::string &pgn_dataset)
@@ -613,20 +743,20 @@ void training_loop(std::string net_file, std::string qnet_file, std::shared_ptr<
     std::srand(time(NULL));
 
 
-    std::shared_ptr<training_weights> gradient = std::make_shared<training_weights>();
-    std::shared_ptr<training_weights> gradient_sq = std::make_shared<training_weights>();
-
-    std::shared_ptr<training_weights> first_moment = std::make_shared<training_weights>();
-    std::shared_ptr<training_weights> second_moment = std::make_shared<training_weights>();
-
-    std::shared_ptr<training_weights> corrected_first_moment = std::make_shared<training_weights>();
-    std::shared_ptr<training_weights> corrected_second_moment  = std::make_shared<training_weights>();
-
+    std::shared_ptr<training_moments> first_moment = std::make_shared<training_moments>();
+    std::shared_ptr<training_moments> second_moment = std::make_shared<training_moments>();
 
     first_moment->zero();
     second_moment->zero();
 
-    optimizer opt(8, weights, gradient, gradient_sq, first_moment, second_moment, corrected_first_moment, corrected_second_moment);
+    optimizer opt(8, weights, first_moment, second_moment);
+
+    constexpr size_t MB = 1024*1024;
+
+    std::cout << "Weights: " << weights->memory_usage() / MB << "MB" << std::endl;
+    std::cout << "Moments: " << 2*first_moment->memory_usage() / MB << "MB (" << (USE_BF16_MOMENTS ? "bf16" : "float") << ")" << std::endl;
+    std::cout << "Worker gradients: " << opt.gradient_memory_usage() / MB << "MB (grows with active inputs)" << std::endl;
+    std::cout << "Resident memory: " << get_resident_memory() / MB << "MB" << std::endl;
 
 
     trainer_params params;
@@ -648,6 +778,37 @@ void training_loop(std::string net_file, std::string qnet_file, std::shared_ptr<
 
     params.learning_rate_decay = 0.99f;
 
+    params.checkpoint_interval = 1000;
+
+    //Checkpoint is kept next to training net, run continues from it after restart
+    std::string checkpoint_file = net_file + ".ckpt";
+
+    training_progress progress;
+    progress.num_of_workers = opt.get_pool_size();
+    progress.step = 0;
+    progress.data_seed = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+    progress.next_batch = 0;
+    progress.learning_rate = params.learning_rate;
+    progress.training_cost = 0.0f;
+
+    if (std::filesystem::exists(checkpoint_file)) {
+        //Failed load leaves weights partially overwritten
+        if (!load_checkpoint(checkpoint_file, progress, *weights, *first_moment, *second_moment, opt.get_row_steps())) {
+            std::cout << "Training stopped, move or delete " << checkpoint_file << " to start without it" << std::endl;
+            return;
+        }
+        std::cout << "Resuming from " << checkpoint_file << " at step " << progress.step << std::endl;
+
+        if (progress.num_of_workers != (uint32_t)opt.get_pool_size()) {
+            std::cout << "Warning: checkpoint was saved with " << progress.num_of_workers << " workers, resumed run won't be bit exact" << std::endl;
+        }
+
+        opt.set_steps(progress.step);
+        params.learning_rate = progress.learning_rate;
+    }
+
+    checkpoint_writer checkpoints(checkpoint_file);
+
     std::cout << std::endl;
     std::cout << "Dataset size: " << dataset->get_size<training_position>() / (1000*1000) << "M" << std::endl;
     std::cout << "Beta1: " << params.beta1 << std::endl;
@@ -660,20 +821,29 @@ void training_loop(std::string net_file, std::string qnet_file, std::shared_ptr<
     std::cout << "Batch size: " << params.batch_size << std::endl;
     std::cout << "Epoch size: " << params.epoch_size << std::endl;
     std::cout << "Threads: " << opt.get_pool_size() << std::endl;
+    std::cout << "Training kernels: " << training_kernels_name() << std::endl;
     std::cout << "Enable position skipping: " << params.enable_position_skipping << std::endl;
     std::cout << "Freeze perspective weights: " << params.freeze_perspective << std::endl;
-    std::cout << "Freeze L1 weights: " << params.freeze_l1_weights << std::endl << std::endl;
+    std::cout << "Freeze L1 weights: " << params.freeze_l1_weights << std::endl;
+    std::cout << "Checkpoint interval: " << params.checkpoint_interval << std::endl << std::endl;
 
-    training_batch_manager batch_manager(params.batch_size, params.epoch_size, dataset);
+    training_batch_manager batch_manager(params.batch_size, params.epoch_size, dataset, params.enable_position_skipping,
+                                         progress.data_seed, progress.next_batch);
+
+    std::cout << "Batch queue: " << batch_manager.get_memory_usage() / MB << "MB" << std::endl;
+    std::cout << "Checkpoint buffer: " << checkpoints.memory_usage() / MB << "MB" << std::endl;
 
     auto t0 = std::chrono::high_resolution_clock::now();
 
     float batch_cost;
-    float training_cost = 0.0f;
+    float training_cost = progress.training_cost;
     float psqt_portion, ff_sparsity;
 
-    int epoch = 0;
+    size_t epoch = batch_manager.get_epochs();
     size_t non_skipped_positions;
+    size_t trained_positions = 0;
+
+    auto training_start = std::chrono::high_resolution_clock::now();
 
     while (true) {
         auto t1 = std::chrono::high_resolution_clock::now();
@@ -682,7 +852,8 @@ void training_loop(std::string net_file, std::string qnet_file, std::shared_ptr<
 
         batch_manager.load_new_batch();
 
-        if (batch_manager.get_epochs() != epoch) {
+        bool new_epoch = (batch_manager.get_epochs() != epoch);
+        if (new_epoch) {
             epoch = batch_manager.get_epochs();
 
             weights->save_file(net_file);
@@ -701,14 +872,33 @@ void training_loop(std::string net_file, std::string qnet_file, std::shared_ptr<
             training_cost = training_cost * 0.99f + batch_cost * 0.01f;
         }
 
+        if (new_epoch || opt.get_steps() % params.checkpoint_interval == 0) {
+            progress.step = opt.get_steps();
+            progress.next_batch = batch_manager.get_next_batch();
+            progress.learning_rate = params.learning_rate;
+            progress.training_cost = training_cost;
+
+            checkpoints.write(progress, *weights, *first_moment, *second_moment, opt.get_row_steps());
+        }
+
         float kspers = std::clamp((float)non_skipped_positions / ms.count(), 0.0f, 9999.0f);
 
+        double training_time = std::chrono::duration<double>(t1 - training_start).count();
+
+        //Average since start, includes time spent saving nets and waiting for data
+        trained_positions += non_skipped_positions;
+        double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - training_start).count();
+        float avg_kspers = trained_positions / (1000.0 * elapsed);
+        float data_wait = training_time > 0.0 ? 100.0 * batch_manager.get_data_wait_time() / training_time : 0.0;
+
         std::cout << "\rTrC: " << std::setprecision(6) << std::left << std::setw(12) << training_cost
                   << "   BC: "  << std::left << std::setw(12) << batch_cost
-                  << "   Speed: " << std::right << std::setw(4) << (int)kspers << " KPos/s    "
+                  << "   Speed: " << std::right << std::setw(4) << (int)kspers << " KPos/s"
+                  << " (avg " << std::setw(4) << (int)avg_kspers << ")    "
                   << "   Epoch: " << batch_manager.get_epochs()
                   << " (" << std::setprecision(3) << std::setw(4) << std::right << (float)batch_manager.get_current_batch_number()*100.0f / batch_manager.get_number_of_batches() << "%)   "
-                  << "PSQT: " << psqt_portion << "  FF sparsity: " << ff_sparsity << "   " << std::flush;
+                  << "PSQT: " << psqt_portion << "  FF sparsity: " << ff_sparsity
+                  << "  Data wait: " << std::setprecision(2) << data_wait << "%   " << std::flush;
     }
 
 }
@@ -718,6 +908,11 @@ void nnue_trainer::train(std::string net_file, std::string qnet_file, std::vecto
 {
     std::shared_ptr<data_reader> reader = std::make_shared<data_reader>(selfplay_directories);
 
+    if (reader->get_size<training_position>() + reader->get_num_of_chain_positions() == 0) {
+        std::cout << "Error: no training positions found, training stopped" << std::endl;
+        return;
+    }
+
     std::shared_ptr<training_weights> weights = std::make_shared<training_weights>();
 
     init_weights(*weights, true);
@@ -727,6 +922,162 @@ void nnue_trainer::train(std::string net_file, std::string qnet_file, std::vecto
 }
 
 
+//Random game positions with random labels, enough to measure speed without a dataset
+static std::vector<training_position> generate_benchmark_positions(size_t count)
+{
+    std::vector<training_position> positions;
+    positions.reserve(count);
+
+    std::mt19937 gen(1);
+    std::normal_distribution<float> eval_dist(0.0f, 300.0f);
+
+    board_state state;
+    while (positions.size() < count) {
+        state.set_initial_state();
+        float wdl = (gen() % 3) * 0.5f;
+
+        for (int ply = 0; ply < 160 && positions.size() < count; ply++) {
+            std::vector<chess_move> moves = state.get_all_legal_moves(state.get_turn());
+            if (moves.empty()) {
+                break;
+            }
+            chess_move move = moves[gen() % moves.size()];
+            if (ply >= 8) {
+                positions.emplace_back(state, move, (int32_t)eval_dist(gen), wdl);
+            }
+            state.make_move(move);
+        }
+    }
+    return positions;
+}
+
+
+void nnue_trainer::benchmark(std::vector<std::string> dataset_directories, int steps, int max_threads)
+{
+    constexpr int batch_size = 32000;
+    constexpr int warmup_steps = 2;
+
+    std::shared_ptr<data_reader> reader;
+    std::vector<training_position> synthetic;
+
+    if (!dataset_directories.empty()) {
+        reader = std::make_shared<data_reader>(dataset_directories);
+        if (reader->get_size<training_position>() + reader->get_num_of_chain_positions() < (size_t)batch_size) {
+            std::cout << "Not enough training data for benchmark" << std::endl;
+            return;
+        }
+    } else {
+        std::cout << "No dataset given, using synthetic positions" << std::endl;
+        synthetic = generate_benchmark_positions(batch_size*4);
+    }
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::cout << "Training kernels: " << training_kernels_name() << std::endl;
+    std::cout << "Batch size: " << batch_size << "  Steps: " << steps << " (+" << warmup_steps << " warmup)" << std::endl;
+    std::cout << "Phase columns are KPos/s of phase alone, Data is share of time waiting for batches, "
+              << "Wait is share of step time workers spend at barriers" << std::endl << std::endl;
+
+    std::cout << std::setw(8) << "Threads" << std::setw(10) << "KPos/s"
+              << std::setw(10) << "Forward" << std::setw(10) << "Backward" << std::setw(13) << "Reduce+Adam"
+              << std::setw(8) << "Data" << std::setw(8) << "Wait" << std::endl;
+
+    for (int threads : thread_counts) {
+        std::shared_ptr<training_weights> weights = std::make_shared<training_weights>();
+        std::shared_ptr<training_moments> first_moment = std::make_shared<training_moments>();
+        std::shared_ptr<training_moments> second_moment = std::make_shared<training_moments>();
+
+        std::srand(1);
+        init_weights(*weights, true);
+        first_moment->zero();
+        second_moment->zero();
+
+        optimizer opt(threads, weights, first_moment, second_moment);
+
+        trainer_params params;
+        params.use_factorized = true;
+        params.learning_rate = 0.0008f;
+        params.weight_decay = 0.0f;
+        params.beta1 = 0.9f;
+        params.beta2 = 0.999f;
+        params.batch_size = batch_size - batch_size % threads;
+        params.epoch_size = 100000000;
+        params.min_lambda = 0.2f;
+        params.max_lambda = 0.4f;
+        params.freeze_perspective = false;
+        params.freeze_l1_weights = false;
+        params.enable_position_skipping = false;
+        params.learning_rate_decay = 1.0f;
+        params.checkpoint_interval = 0;
+
+        std::unique_ptr<training_batch_manager> batch_manager;
+        if (reader) {
+            batch_manager = std::make_unique<training_batch_manager>(params.batch_size, params.epoch_size, reader, false, 1);
+        }
+
+        float cost, psqt_portion, ff_sparsity;
+        size_t non_skipped_positions;
+        size_t positions = 0;
+
+        double data_time = 0.0;
+        std::chrono::steady_clock::time_point t0;
+
+        for (int s = 0; s < warmup_steps + steps; s++) {
+            if (s == warmup_steps) {
+                opt.get_timings().reset();
+                data_time = batch_manager ? batch_manager->get_data_wait_time() : 0.0;
+                t0 = std::chrono::steady_clock::now();
+            }
+
+            training_position *batch;
+            if (batch_manager) {
+                batch_manager->load_new_batch();
+                batch = batch_manager->get_current_batch();
+            } else {
+                batch = &synthetic[(s % 4) * batch_size];
+            }
+
+            opt.step(batch, cost, psqt_portion, ff_sparsity, non_skipped_positions, params);
+
+            if (s >= warmup_steps) {
+                positions += non_skipped_positions;
+            }
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (batch_manager) {
+            data_time = batch_manager->get_data_wait_time() - data_time;
+        }
+
+        const optimizer_timings &timings = opt.get_timings();
+
+        //Worker times are summed over threads, divide to get wall time if work was spread evenly
+        auto kpos = [&] (double seconds) {
+            return seconds > 0.0 ? positions / (1000.0 * seconds) : 0.0;
+        };
+        double worker_time = (timings.forward + timings.backward + timings.reduce) / threads;
+        double wait = 1.0 - worker_time / (timings.backprop_phase + timings.reduce_phase);
+
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(8) << threads << std::setw(10) << kpos(elapsed)
+                  << std::setw(10) << kpos(timings.forward / threads)
+                  << std::setw(10) << kpos(timings.backward / threads)
+                  << std::setw(13) << kpos(timings.reduce / threads);
+        if (batch_manager) {
+            std::cout << std::setw(7) << 100.0 * data_time / elapsed << "%";
+        } else {
+            std::cout << std::setw(8) << "-";
+        }
+        std::cout << std::setw(7) << 100.0 * wait << "%" << std::endl;
+        std::cout << std::defaultfloat;
+    }
+}
+
+
 float nnue_trainer::find_scaling_factor_for_net(std::string qnet_file, const std::string &pgn_dataset)
 {
     std::shared_ptr<nnue_weights> weights = std::make_shared<nnue_weights>();
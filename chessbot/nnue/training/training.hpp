@@ -13,4 +13,8 @@ struct nnue_trainer {
     static void quantize_net(std::string net_file, std::string qnet_file);
 
     static float find_scaling_factor_for_net(std::string qnet_file, const std::string &pgn_dataset);
+
+    //Runs fixed number of optimizer steps for each thread count and reports speed of every phase.
+    //Synthetic positions are used when no directories are given.
+    static void benchmark(std::vector<std::string> dataset_directories, int steps, int max_threads);
 };
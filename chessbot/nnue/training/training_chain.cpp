@@ -0,0 +1,438 @@
+#include "training_chain.hpp"
+#include <cstring>
+#include <iostream>
+
+
+void chain_board::set(const training_position &pos)
+{
+    std::memset(squares, 0, sizeof(squares));
+
+    occupation = pos.occupation;
+    uint64_t occ = pos.occupation;
+    int index = 0;
+    int sq_index;
+
+    int num_of_pieces = pos.count_pieces();
+    for (int i = 0; i < num_of_pieces; i++) {
+        uint8_t p = pos.iterate_pieces(occ, index, sq_index);
+        squares[sq_index] = p;
+    }
+    flags = pos.flags;
+}
+
+
+//Castling rights ended by a move from or to a king or rook home square
+static uint8_t castling_rights_lost(int sq)
+{
+    switch (sq) {
+    case 60: return CASTLE_WHITE_KSIDE | CASTLE_WHITE_QSIDE;
+    case 63: return CASTLE_WHITE_KSIDE;
+    case 56: return CASTLE_WHITE_QSIDE;
+    case 4: return CASTLE_BLACK_KSIDE | CASTLE_BLACK_QSIDE;
+    case 7: return CASTLE_BLACK_KSIDE;
+    case 0: return CASTLE_BLACK_QSIDE;
+    default: return 0;
+    }
+}
+
+
+void chain_board::play(uint16_t move)
+{
+    int from = (move >> 10) & 0x3F;
+    int to = (move >> 4) & 0x3F;
+    uint8_t promotion = move & 0x7;
+
+    uint8_t p = squares[from];
+    uint8_t player = p & 0x8;
+
+    if ((p & 0x7) == PAWN) {
+        if ((from & 0x7) != (to & 0x7) && squares[to] == 0) {
+            int captured = (from & ~0x7) | (to & 0x7);
+            squares[captured] = 0;
+            occupation &= ~(1ULL << captured);
+        }
+        if (promotion != EMPTY) {
+            p = player | promotion;
+        }
+    } else if ((p & 0x7) == KING && (from & 0x7) == 4) {
+        int rank = from & ~0x7;
+        if ((to & 0x7) == 2) {
+            squares[rank + 3] = squares[rank];
+            squares[rank] = 0;
+            occupation ^= (1ULL << rank) | (1ULL << (rank + 3));
+        } else if ((to & 0x7) == 6) {
+            squares[rank + 5] = squares[rank + 7];
+            squares[rank + 7] = 0;
+            occupation ^= (1ULL << (rank + 7)) | (1ULL << (rank + 5));
+        }
+    }
+
+    squares[from] = 0;
+    squares[to] = p;
+    occupation = (occupation & ~(1ULL << from)) | (1ULL << to);
+
+    flags ^= WHITE_TURN;
+    if ((flags & RESULT_DRAW) == 0) {
+        flags ^= RESULT_STM_WIN;
+    }
+
+    flags &= ~(castling_rights_lost(from) | castling_rights_lost(to) | EN_PASSANT_CAPTURE);
+    if ((p & 0x7) == PAWN && (to - from == 2*BOARD_WIDTH || from - to == 2*BOARD_WIDTH) &&
+        training_position::en_passant_file(squares, (flags & WHITE_TURN) != 0 ? WHITE : BLACK) == (to & 0x7)) {
+        flags |= EN_PASSANT_CAPTURE;
+    }
+}
+
+
+training_position chain_board::get_position(uint16_t bm, int16_t eval) const
+{
+    training_position pos;
+
+    pos.occupation = occupation;
+    pos.eval = eval;
+    pos.flags = flags;
+    pos.bm = bm;
+    std::memset(pos.packed_pieces, 0, sizeof(pos.packed_pieces));
+
+    uint64_t occ = occupation;
+    int write_index = 0;
+    while (occ) {
+        int sq = bit_scan_forward_clear(occ);
+        pos.packed_pieces[write_index / 2] |= squares[sq] << ((write_index & 0x1) * 4);
+        write_index++;
+    }
+
+    int from = (bm >> 10) & 0x3F;
+    int to = (bm >> 4) & 0x3F;
+
+    uint8_t moving = squares[from];
+    uint8_t captured = squares[to];
+    if ((moving & 0x7) == PAWN && (from & 0x7) != (to & 0x7) && captured == 0) {
+        captured = PAWN | ((moving & 0x8) ^ 0x8);
+    }
+    pos.bm_pieces = (moving << 4) | captured;
+
+    return pos;
+}
+
+
+bool same_training_sample(const training_position &a, const training_position &b)
+{
+    if (a.occupation != b.occupation || a.eval != b.eval || a.flags != b.flags || a.bm != b.bm || a.bm_pieces != b.bm_pieces) {
+        return false;
+    }
+
+    int num_of_pieces = a.count_pieces();
+    for (int i = 0; i < num_of_pieces; i++) {
+        int shift = (i & 0x1) * 4;
+        if (((a.packed_pieces[i / 2] >> shift) & 0xF) != ((b.packed_pieces[i / 2] >> shift) & 0xF)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static int64_t zigzag_decode(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 0x1);
+}
+
+
+static uint64_t zigzag_encode(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+
+
+chain_block_decoder::chain_block_decoder(const char *data, size_t size)
+{
+    ptr = data;
+    end = data + size;
+    entries_left = 0;
+    last_move = 0;
+    last_eval = 0;
+}
+
+
+uint16_t chain_block_decoder::read_uint16()
+{
+    uint16_t v;
+    std::memcpy(&v, ptr, sizeof(v));
+    ptr += sizeof(v);
+    return v;
+}
+
+
+uint64_t chain_block_decoder::read_varint()
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (true) {
+        uint8_t b = *ptr++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return v;
+        }
+        shift += 7;
+    }
+}
+
+
+bool chain_block_decoder::next(training_position &pos)
+{
+    while (entries_left > 0) {
+        uint16_t move = read_uint16();
+        entries_left--;
+
+        board.play(last_move);
+        last_eval = -last_eval;
+        last_move = move & ~chain_skipped_ply;
+
+        if ((move & chain_skipped_ply) == 0) {
+            last_eval += zigzag_decode(read_varint());
+            pos = board.get_position(last_move, last_eval);
+            return true;
+        }
+    }
+
+    if (ptr >= end) {
+        return false;
+    }
+
+    std::memset(pos.packed_pieces, 0, sizeof(pos.packed_pieces));
+    std::memcpy(&pos.occupation, ptr, sizeof(pos.occupation));
+    ptr += sizeof(pos.occupation);
+    std::memcpy(&pos.eval, ptr, sizeof(pos.eval));
+    ptr += sizeof(pos.eval);
+    pos.flags = *ptr++;
+    pos.bm = read_uint16();
+    pos.bm_pieces = *ptr++;
+
+    int packed_bytes = (pos.count_pieces() + 1) / 2;
+    std::memcpy(pos.packed_pieces, ptr, packed_bytes);
+    ptr += packed_bytes;
+
+    entries_left = read_varint();
+
+    board.set(pos);
+    last_move = pos.bm;
+    last_eval = pos.eval;
+
+    return true;
+}
+
+
+
+chain_file_writer::chain_file_writer(const std::string &filename, size_t bp)
+{
+    block_positions = bp;
+    positions_in_block = 0;
+    in_chain = false;
+    num_of_entries = 0;
+    last_eval = 0;
+
+    bytes_written = 0;
+    num_of_chains = 0;
+    num_of_positions = 0;
+
+    file.open(filename, std::ios::binary);
+    if (file.is_open()) {
+        file.write((const char*)&chain_file_magic, sizeof(chain_file_magic));
+        file.write((const char*)&chain_file_version, sizeof(chain_file_version));
+        bytes_written += chain_file_header_size;
+    }
+}
+
+
+chain_file_writer::~chain_file_writer()
+{
+    close();
+}
+
+
+void chain_file_writer::close()
+{
+    if (!file.is_open()) {
+        return;
+    }
+    end_chain();
+    end_block();
+    file.close();
+}
+
+
+void chain_file_writer::flush()
+{
+    if (!file.is_open()) {
+        return;
+    }
+    end_chain();
+    end_block();
+    file.flush();
+}
+
+
+void chain_file_writer::write_uint16(std::vector<char> &buffer, uint16_t value)
+{
+    buffer.push_back(value & 0xFF);
+    buffer.push_back(value >> 8);
+}
+
+
+void chain_file_writer::write_varint(std::vector<char> &buffer, uint64_t value)
+{
+    while (value >= 0x80) {
+        buffer.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer.push_back(value);
+}
+
+
+void chain_file_writer::add(const training_position &pos)
+{
+    num_of_positions++;
+
+    if (positions_in_block >= block_positions) {
+        end_chain();
+        end_block();
+    }
+    positions_in_block++;
+
+    if (in_chain) {
+        chain_board next = board;
+        next.play(last.bm);
+
+        if (same_training_sample(next.get_position(pos.bm, pos.eval), pos)) {
+            add_entry(pos.bm, pos.eval);
+            board = next;
+            last = pos;
+            return;
+        }
+
+        uint16_t skipped_move;
+        if (find_skipped_move(next, pos, skipped_move)) {
+            add_entry(skipped_move | chain_skipped_ply, 0);
+            add_entry(pos.bm, pos.eval);
+            board = next;
+            board.play(skipped_move);
+            last = pos;
+            return;
+        }
+        end_chain();
+    }
+
+    start_chain(pos);
+}
+
+
+bool chain_file_writer::find_skipped_move(const chain_board &from, const training_position &pos, uint16_t &move)
+{
+    chain_board target;
+    target.set(pos);
+
+    //Quiet move changes two squares, castling four
+    int changed[4];
+    int num_of_changed = 0;
+    for (int i = 0; i < 64; i++) {
+        if (from.squares[i] != target.squares[i]) {
+            if (num_of_changed == 4) {
+                return false;
+            }
+            changed[num_of_changed++] = i;
+        }
+    }
+
+    constexpr uint8_t promotions[] = {EMPTY, QUEEN, ROOK, BISHOP, KNIGHT};
+
+    for (int i = 0; i < num_of_changed; i++) {
+        for (int j = 0; j < num_of_changed; j++) {
+            if (i == j || from.squares[changed[i]] == 0) {
+                continue;
+            }
+            for (uint8_t promotion : promotions) {
+                uint16_t m = (changed[i] << 10) | (changed[j] << 4) | promotion;
+
+                chain_board after = from;
+                after.play(m);
+                if (same_training_sample(after.get_position(pos.bm, pos.eval), pos)) {
+                    move = m;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+
+void chain_file_writer::start_chain(const training_position &pos)
+{
+    chain_start.clear();
+    chain_entries.clear();
+    num_of_entries = 0;
+
+    const char *occupation = (const char*)&pos.occupation;
+    const char *eval = (const char*)&pos.eval;
+    chain_start.insert(chain_start.end(), occupation, occupation + sizeof(pos.occupation));
+    chain_start.insert(chain_start.end(), eval, eval + sizeof(pos.eval));
+    chain_start.push_back(pos.flags);
+    write_uint16(chain_start, pos.bm);
+    chain_start.push_back(pos.bm_pieces);
+
+    chain_board b;
+    b.set(pos);
+    training_position packed = b.get_position(pos.bm, pos.eval);
+    int packed_bytes = (pos.count_pieces() + 1) / 2;
+    chain_start.insert(chain_start.end(), (const char*)packed.packed_pieces, (const char*)packed.packed_pieces + packed_bytes);
+
+    board = b;
+    last = pos;
+    last_eval = pos.eval;
+    in_chain = true;
+}
+
+
+void chain_file_writer::add_entry(uint16_t move, int32_t eval)
+{
+    write_uint16(chain_entries, move);
+    num_of_entries++;
+
+    last_eval = -last_eval;
+    if ((move & chain_skipped_ply) == 0) {
+        write_varint(chain_entries, zigzag_encode(eval - last_eval));
+        last_eval = eval;
+    }
+}
+
+
+void chain_file_writer::end_chain()
+{
+    if (!in_chain) {
+        return;
+    }
+    block.insert(block.end(), chain_start.begin(), chain_start.end());
+    write_varint(block, num_of_entries);
+    block.insert(block.end(), chain_entries.begin(), chain_entries.end());
+
+    num_of_chains++;
+    in_chain = false;
+}
+
+
+void chain_file_writer::end_block()
+{
+    if (block.empty()) {
+        return;
+    }
+    uint32_t header[2] = {(uint32_t)block.size(), (uint32_t)positions_in_block};
+    file.write((const char*)header, sizeof(header));
+    file.write(block.data(), block.size());
+
+    bytes_written += sizeof(header) + block.size();
+
+    block.clear();
+    positions_in_block = 0;
+}
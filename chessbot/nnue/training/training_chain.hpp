@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include "training_position.hpp"
+
+
+//Compact on-disk format for training data. Consecutive positions of a game are stored as a chain: first position in
+//full, following ones as their best move and eval delta. Side to move and result follow from the first position.
+//
+//File:   magic, version, blocks
+//Block:  uint32 payload bytes, uint32 positions, chains
+//Chain:  start position, varint number of entries, entries
+//Entry:  uint16 move, zigzag varint eval delta (stored positions only)
+//
+//Position of an entry is reached by playing the previous move. Entries flagged with chain_skipped_ply only advance the
+//board, which bridges positions filtered out of the dataset. Blocks are independent and can be decoded in any order.
+
+constexpr uint32_t chain_file_magic = 0x4E484354;
+constexpr uint32_t chain_file_version = 1;
+constexpr size_t chain_file_header_size = 8;
+constexpr size_t chain_block_header_size = 8;
+
+constexpr uint16_t chain_skipped_ply = 0x8;
+
+
+//Mailbox board of a chain. Moves are applied without legality checks, castling and en passant are recognized from
+//piece movement.
+struct chain_board
+{
+    void set(const training_position &pos);
+
+    //Plays move and passes turn and result to the other side
+    void play(uint16_t move);
+
+    training_position get_position(uint16_t bm, int16_t eval) const;
+
+    uint8_t squares[64];
+    uint64_t occupation;
+    uint8_t flags;
+};
+
+
+//Compares fields used by training, ignores unused piece nibbles and padding
+bool same_training_sample(const training_position &a, const training_position &b);
+
+
+struct chain_block_decoder
+{
+    chain_block_decoder(const char *data, size_t size);
+
+    //Returns false at end of block
+    bool next(training_position &pos);
+private:
+    uint16_t read_uint16();
+    uint64_t read_varint();
+
+    const char *ptr;
+    const char *end;
+
+    chain_board board;
+    size_t entries_left;
+    uint16_t last_move;
+    int32_t last_eval;
+};
+
+
+//Writes positions in dataset order. Positions continue the current chain when they are reachable from the previous
+//one by its best move, optionally with one skipped ply in between.
+struct chain_file_writer
+{
+    chain_file_writer(const std::string &filename, size_t block_positions = 4096);
+    ~chain_file_writer();
+
+    bool is_open() {
+        return file.is_open();
+    }
+
+    void add(const training_position &pos);
+    void close();
+
+    //Ends current chain and block and writes them to file
+    void flush();
+
+    size_t get_bytes_written() {
+        return bytes_written;
+    }
+
+    size_t get_num_of_chains() {
+        return num_of_chains;
+    }
+
+    size_t get_num_of_positions() {
+        return num_of_positions;
+    }
+private:
+    bool find_skipped_move(const chain_board &from, const training_position &pos, uint16_t &move);
+
+    void start_chain(const training_position &pos);
+    void add_entry(uint16_t move, int32_t eval);
+    void end_chain();
+    void end_block();
+
+    void write_uint16(std::vector<char> &buffer, uint16_t value);
+    void write_varint(std::vector<char> &buffer, uint64_t value);
+
+    std::ofstream file;
+
+    size_t block_positions;
+    size_t positions_in_block;
+    std::vector<char> block;
+
+    bool in_chain;
+    chain_board board;
+    training_position last;
+    int32_t last_eval;
+
+    std::vector<char> chain_start;
+    std::vector<char> chain_entries;
+    size_t num_of_entries;
+
+    size_t bytes_written;
+    size_t num_of_chains;
+    size_t num_of_positions;
+};
@@ -0,0 +1,194 @@
+#include "training_checkpoint.hpp"
+#include "../../util/misc.hpp"
+#include <cstdio>
+
+
+static uint64_t num_of_parameters(const training_weights &weights)
+{
+    return weights.memory_usage() / sizeof(float);
+}
+
+//Fields are written one by one, so file has no struct padding and doesn't depend on compiler layout
+static void write_progress(std::ofstream &file, const training_progress &progress)
+{
+    file.write((const char*)&progress.num_of_workers, sizeof(progress.num_of_workers));
+    file.write((const char*)&progress.step, sizeof(progress.step));
+    file.write((const char*)&progress.data_seed, sizeof(progress.data_seed));
+    file.write((const char*)&progress.next_batch, sizeof(progress.next_batch));
+    file.write((const char*)&progress.learning_rate, sizeof(progress.learning_rate));
+    file.write((const char*)&progress.training_cost, sizeof(progress.training_cost));
+}
+
+static void read_progress(std::ifstream &file, training_progress &progress)
+{
+    file.read((char*)&progress.num_of_workers, sizeof(progress.num_of_workers));
+    file.read((char*)&progress.step, sizeof(progress.step));
+    file.read((char*)&progress.data_seed, sizeof(progress.data_seed));
+    file.read((char*)&progress.next_batch, sizeof(progress.next_batch));
+    file.read((char*)&progress.learning_rate, sizeof(progress.learning_rate));
+    file.read((char*)&progress.training_cost, sizeof(progress.training_cost));
+}
+
+
+bool save_checkpoint(const std::string &path, const training_progress &progress, training_weights &weights,
+                     training_moments &first_moment, training_moments &second_moment, const std::vector<int> &row_steps)
+{
+    std::string tmp_path = path + ".tmp";
+
+    std::ofstream file(tmp_path.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cout << "Error: can't open checkpoint file " << tmp_path << std::endl;
+        return false;
+    }
+
+    uint64_t params = num_of_parameters(weights);
+    uint32_t moment_bytes = sizeof(moment_t);
+    uint64_t rows = row_steps.size();
+
+    file.write((const char*)&checkpoint_file_magic, sizeof(checkpoint_file_magic));
+    file.write((const char*)&checkpoint_file_version, sizeof(checkpoint_file_version));
+    file.write((const char*)&params, sizeof(params));
+    file.write((const char*)&moment_bytes, sizeof(moment_bytes));
+    write_progress(file, progress);
+
+    weights.save(file);
+    first_moment.save(file);
+    second_moment.save(file);
+
+    file.write((const char*)&rows, sizeof(rows));
+    file.write((const char*)row_steps.data(), rows*sizeof(int));
+
+    file.close();
+    if (file.fail()) {
+        std::cout << "Error: failed to write checkpoint file " << tmp_path << std::endl;
+        return false;
+    }
+
+    sync_file(tmp_path);
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cout << "Error: can't replace checkpoint file " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool load_checkpoint(const std::string &path, training_progress &progress, training_weights &weights,
+                     training_moments &first_moment, training_moments &second_moment, std::vector<int> &row_steps)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cout << "Error: can't open checkpoint file " << path << std::endl;
+        return false;
+    }
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t params = 0;
+    uint32_t moment_bytes = 0;
+    uint64_t rows = 0;
+
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&version, sizeof(version));
+    file.read((char*)&params, sizeof(params));
+    file.read((char*)&moment_bytes, sizeof(moment_bytes));
+
+    if (magic != checkpoint_file_magic || version != checkpoint_file_version || params != num_of_parameters(weights)) {
+        std::cout << "Error: " << path << " is not a checkpoint of this network" << std::endl;
+        return false;
+    }
+    if (moment_bytes != sizeof(moment_t)) {
+        std::cout << "Error: " << path << " has " << moment_bytes*8 << " bit moments, trainer is built with " << sizeof(moment_t)*8 << " bit moments" << std::endl;
+        return false;
+    }
+
+    read_progress(file, progress);
+
+    weights.load(file);
+    first_moment.load(file);
+    second_moment.load(file);
+
+    file.read((char*)&rows, sizeof(rows));
+    if (rows != row_steps.size()) {
+        std::cout << "Error: " << path << " has " << rows << " perspective rows, expected " << row_steps.size() << std::endl;
+        return false;
+    }
+    file.read((char*)row_steps.data(), rows*sizeof(int));
+
+    if (!file) {
+        std::cout << "Error: checkpoint " << path << " is truncated" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+checkpoint_writer::checkpoint_writer(std::string p)
+{
+    path = p;
+    pending = false;
+    running = true;
+
+    t = std::thread(&checkpoint_writer::thread_entry, this);
+}
+
+
+checkpoint_writer::~checkpoint_writer()
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [this] {return !pending;});
+        running = false;
+    }
+    cv.notify_all();
+    t.join();
+}
+
+
+void checkpoint_writer::write(const training_progress &p, const training_weights &w, const training_moments &m,
+                              const training_moments &v, const std::vector<int> &rs)
+{
+    wait();
+
+    progress = p;
+    weights.copy_from(w);
+    first_moment.copy_from(m);
+    second_moment.copy_from(v);
+    row_steps = rs;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending = true;
+    }
+    cv.notify_all();
+}
+
+
+void checkpoint_writer::wait()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    cv.wait(guard, [this] {return !pending;});
+}
+
+
+void checkpoint_writer::thread_entry()
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cv.wait(guard, [this] {return pending || !running;});
+            if (!pending) {
+                return;
+            }
+        }
+
+        save_checkpoint(path, progress, weights, first_moment, second_moment, row_steps);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending = false;
+        }
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "training_nnue.hpp"
+
+
+//Training checkpoint holds weights, Adam moments, lazy update steps of perspective rows and progress below. Resuming
+//from it continues the run bit exact, given same dataset and number of workers.
+//
+//File:   magic, version, parameter count, moment bytes, progress, weights, first moment, second moment, row steps
+
+constexpr uint32_t checkpoint_file_magic = 0x4B434E54;
+constexpr uint32_t checkpoint_file_version = 3;
+
+struct training_progress
+{
+    uint32_t num_of_workers;
+    uint64_t step;
+
+    //Batches are generated from data seed and batch index
+    uint64_t data_seed;
+    uint64_t next_batch;
+
+    float learning_rate;
+    float training_cost;
+};
+
+
+//Writes to temporary file which replaces checkpoint only after it is complete and synced
+bool save_checkpoint(const std::string &path, const training_progress &progress, training_weights &weights,
+                     training_moments &first_moment, training_moments &second_moment, const std::vector<int> &row_steps);
+
+bool load_checkpoint(const std::string &path, training_progress &progress, training_weights &weights,
+                     training_moments &first_moment, training_moments &second_moment, std::vector<int> &row_steps);
+
+
+//Saves checkpoints on own thread. State is copied on caller's thread between optimizer steps, so training continues
+//while file is written.
+struct checkpoint_writer
+{
+    checkpoint_writer(std::string path);
+    ~checkpoint_writer();
+
+    //Waits for previous checkpoint to be written before copying state
+    void write(const training_progress &progress, const training_weights &weights, const training_moments &first_moment,
+               const training_moments &second_moment, const std::vector<int> &row_steps);
+
+    void wait();
+
+    size_t memory_usage() const {
+        return weights.memory_usage() + 2*first_moment.memory_usage() + row_steps.capacity()*sizeof(int);
+    }
+private:
+    void thread_entry();
+
+    std::string path;
+
+    training_progress progress;
+    training_weights weights;
+    training_moments first_moment;
+    training_moments second_moment;
+    std::vector<int> row_steps;
+
+    std::thread t;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool pending;
+    bool running;
+};
@@ -1,10 +1,23 @@
 #include "training_data.hpp"
 #include "../../util/pgn_parser.hpp"
+#include "../../util/pgn_reader.hpp"
+#include "../../util/wdl_model.hpp"
 #include <math.h>
 #include <algorithm>
 #include <random>
 #include <sstream>
 #include <filesystem>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 float evaluation_wdl_mse(const std::vector<training_position> &data, float scaling_factor)
@@ -53,7 +66,7 @@ float training_data_utility::find_scaling_factor_for_data(const std::vector<trai
 
 
 
-size_t filter_and_convert_data(const std::string &pgn_text, std::vector<training_position> &data_out)
+size_t filter_and_convert_data(std::string_view pgn_text, std::vector<training_position> &data_out)
 {
     //This function filters selfplay results
     std::vector<training_position> data;
@@ -63,10 +76,10 @@ size_t filter_and_convert_data(const std::string &pgn_text, std::vector<training
     iterate_pgn_positions(pgn_text, [&] (const board_state &state, chess_move bm, game_win_type_t game_result, std::string *comment)
     {
         unfiltered_position_count += 1;
-        int32_t eval = std::atoi(comment->c_str());
+        //Evals are normalized with the engine's fixed scaling, same as positions written by datagen
+        int32_t eval = wdl_model::normalize_score(state, std::atoi(comment->c_str()));
 
-        bool is_tactical = (state.get_square(bm.to).get_type() != EMPTY) || state.in_check(WHITE) || state.in_check(BLACK);
-        if (!is_tactical) {
+        if (!training_data_utility::is_filtered_position(state, bm)) {
             float wdl = 0.5f;
             if (game_result == WHITE_WIN) {
                 wdl = 1.0f;
@@ -78,87 +91,147 @@ size_t filter_and_convert_data(const std::string &pgn_text, std::vector<training
         }
     });
 
+    data_out.insert(data_out.end(), data.begin(), data.end());
 
-    std::vector<training_position> batch = get_random_batch(data, 100000);
-    float scaling_factor = training_data_utility::find_scaling_factor_for_data(batch);
-
-    data_out.reserve(data_out.size() + data.size());
-
-    for (size_t i = 0; i < data.size(); i++) {
-        data[i].eval = (data[i].eval * 400) / scaling_factor;
-        data_out.push_back(data[i]);
-    }
-
     return unfiltered_position_count;
 }
 
 
-void save_binary_data(std::vector<training_position> &dataset, std::string output_folder, size_t file_number, size_t save_positions)
+//Output of conversion workers. Positions of a file are appended as one run, so games stay in order, and shard is
+//rotated when it is full.
+struct conversion_output
 {
-    std::stringstream ss;
-    ss << output_folder;
-    ss << "/";
-    ss << "data" << file_number << ".bin";
-
-    std::cout << "Saving data: " << ss.str() << "... ";
-    std::ofstream file(ss.str(), std::ios::binary);
-    if (file.is_open()) {
-        for (size_t i = 0; i < save_positions; i++) {
-            training_position pos = dataset[dataset.size()-1];
-            dataset.pop_back();
-            file.write((char*)&pos, sizeof(training_position));
+    conversion_output(const std::string &folder, size_t positions_per_file): output_folder(folder), file_positions(positions_per_file)
+    {
+        file_count = 0;
+        positions_in_file = 0;
+    }
+
+    void write(const std::vector<training_position> &positions)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (size_t i = 0; i < positions.size(); i++) {
+            if (!writer || positions_in_file >= file_positions) {
+                open_next();
+            }
+            writer->add(positions[i]);
+            positions_in_file++;
         }
-        std::cout << " done." << std::endl;
-    } else {
-        std::cout << " error." << std::endl;
     }
-    file.close();
 
-}
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (writer) {
+            writer->close();
+            writer.reset();
+        }
+    }
 
+    size_t get_file_count() {
+        return file_count;
+    }
+private:
+    void open_next()
+    {
+        if (writer) {
+            writer->close();
+        }
+        std::string filename = output_folder + "/data" + std::to_string(file_count++) + ".bin";
+        writer = std::make_unique<training_data_writer>(filename);
+        if (!writer->is_open()) {
+            std::cout << "Cannot write file " << filename << std::endl;
+        }
+        positions_in_file = 0;
+    }
 
+    std::mutex lock;
+    std::string output_folder;
+    size_t file_positions;
+
+    std::unique_ptr<training_data_writer> writer;
+    size_t file_count;
+    size_t positions_in_file;
+};
 
-void training_data_utility::convert_training_data(std::vector<std::string> selfplay_directories, std::string output_folder, size_t output_file_sizes_MB)
-{
-    std::vector <training_position> positions;
 
-    size_t positions_per_file = (output_file_sizes_MB*1024*1024) / sizeof(training_position);
-    size_t file_count = 0;
-    size_t raw_data_size = 0;
-    size_t filtered_data_size = 0;
-    int input_files = 0;
-    int output_files = 0;
 
+void training_data_utility::convert_training_data(std::vector<std::string> selfplay_directories, std::string output_folder, size_t output_file_sizes_MB, int threads)
+{
+    std::vector<std::string> files;
     for (size_t i = 0; i < selfplay_directories.size(); i++) {
-        std::string folder = selfplay_directories[i];
-        for (const auto& entry : std::filesystem::directory_iterator(folder)) {
-            std::string filename = entry.path().string();
-            std::string extension = entry.path().extension().string();
+        for (const auto& entry : std::filesystem::directory_iterator(selfplay_directories[i])) {
+            if (entry.path().extension().string() == ".pgn") {
+                files.push_back(entry.path().string());
+            }
+        }
+    }
+    std::sort(files.begin(), files.end());
 
-            if (extension == ".pgn") {
-                std::string pgn_text = pgn_parser::read_text_file(filename);
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, std::max((int)files.size(), 1));
+
+    conversion_output output(output_folder, (output_file_sizes_MB*1024*1024) / sizeof(training_position));
+
+    //Workers take files in order, each holds one file's text and positions at a time
+    std::atomic<size_t> next_file = 0;
+    std::atomic<size_t> files_done = 0;
+    std::atomic<size_t> raw_data_size = 0;
+    std::atomic<size_t> filtered_data_size = 0;
+
+    auto convert_files = [&] () {
+        std::vector<training_position> positions;
+        while (true) {
+            size_t index = next_file++;
+            if (index >= files.size()) {
+                break;
+            }
+            pgn_file pgn(files[index]);
 
-                raw_data_size += filter_and_convert_data(pgn_text, positions);
+            positions.clear();
+            raw_data_size += filter_and_convert_data(pgn.get_text(), positions);
+            filtered_data_size += positions.size();
 
-                while (positions.size() >= positions_per_file) {
-                    save_binary_data(positions, output_folder, file_count++, positions_per_file);
-                    filtered_data_size += positions_per_file;
-                    output_files++;
-                }
-                input_files++;
-            }
+            output.write(positions);
+            files_done++;
         }
+    };
+
+    std::cout << "Converting " << files.size() << " files with " << threads << " threads" << std::endl;
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(convert_files);
     }
-    filtered_data_size += positions.size();
 
-    while (positions.size() > 0) {
-        save_binary_data(positions, output_folder, file_count++, std::min(positions.size(), positions_per_file));
-        output_files++;
+    auto report = [&] () {
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+        std::cout << "\rFiles: " << files_done << "/" << files.size()
+                  << "   " << std::fixed << std::setprecision(2) << files_done / seconds << " files/s"
+                  << "   " << (size_t)(raw_data_size / seconds / 1000) << " KPos/s"
+                  << "   Positions: " << raw_data_size / 1000 << "K -> " << filtered_data_size / 1000 << "K   "
+                  << std::defaultfloat << std::flush;
+    };
+
+    while (files_done < files.size()) {
+        report();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
 
+    for (std::thread &t : workers) {
+        t.join();
+    }
+    output.close();
+    report();
+
     std::cout << std::endl << std::endl;
-    std::cout << "Input files: " << input_files << std::endl;
-    std::cout << "Output files: " << output_files << std::endl;
+    std::cout << "Input files: " << files.size() << std::endl;
+    std::cout << "Output files: " << output.get_file_count() << std::endl;
     std::cout << "Raw dataset size: " << (raw_data_size / 1000000) << "M" << std::endl;
     std::cout << "Filtered dataset size: " << (filtered_data_size / 1000000) << "M" << std::endl;
     std::cout << std::endl;
@@ -166,106 +239,547 @@ void training_data_utility::convert_training_data(std::vector<std::string> selfp
 
 
 
-data_reader::data_reader(std::vector<std::string> folders)
+void training_data_utility::convert_to_chains(std::vector<std::string> directories, std::string output_folder)
+{
+    size_t input_bytes = 0;
+    size_t output_bytes = 0;
+    size_t positions = 0;
+    size_t chains = 0;
+
+    for (size_t i = 0; i < directories.size(); i++) {
+        for (const auto& entry : std::filesystem::directory_iterator(directories[i])) {
+            if (entry.path().extension().string() != ".bin") {
+                continue;
+            }
+            std::string filename = entry.path().string();
+
+            std::ifstream file(filename, std::ios::binary | std::ios::ate);
+            if (!file.is_open()) {
+                std::cout << "Cannot read file " << filename << std::endl;
+                continue;
+            }
+            size_t size_of_file = file.tellg();
+            file.seekg(0, std::ios::beg);
+
+            std::vector<training_position> data(size_of_file / sizeof(training_position));
+            file.read((char*)data.data(), data.size() * sizeof(training_position));
+            file.close();
+
+            //Older convert_training_data wrote games backwards, check which direction positions follow each other
+            size_t forward = 0;
+            size_t backward = 0;
+            for (size_t j = 0; j + 1 < std::min(data.size(), (size_t)10000); j++) {
+                chain_board board;
+                board.set(data[j]);
+                board.play(data[j].bm);
+                forward += same_training_sample(board.get_position(data[j+1].bm, data[j+1].eval), data[j+1]);
+
+                board.set(data[j+1]);
+                board.play(data[j+1].bm);
+                backward += same_training_sample(board.get_position(data[j].bm, data[j].eval), data[j]);
+            }
+            if (backward > forward) {
+                std::reverse(data.begin(), data.end());
+            }
+
+            std::string output_file = output_folder + "/" + entry.path().stem().string() + ".chain";
+            chain_file_writer writer(output_file);
+            if (!writer.is_open()) {
+                std::cout << "Cannot write file " << output_file << std::endl;
+                continue;
+            }
+            for (size_t j = 0; j < data.size(); j++) {
+                writer.add(data[j]);
+            }
+            writer.close();
+
+            std::cout << filename << " -> " << output_file << "  " << size_of_file / (1024*1024) << "MB -> "
+                      << writer.get_bytes_written() / (1024*1024) << "MB  "
+                      << (float)writer.get_num_of_positions() / std::max(writer.get_num_of_chains(), (size_t)1) << " positions per chain" << std::endl;
+
+            input_bytes += size_of_file;
+            output_bytes += writer.get_bytes_written();
+            positions += writer.get_num_of_positions();
+            chains += writer.get_num_of_chains();
+        }
+    }
+
+    std::cout << std::endl;
+    std::cout << "Positions: " << positions << "  Chains: " << chains << std::endl;
+    std::cout << "Size: " << input_bytes / (1024*1024) << "MB -> " << output_bytes / (1024*1024) << "MB ("
+              << (float)output_bytes / std::max(positions, (size_t)1) << " bytes per position)" << std::endl;
+}
+
+
+bool training_data_utility::is_filtered_position(const board_state &state, const chess_move &bm)
+{
+    return (state.get_square(bm.to).get_type() != EMPTY) || state.in_check(WHITE) || state.in_check(BLACK);
+}
+
+
+
+training_data_writer::training_data_writer(const std::string &f)
+{
+    filename = f;
+    num_of_positions = 0;
+
+    if (std::filesystem::path(filename).extension().string() == ".chain") {
+        chains = std::make_unique<chain_file_writer>(filename);
+    } else {
+        file.open(filename, std::ios::binary);
+        buffer.reserve(4096);
+    }
+}
+
+
+training_data_writer::~training_data_writer()
+{
+    close();
+}
+
+
+void training_data_writer::add(const training_position &pos)
+{
+    num_of_positions += 1;
+
+    if (chains) {
+        chains->add(pos);
+        return;
+    }
+
+    buffer.push_back(pos);
+    if (buffer.size() == buffer.capacity()) {
+        flush();
+    }
+}
+
+
+void training_data_writer::flush()
+{
+    file.write((const char*)buffer.data(), buffer.size() * sizeof(training_position));
+    buffer.clear();
+}
+
+
+void training_data_writer::sync()
+{
+    if (chains) {
+        chains->flush();
+    } else {
+        flush();
+        file.flush();
+    }
+    sync_file(filename);
+}
+
+
+void training_data_writer::close()
+{
+    if (chains) {
+        chains->close();
+    } else if (file.is_open()) {
+        flush();
+        file.close();
+    }
+}
+
+
+
+void training_data_utility::benchmark_decoding(std::vector<std::string> directories)
+{
+    data_reader reader(directories);
+    reader.set_access_pattern(data_reader::ACCESS_SEQUENTIAL);
+
+    //Checksum keeps reads from being optimized out
+    uint64_t checksum = 0;
+
+    auto report = [] (std::string name, size_t positions, size_t bytes, std::chrono::high_resolution_clock::time_point t0) {
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+        std::cout << name << ": " << positions << " positions  "
+                  << (float)bytes / std::max(positions, (size_t)1) << " bytes/pos  "
+                  << (size_t)(positions / seconds / 1000) << " KPos/s  "
+                  << (size_t)(bytes / seconds / (1024*1024)) << " MB/s" << std::endl;
+    };
+
+    size_t bin_positions = reader.get_size<training_position>();
+    if (bin_positions > 0) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < bin_positions; i++) {
+            const training_position &pos = reader.get<training_position>(i);
+            checksum += pos.occupation + pos.eval;
+        }
+        report("bin", bin_positions, bin_positions * sizeof(training_position), t0);
+    }
+
+    if (reader.get_num_of_chain_blocks() > 0) {
+        std::vector<training_position> positions;
+        size_t chain_positions = 0;
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < reader.get_num_of_chain_blocks(); i++) {
+            positions.clear();
+            reader.decode_chain_block(i, positions);
+            for (const training_position &pos : positions) {
+                checksum += pos.occupation + pos.eval;
+            }
+            chain_positions += positions.size();
+        }
+        report("chain", chain_positions, reader.get_chain_size(), t0);
+    }
+
+    std::cout << "Checksum: " << checksum << std::endl;
+}
+
+
+
+const char *data_reader::map_file(const std::string &filename, size_t &size)
+{
+#ifdef __linux__
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Cannot read file " << filename << std::endl;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = st.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        std::cout << "Failed to map file " << filename << std::endl;
+        return nullptr;
+    }
+    return (const char*)mapping;
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cout << "Cannot read file " << filename << std::endl;
+        return nullptr;
+    }
+    size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    char *data = new char[size];
+    file.read(data, size);
+    file.close();
+    return data;
+#endif
+}
+
+
+void data_reader::unmap_file(const char *data, size_t size)
+{
+#ifdef __linux__
+    munmap((void*)data, size);
+#else
+    delete [] data;
+#endif
+}
+
+
+void data_reader::index_chain_shard(const shard &s)
+{
+    uint32_t header[2];
+    if (s.size < chain_file_header_size) {
+        std::cout << "Invalid chain file " << s.filename << std::endl;
+        return;
+    }
+    std::memcpy(header, s.data, sizeof(header));
+    if (header[0] != chain_file_magic || header[1] != chain_file_version) {
+        std::cout << "Invalid chain file " << s.filename << std::endl;
+        return;
+    }
+
+    size_t pos = chain_file_header_size;
+    while (pos + chain_block_header_size <= s.size) {
+        std::memcpy(header, &s.data[pos], sizeof(header));
+        pos += chain_block_header_size;
+
+        if (pos + header[0] > s.size) {
+            std::cout << "Truncated chain file " << s.filename << std::endl;
+            break;
+        }
+        //Empty blocks are not indexed, so batches never draw them
+        if (header[1] > 0) {
+            chain_blocks.push_back({&s.data[pos], header[0], chain_positions});
+            chain_positions += header[1];
+        }
+
+        pos += header[0];
+    }
+}
+
+
+data_reader::data_reader(std::vector<std::string> folders)
+{
+    dataset_size = 0;
+    chain_dataset_size = 0;
+    chain_positions = 0;
+
+    for (size_t i = 0; i < folders.size(); i++) {
+        std::string folder = folders[i];
+        for (const auto& entry : std::filesystem::directory_iterator(folder)) {
+            std::string filename = entry.path().string();
+            std::string extension = entry.path().extension().string();
+
+            if (extension != ".bin" && extension != ".chain") {
+                continue;
+            }
+
+            size_t size_of_file = 0;
+            const char *data = map_file(filename, size_of_file);
+            if (!data) {
+                continue;
+            }
+
+            if (extension == ".bin") {
+                shards.push_back({filename, size_of_file, dataset_size, data});
+                dataset_size += size_of_file;
+            } else {
+                chain_shards.push_back({filename, size_of_file, chain_dataset_size, data});
+                chain_dataset_size += size_of_file;
+                index_chain_shard(chain_shards.back());
+            }
+
+            std::cout << "File: " << filename << "  Size: " << size_of_file / (1024*1024) << "MB" << std::endl;
+        }
+    }
+    std::cout << "Total dataset size: " << dataset_size / (1024*1024) << "MB";
+    if (chain_positions > 0) {
+        std::cout << " + " << chain_positions / (1000*1000) << "M chained positions";
+    }
+    std::cout << std::endl;
+
+    set_access_pattern(ACCESS_RANDOM);
+}
+
+
+data_reader::~data_reader()
+{
+    for (size_t i = 0; i < shards.size(); i++) {
+        unmap_file(shards[i].data, shards[i].size);
+    }
+    for (size_t i = 0; i < chain_shards.size(); i++) {
+        unmap_file(chain_shards[i].data, chain_shards[i].size);
+    }
+}
+
+
+void data_reader::set_access_pattern(access_pattern_t pattern)
 {
-    dataset_size = 0;
+#ifdef __linux__
+    for (size_t i = 0; i < shards.size(); i++) {
+        madvise((void*)shards[i].data, shards[i].size, (pattern == ACCESS_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL));
+    }
+    //Blocks are read whole, so chain shards always get read ahead within the block
+    for (size_t i = 0; i < chain_shards.size(); i++) {
+        madvise((void*)chain_shards[i].data, chain_shards[i].size, (pattern == ACCESS_RANDOM ? MADV_NORMAL : MADV_SEQUENTIAL));
+    }
+#endif
+}
 
-    auto enumerate_files = [&folders] (auto action) {
-        for (size_t i = 0; i < folders.size(); i++) {
-            std::string folder = folders[i];
-            for (const auto& entry : std::filesystem::directory_iterator(folder)) {
-                std::string filename = entry.path().string();
-                std::string extension = entry.path().extension().string();
 
-                if (extension == ".bin") {
-                    action(filename);
-                }
-            }
-        }
-    };
+size_t data_reader::find_chain_block(size_t index) const
+{
+    auto it = std::upper_bound(chain_blocks.begin(), chain_blocks.end(), index, [] (size_t i, const chain_block &b) {
+        return i < b.first_position;
+    });
+    return (it - chain_blocks.begin()) - 1;
+}
 
-    enumerate_files([this] (std::string filename) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (file.is_open()) {
-        size_t size_of_file = file.tellg();
-        files.emplace_back(filename, size_of_file);
-        dataset_size += size_of_file;
 
-        std::cout << "File: " << filename << "  Size: " << size_of_file / (1024*1024) << "MB" << std::endl;
+void data_reader::decode_chain_block(size_t block, std::vector<training_position> &positions) const
+{
+    chain_block_decoder decoder(chain_blocks[block].data, chain_blocks[block].size);
+
+    training_position pos;
+    while (decoder.next(pos)) {
+        positions.push_back(pos);
     }
-    file.close();
+}
+
+
+const char *data_reader::get_raw(size_t position) const
+{
+    //First shard which ends after position
+    auto it = std::upper_bound(shards.begin(), shards.end(), position, [] (size_t pos, const shard &s) {
+        return pos < s.offset + s.size;
+    });
+    return &it->data[position - it->offset];
+}
+
+
+size_t data_reader::get_shard_end_raw(size_t position) const
+{
+    auto it = std::upper_bound(shards.begin(), shards.end(), position, [] (size_t pos, const shard &s) {
+        return pos < s.offset + s.size;
     });
-    std::cout << "Total dataset size: " << dataset_size / (1024*1024) << "MB" << std::endl;
+    return it->offset + it->size;
 }
 
+
 void data_reader::read_raw(size_t position, size_t bytes_to_read, char *dst)
 {
-    size_t index = 0;
-    for (size_t i = 0; i < files.size() && bytes_to_read > 0; i++) {
-        std::string filename = files[i].first;
-        size_t file_size = files[i].second;
-
-        if (index + file_size > position) {
-            size_t offset = position - index;
-            size_t read_size = std::min(bytes_to_read, file_size - offset);
-
-            std::ifstream file(filename, std::ios::binary);
-            if (file.is_open()) {
-                file.seekg(offset, std::ios::beg);
-
-                size_t chunk_size = 1024*1024*64;
-                size_t dst_index = 0;
-                size_t read_left = read_size;
-                while (read_left > 0) {
-                    size_t s = std::min(read_left, chunk_size);
-                    file.read(&dst[dst_index], s);
-                    dst_index += s;
-                    read_left -= s;
-                }
-            } else {
-                std::cout << "Cannot read file " << filename << std::endl;
-            }
+    while (bytes_to_read > 0 && position < dataset_size) {
+        auto it = std::upper_bound(shards.begin(), shards.end(), position, [] (size_t pos, const shard &s) {
+            return pos < s.offset + s.size;
+        });
+        size_t offset = position - it->offset;
+        size_t read_size = std::min(bytes_to_read, it->size - offset);
+
+        std::memcpy(dst, &it->data[offset], read_size);
+
+        position += read_size;
+        bytes_to_read -= read_size;
+        dst += read_size;
+    }
+}
 
-            file.close();
-            position += read_size;
-            bytes_to_read -= read_size;
-            dst += read_size;
-        }
-        index += file_size;
+
+
+
+bool skip_position(const training_position &pos)
+{
+    constexpr int max_eval_error = 200;
+
+    int32_t eval = pos.eval;
+    float wdl = pos.get_wdl_relative_to_stm();
+
+    return ((eval > max_eval_error && wdl < 0.25f) ||
+            (eval < -max_eval_error && wdl > 0.75f));
+}
+
+
+void batch_queue::push(training_position *batch)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batches.push(batch);
+    }
+    cv.notify_one();
+}
+
+
+training_position *batch_queue::pop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    cv.wait(guard, [this] {return closed || !batches.empty();});
+
+    if (closed) {
+        return nullptr;
+    }
+
+    training_position *batch = batches.front();
+    batches.pop();
+    return batch;
+}
+
+
+void batch_queue::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
     }
+    cv.notify_all();
 }
 
 
+void ordered_batch_queue::set_next(size_t index)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    next = index;
+}
+
+
+void ordered_batch_queue::push(size_t index, training_position *batch)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batches[index] = batch;
+    }
+    cv.notify_all();
+}
 
 
-training_batch_manager::training_batch_manager(size_t bs, size_t es, std::shared_ptr<data_reader> dr)
+training_position *ordered_batch_queue::pop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    cv.wait(guard, [this] {return closed || batches.count(next);});
+
+    if (closed) {
+        return nullptr;
+    }
+
+    auto it = batches.find(next);
+    training_position *batch = it->second;
+    batches.erase(it);
+    next++;
+    return batch;
+}
+
+
+void ordered_batch_queue::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+    }
+    cv.notify_all();
+}
+
+
+training_batch_manager::training_batch_manager(size_t bs, size_t es, std::shared_ptr<data_reader> dr, bool skip, uint64_t seed,
+                                               size_t first_batch, int num_of_producers, int queue_depth)
 {
     epoch_size = es;
     batch_size = bs;
+    skip_positions = skip;
 
     reader = dr;
-    buffer_index = 0;
 
-    buffers[0] = new training_position[epoch_size];
-    buffers[1] = new training_position[epoch_size];
+    data_seed = seed;
+    next_batch = first_batch;
+    produced_batches = first_batch;
+    ready_batches.set_next(first_batch);
 
-    epochs = 0;
-    batch_number = 0;
+    epochs = first_batch / get_number_of_batches();
+    batch_number = first_batch % get_number_of_batches();
+    data_wait_time = 0.0;
 
-    batch_index = 0;
+    //Every buffer is either queued, being filled by a producer or held by the trainer
+    size_t num_of_buffers = queue_depth + num_of_producers + 1;
+    batch_storage.resize(num_of_buffers * batch_size);
+    for (size_t i = 0; i < num_of_buffers; i++) {
+        free_batches.push(&batch_storage[i * batch_size]);
+    }
+    current_batch = nullptr;
 
-    load_epoch(buffers[0]);
-    loader_thread = std::thread(&training_batch_manager::load_epoch, this, buffers[1]);
+    running = true;
+    for (int i = 0; i < num_of_producers; i++) {
+        producers.emplace_back(&training_batch_manager::producer_loop, this);
+    }
 }
 
 
 training_batch_manager::~training_batch_manager()
 {
-    delete [] buffers[0];
-    delete [] buffers[1];
+    running = false;
+    free_batches.close();
+    ready_batches.close();
+
+    for (std::thread &t : producers) {
+        t.join();
+    }
 }
 
-int get_king_bucket_configuration(training_position &pos)
+//Groups batch by king bucket pair for locality of perspective weight rows, and by exact king squares inside pair so that
+//neighbouring samples share inputs and trainer can update accumulators incrementally
+int get_batch_sort_key(training_position &pos)
 {
     uint64_t occupation = pos.occupation;
     int index = 0;
@@ -290,88 +804,115 @@ int get_king_bucket_configuration(training_position &pos)
     int white_bucket = get_king_bucket(white_king_sq);
     int black_bucket = get_king_bucket(black_king_sq);
 
-    return std::min(white_bucket,black_bucket)*16 + std::max(white_bucket, black_bucket);
+    int bucket_configuration = std::min(white_bucket,black_bucket)*16 + std::max(white_bucket, black_bucket);
+
+    return bucket_configuration*64*64 + white_king_sq*64 + black_king_sq;
 }
 
 
-void training_batch_manager::load_epoch(training_position *buffer)
+void training_batch_manager::fill_batch(size_t index, std::vector<std::pair<training_position, int>> &batch, std::vector<training_position> &decoded)
 {
-    std::random_device rd;
-    std::mt19937_64 gen(rd());
+    std::seed_seq seed{(uint32_t)data_seed, (uint32_t)(data_seed >> 32), (uint32_t)index, (uint32_t)(index >> 32)};
+    std::mt19937_64 gen(seed);
 
     std::uniform_int_distribution<uint64_t> dist(0, UINT64_MAX);
 
-    std::vector<size_t> indices(epoch_size);
-    for (int i = 0; i < epoch_size; i++) {
-        indices[i] = dist(gen) % reader->get_size<training_position>();
-    }
+    size_t dataset_size = reader->get_size<training_position>();
+    size_t total_size = dataset_size + reader->get_num_of_chain_positions();
 
-    std::sort(indices.begin(), indices.end());
-
-    size_t fetch_index = 0;
-
-    size_t chunk_size = 1024*1024*64;
-    std::vector<training_position> chunk(chunk_size);
+    if (total_size == 0) {
+        std::cout << "Error: dataset has no positions, batch " << index << " is empty" << std::endl;
+        return;
+    }
 
-    size_t read_index = 0;
-    while (read_index < reader->get_size<training_position>()) {
-        if (read_index + chunk_size > reader->get_size<training_position>()) {
-            chunk_size = reader->get_size<training_position>() - read_index;
+    size_t n = 0;
+    int empty_draws = 0;
+    while (n < batch_size && running) {
+        size_t n_before = n;
+        size_t position = dist(gen) % total_size;
+
+        //Chain blocks are decoded whole, each run starts at random offset inside block
+        if (position >= dataset_size) {
+            decoded.clear();
+            reader->decode_chain_block(reader->find_chain_block(position - dataset_size), decoded);
+
+            for (size_t r = 0; r < runs_per_chain_block && n < batch_size; r++) {
+                size_t start = decoded.size() > run_length ? dist(gen) % (decoded.size() - run_length + 1) : 0;
+                size_t end = std::min(decoded.size(), start + run_length);
+
+                for (size_t i = start; i < end && n < batch_size; i++) {
+                    if (!skip_positions || !skip_position(decoded[i])) {
+                        batch[n++].first = decoded[i];
+                    }
+                }
+            }
+        } else {
+            //Run stops at end of its shard, next shard is a different file
+            size_t end = std::min(position + run_length, reader->get_shard_end<training_position>(position));
+
+            for (size_t i = position; i < end && n < batch_size; i++) {
+                const training_position &pos = reader->get<training_position>(i);
+                if (!skip_positions || !skip_position(pos)) {
+                    batch[n++].first = pos;
+                }
+            }
         }
 
-        reader->read<training_position>(read_index, chunk_size, chunk.data());
-
-        while (fetch_index < epoch_size && indices[fetch_index] < read_index + chunk_size) {
-            buffer[fetch_index] = chunk[indices[fetch_index] - read_index];
-            fetch_index++;
+        //Corrupt chain blocks or data where every position is skipped would never fill the batch
+        if (n != n_before) {
+            empty_draws = 0;
+        } else if (++empty_draws >= max_empty_draws) {
+            std::cout << "Error: no usable positions in " << max_empty_draws << " draws, batch " << index << " is incomplete" << std::endl;
+            break;
         }
-
-        read_index += chunk_size;
     }
 
-
-    /*size_t chunk_size = 1000;
-    size_t chunks = epoch_size / chunk_size;
-
-    for (int i = 0; i < chunks; i++) {
-        uint64_t pos = dist(gen) % (reader->get_size<training_position>() - chunk_size);
-
-        reader->read<training_position>(pos, chunk_size, &buffer[i*chunk_size]);
-    }*/
-
-    for (size_t i = epoch_size - 1; i > 0; --i) {
-        size_t j = dist(gen) % (i+1);
-
-        std::swap(buffer[i], buffer[j]);
+    for (size_t i = 0; i < batch_size; i++) {
+        batch[i].second = get_batch_sort_key(batch[i].first);
     }
+    std::sort(batch.begin(), batch.end(), [] (auto &a, auto &b) {return a.second > b.second;});
+}
 
 
+void training_batch_manager::producer_loop()
+{
     std::vector<std::pair<training_position, int>> batch(batch_size);
+    std::vector<training_position> decoded;
 
-    for (size_t i = 0; i < epoch_size - batch_size; i += batch_size) {
-        for (size_t j = 0; j < batch_size; j++) {
-            batch[j].first = buffer[i + j];
-            batch[j].second = get_king_bucket_configuration(buffer[i + j]);
+    while (running) {
+        training_position *buffer = free_batches.pop();
+        if (!buffer) {
+            break;
         }
-        std::sort(batch.begin(), batch.end(), [] (auto &a, auto &b) {return a.second > b.second;});
+
+        //Index is taken only after buffer, so producer holding trainer's next batch is never blocked
+        size_t index = produced_batches++;
+
+        fill_batch(index, batch, decoded);
         for (size_t j = 0; j < batch_size; j++) {
-            buffer[i + j] = batch[j].first;
+            buffer[j] = batch[j].first;
         }
+
+        ready_batches.push(index, buffer);
     }
 }
 
 
 void training_batch_manager::load_new_batch()
 {
-    batch_number += 1;
-    batch_index += batch_size;
+    if (current_batch) {
+        free_batches.push(current_batch);
+    }
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    current_batch = ready_batches.pop();
+    auto t1 = std::chrono::high_resolution_clock::now();
 
-    if (batch_index + batch_size >= epoch_size) {
-        loader_thread.join();
-        loader_thread = std::thread(&training_batch_manager::load_epoch, this, buffers[buffer_index]);
+    data_wait_time += std::chrono::duration<double>(t1 - t0).count();
 
-        buffer_index = (buffer_index + 1) % 2;
-        batch_index = 0;
+    next_batch += 1;
+    batch_number += 1;
+    if (batch_number >= get_number_of_batches()) {
         batch_number = 0;
         epochs += 1;
     }
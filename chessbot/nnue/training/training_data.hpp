@@ -1,7 +1,14 @@
 #pragma once
 
 #include <vector>
+#include <queue>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 #include "training_position.hpp"
+#include "training_chain.hpp"
 #include "../../util/misc.hpp"
 
 
@@ -19,32 +26,180 @@ std::vector<T> get_random_batch(std::vector<T> &samples, int batch_size)
     return batch;
 }
 
+//Dataset of binary .bin shards and compressed .chain shards. Shards are memory mapped once and samples are served
+//directly from mappings. .bin shards are expected to contain whole samples, .chain shards are decoded a block at a time.
 struct data_reader
 {
     data_reader(std::vector<std::string> directories);
+    ~data_reader();
+
+    enum access_pattern_t {ACCESS_RANDOM, ACCESS_SEQUENTIAL};
+
+    template <typename T>
+    struct shard_view
+    {
+        const T *begin() const {
+            return first;
+        }
+        const T *end() const {
+            return last;
+        }
+        size_t size() const {
+            return last - first;
+        }
+
+        const T *first;
+        const T *last;
+    };
 
     template <typename T>
     void read(size_t index, size_t num, T *buffer) {
         read_raw(index * sizeof(T), num * sizeof(T), (char*)buffer);
     }
 
+    //Sample by index over all shards, without copying
+    template <typename T>
+    const T &get(size_t index) const {
+        return *(const T*)get_raw(index * sizeof(T));
+    }
+
     template <typename T>
     size_t get_size() const {
         return dataset_size / sizeof(T);
     }
+
+    //Index one past the last sample of shard holding sample index
+    template <typename T>
+    size_t get_shard_end(size_t index) const {
+        return get_shard_end_raw(index * sizeof(T)) / sizeof(T);
+    }
+
+    size_t get_num_of_shards() const {
+        return shards.size();
+    }
+
+    const std::string &get_shard_name(size_t index) const {
+        return shards[index].filename;
+    }
+
+    template <typename T>
+    shard_view<T> get_shard(size_t index) const {
+        shard_view<T> view;
+        view.first = (const T*)shards[index].data;
+        view.last = view.first + shards[index].size / sizeof(T);
+        return view;
+    }
+
+    //Hint for kernel read ahead of all mappings
+    void set_access_pattern(access_pattern_t pattern);
+
+    size_t get_num_of_chain_positions() const {
+        return chain_positions;
+    }
+
+    size_t get_num_of_chain_blocks() const {
+        return chain_blocks.size();
+    }
+
+    size_t get_chain_size() const {
+        return chain_dataset_size;
+    }
+
+    //Block holding chain position index
+    size_t find_chain_block(size_t index) const;
+
+    //Appends all positions of block
+    void decode_chain_block(size_t block, std::vector<training_position> &positions) const;
 private:
-    std::vector<std::pair<std::string, size_t>> files;
+    struct shard
+    {
+        std::string filename;
+        size_t size;
+        size_t offset;
+        const char *data;
+    };
+    std::vector<shard> shards;
+    std::vector<shard> chain_shards;
+
+    struct chain_block
+    {
+        const char *data;
+        size_t size;
+        size_t first_position;
+    };
+    std::vector<chain_block> chain_blocks;
 
     size_t dataset_size;
+    size_t chain_dataset_size;
+    size_t chain_positions;
+
+    static const char *map_file(const std::string &filename, size_t &size);
+    static void unmap_file(const char *data, size_t size);
 
+    void index_chain_shard(const shard &s);
+
+    const char *get_raw(size_t position) const;
+    size_t get_shard_end_raw(size_t position) const;
     void read_raw(size_t position, size_t bytes_to_read, char *dst);
 };
 
 
 
+//Position with large disagreement between eval and game result
+bool skip_position(const training_position &pos);
+
+
+//Blocking FIFO of batch buffers shared between loader threads and trainer
+struct batch_queue
+{
+    batch_queue(): closed(false) {}
+
+    void push(training_position *batch);
+
+    //Returns nullptr once queue is closed
+    training_position *pop();
+
+    void close();
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    std::queue<training_position*> batches;
+    bool closed;
+};
+
+
+//Batch buffers handed out in order of batch index, whichever producer finishes first
+struct ordered_batch_queue
+{
+    ordered_batch_queue(): next(0), closed(false) {}
+
+    void set_next(size_t index);
+
+    void push(size_t index, training_position *batch);
+
+    //Waits for batch with next index, returns nullptr once queue is closed
+    training_position *pop();
+
+    void close();
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    std::map<size_t, training_position*> batches;
+    size_t next;
+    bool closed;
+};
+
+
+//Streams batches to the trainer. Producer threads build batches from short random runs of consecutive samples, drop skipped
+//positions, sort each batch by king buckets and hand it over through a bounded queue. Memory is bounded by queue depth,
+//not epoch size.
+//
+//Every batch is drawn with its own generator seeded by data seed and batch index, so batch stream doesn't depend on
+//number of producers or their timing and can be restarted from any batch.
 struct training_batch_manager
 {
-    training_batch_manager(size_t bs, size_t es, std::shared_ptr<data_reader> dr);
+    training_batch_manager(size_t bs, size_t es, std::shared_ptr<data_reader> dr, bool skip_positions, uint64_t data_seed,
+                           size_t first_batch = 0, int num_of_producers = 2, int queue_depth = 8);
     ~training_batch_manager();
 
 
@@ -61,15 +216,45 @@ struct training_batch_manager
     }
 
     training_position *get_current_batch() {
-        return &buffers[buffer_index][batch_index];
+        return current_batch;
+    }
+
+    //Index of batch returned by next load_new_batch
+    size_t get_next_batch() {
+        return next_batch;
+    }
+
+    uint64_t get_data_seed() {
+        return data_seed;
+    }
+
+    //Seconds trainer has spent blocked in load_new_batch
+    double get_data_wait_time() {
+        return data_wait_time;
+    }
+
+    size_t get_memory_usage() {
+        return batch_storage.size() * sizeof(training_position);
     }
 
     void load_new_batch();
 private:
+    //Short runs keep reads local without correlating the batch, length doesn't depend on batch size
+    static constexpr size_t run_length = 16;
+
+    //Runs drawn from each decoded chain block, so a few runs share the cost of decoding it
+    static constexpr size_t runs_per_chain_block = 8;
+
+    //Consecutive draws without a usable position before batch is given up
+    static constexpr int max_empty_draws = 10000;
 
-    void load_epoch(training_position *buffer);
+    void producer_loop();
 
-    size_t batch_index;
+    void fill_batch(size_t index, std::vector<std::pair<training_position, int>> &batch, std::vector<training_position> &decoded);
+
+    uint64_t data_seed;
+    size_t next_batch;
+    std::atomic<size_t> produced_batches;
 
     size_t epochs;
     size_t epoch_size;
@@ -77,19 +262,69 @@ private:
     size_t batch_size;
     size_t batch_number;
 
-    training_position *buffers[2];
-    size_t buffer_index;
+    bool skip_positions;
+
+    std::vector<training_position> batch_storage;
+    training_position *current_batch;
+
+    batch_queue free_batches;
+    ordered_batch_queue ready_batches;
+
+    double data_wait_time;
 
     std::shared_ptr<data_reader> reader;
 
-    std::thread loader_thread;
+    std::atomic<bool> running;
+    std::vector<std::thread> producers;
 };
 
 
 
 struct training_data_utility
 {
-    static void convert_training_data(std::vector<std::string> selfplay_directories, std::string output_folder, size_t output_file_sizes_MB);
+    //Converts .pgn files concurrently and writes filtered positions to .bin shards of given size. 0 threads uses all cores.
+    static void convert_training_data(std::vector<std::string> selfplay_directories, std::string output_folder, size_t output_file_sizes_MB, int threads = 0);
+
+    //Rewrites .bin shards as .chain shards
+    static void convert_to_chains(std::vector<std::string> directories, std::string output_folder);
+
+    //Read throughput of .bin shards and decode throughput of .chain shards
+    static void benchmark_decoding(std::vector<std::string> directories);
 
     static float find_scaling_factor_for_data(const std::vector<training_position> &data);
+
+    //Captures and checks are left out of training data
+    static bool is_filtered_position(const board_state &state, const chess_move &bm);
+};
+
+
+//Writes positions to a .bin or .chain shard, format follows from file extension
+struct training_data_writer
+{
+    training_data_writer(const std::string &filename);
+    ~training_data_writer();
+
+    bool is_open() {
+        return chains ? chains->is_open() : file.is_open();
+    }
+
+    void add(const training_position &pos);
+    void close();
+
+    //Writes buffered positions and syncs file to disk, file stays readable if process dies after this
+    void sync();
+
+    size_t get_num_of_positions() {
+        return num_of_positions;
+    }
+private:
+    void flush();
+
+    std::string filename;
+    std::unique_ptr<chain_file_writer> chains;
+
+    std::ofstream file;
+    std::vector<training_position> buffer;
+
+    size_t num_of_positions;
 };
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 
 #include <x86gprintrin.h>
 #include <x86intrin.h>
@@ -59,130 +62,262 @@ inline void copy_vectorized(float *ov, const float *av, int tid, int tc)
 }
 
 template <int N>
-inline void add_vectorized(float *ov, const float *av, const float *bv, int tid, int tc)
+inline void mult_vectorized(float *ov, const float *av, float value, int tid, int tc)
 {
     int per_thread, start;
     split_work(tid, tc, N, per_thread, start);
 
     #if USE_AVX2
 
+    __m256 b = _mm256_set1_ps(value);
+
     for (int i = start; i < start + per_thread; i += 8) {
         __m256 a = _mm256_load_ps(&av[i]);
-        __m256 b = _mm256_load_ps(&bv[i]);
-        __m256 o = _mm256_add_ps(a, b);
+        __m256 o = _mm256_mul_ps(a, b);
         _mm256_store_ps(&ov[i], o);
     }
 
     #else
 
     for (int i = start; i < start + per_thread; i++) {
-        ov[i] = av[i] + bv[i];
+        ov[i] = av[i]*value;
     }
 
     #endif
 }
 
+
 template <int N>
-inline void mult_vectorized(float *ov, const float *av, const float *bv, int tid, int tc)
+inline void set_vectorized(float *ov, float value, int tid, int tc)
 {
     int per_thread, start;
-    split_work(tid, tc, N, per_thread, start);
+    split_work(tid, tc, N, per_thread, start);
 
     #if USE_AVX2
 
+    __m256 v = _mm256_set1_ps(value);
+
     for (int i = start; i < start + per_thread; i += 8) {
-        __m256 a = _mm256_load_ps(&av[i]);
-        __m256 b = _mm256_load_ps(&bv[i]);
-        __m256 o = _mm256_mul_ps(a, b);
-        _mm256_store_ps(&ov[i], o);
+        _mm256_store_ps(&ov[i], v);
     }
 
     #else
 
-
     for (int i = start; i < start + per_thread; i++) {
-        ov[i] = av[i]*bv[i];
+        ov[i] = value;
     }
 
     #endif
 }
 
 
-template <int N>
-inline void mult_vectorized(float *ov, const float *av, float value, int tid, int tc)
+inline const char *training_kernels_name()
 {
-    int per_thread, start;
-    split_work(tid, tc, N, per_thread, start);
+    return USE_AVX512 ? "AVX-512" : (USE_AVX2 ? "AVX2" : "Scalar");
+}
 
-    #if USE_AVX2
+#if USE_AVX2
 
-    __m256 b = _mm256_set1_ps(value);
+inline float horizontal_sum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
 
-    for (int i = start; i < start + per_thread; i += 8) {
-        __m256 a = _mm256_load_ps(&av[i]);
-        __m256 o = _mm256_mul_ps(a, b);
-        _mm256_store_ps(&ov[i], o);
+#endif
+
+#if USE_AVX512
+
+//Row lengths are multiple of 8 floats, last step of a 16 float loop is masked
+inline __mmask16 row_step_mask(int remaining)
+{
+    return remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+}
+
+//Halves are added in 256 bits, _mm512_reduce_add_ps makes gcc warn about uninitialized temporaries
+inline float horizontal_sum(__m512 v)
+{
+    __m256 high = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+    return horizontal_sum(_mm256_add_ps(_mm512_castps512_ps256(v), high));
+}
+
+#endif
+
+//dst += src, rows are 32 byte aligned
+inline void add_row_vectorized(float *dst, const float *src, int n)
+{
+    #if USE_AVX512
+
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = row_step_mask(n - i);
+        __m512 a = _mm512_maskz_loadu_ps(m, &dst[i]);
+        __m512 b = _mm512_maskz_loadu_ps(m, &src[i]);
+        _mm512_mask_storeu_ps(&dst[i], m, _mm512_add_ps(a, b));
+    }
+
+    #elif USE_AVX2
+
+    for (int i = 0; i < n; i += 8) {
+        __m256 a = _mm256_load_ps(&dst[i]);
+        __m256 b = _mm256_load_ps(&src[i]);
+        _mm256_store_ps(&dst[i], _mm256_add_ps(a, b));
     }
 
     #else
 
-    for (int i = start; i < start + per_thread; i++) {
-        ov[i] = av[i]*value;
+    for (int i = 0; i < n; i++) {
+        dst[i] += src[i];
     }
 
     #endif
 }
 
-
-template <int N>
-inline void set_vectorized(float *ov, float value, int tid, int tc)
+//dst += scale*src
+inline void add_scaled_row_vectorized(float *dst, const float *src, float scale, int n)
 {
-    int per_thread, start;
-    split_work(tid, tc, N, per_thread, start);
+    #if USE_AVX512
 
-    #if USE_AVX2
+    __m512 s = _mm512_set1_ps(scale);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = row_step_mask(n - i);
+        __m512 a = _mm512_maskz_loadu_ps(m, &dst[i]);
+        __m512 b = _mm512_maskz_loadu_ps(m, &src[i]);
+        _mm512_mask_storeu_ps(&dst[i], m, _mm512_fmadd_ps(b, s, a));
+    }
 
-    __m256 v = _mm256_set1_ps(value);
+    #elif USE_AVX2
 
-    for (int i = start; i < start + per_thread; i += 8) {
-        _mm256_store_ps(&ov[i], v);
+    __m256 s = _mm256_set1_ps(scale);
+    for (int i = 0; i < n; i += 8) {
+        __m256 a = _mm256_load_ps(&dst[i]);
+        __m256 b = _mm256_load_ps(&src[i]);
+        _mm256_store_ps(&dst[i], _mm256_fmadd_ps(b, s, a));
     }
 
     #else
 
-    for (int i = start; i < start + per_thread; i++) {
-        ov[i] = value;
+    for (int i = 0; i < n; i++) {
+        dst[i] += scale*src[i];
     }
 
     #endif
 }
 
+//sums[k] += dot(w + k*stride, x) for ROWS rows. Every loaded input vector is used by all rows, accumulators stay in registers.
+template <int ROWS>
+inline void dot_rows_vectorized(const float *w, int stride, const float *x, int n, float *sums)
+{
+    #if USE_AVX512
 
-template <int N>
-inline void ema_vectorized(float *ov, float *av, float val, int tid, int tc)
+    __m512 acc[ROWS];
+    for (int k = 0; k < ROWS; k++) {
+        acc[k] = _mm512_setzero_ps();
+    }
+
+    for (int j = 0; j < n; j += 16) {
+        __mmask16 m = row_step_mask(n - j);
+        __m512 xv = _mm512_maskz_loadu_ps(m, &x[j]);
+        for (int k = 0; k < ROWS; k++) {
+            acc[k] = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, &w[k*stride + j]), xv, acc[k]);
+        }
+    }
+
+    for (int k = 0; k < ROWS; k++) {
+        sums[k] += horizontal_sum(acc[k]);
+    }
+
+    #elif USE_AVX2
+
+    __m256 acc[ROWS];
+    for (int k = 0; k < ROWS; k++) {
+        acc[k] = _mm256_setzero_ps();
+    }
+
+    for (int j = 0; j < n; j += 8) {
+        __m256 xv = _mm256_load_ps(&x[j]);
+        for (int k = 0; k < ROWS; k++) {
+            acc[k] = _mm256_fmadd_ps(_mm256_load_ps(&w[k*stride + j]), xv, acc[k]);
+        }
+    }
+
+    for (int k = 0; k < ROWS; k++) {
+        sums[k] += horizontal_sum(acc[k]);
+    }
+
+    #else
+
+    for (int k = 0; k < ROWS; k++) {
+        for (int j = 0; j < n; j++) {
+            sums[k] += w[k*stride + j]*x[j];
+        }
+    }
+
+    #endif
+}
+
+//Backward pass of ROWS rows with output deltas d: x_grads = sum d[k]*w_k and w_grads_k += d[k]*x.
+//Rows with zero delta are skipped, each block of x_grads stays in a register while all rows are applied.
+template <int ROWS>
+inline void backprop_rows_vectorized(const float *w, float *w_grads, int stride, const float *d, const float *x, float *x_grads, int n)
 {
-    int per_thread, start;
-    split_work(tid, tc, N, per_thread, start);
+    int active[ROWS];
+    int num_of_active = 0;
+    for (int k = 0; k < ROWS; k++) {
+        if (d[k] != 0.0f) {
+            active[num_of_active++] = k;
+        }
+    }
 
-    #if USE_AVX2
+    #if USE_AVX512
 
-    __m256 f0 = _mm256_set1_ps(val);
-    __m256 f1 = _mm256_set1_ps(1.0f - val);
+    for (int j = 0; j < n; j += 16) {
+        __mmask16 m = row_step_mask(n - j);
+        __m512 xv = _mm512_maskz_loadu_ps(m, &x[j]);
+        __m512 xg = _mm512_setzero_ps();
 
-    for (int i = start; i < start + per_thread; i += 8) {
-        __m256 a = _mm256_load_ps(&ov[i]);
-        __m256 b = _mm256_load_ps(&av[i]);
+        for (int i = 0; i < num_of_active; i++) {
+            int k = active[i];
+            __m512 dk = _mm512_set1_ps(d[k]);
+            float *g = &w_grads[k*stride + j];
 
-        a = _mm256_mul_ps(a, f0);
-        b = _mm256_mul_ps(b, f1);
+            xg = _mm512_fmadd_ps(dk, _mm512_maskz_loadu_ps(m, &w[k*stride + j]), xg);
+            _mm512_mask_storeu_ps(g, m, _mm512_fmadd_ps(dk, xv, _mm512_maskz_loadu_ps(m, g)));
+        }
+
+        _mm512_mask_storeu_ps(&x_grads[j], m, xg);
+    }
+
+    #elif USE_AVX2
+
+    for (int j = 0; j < n; j += 8) {
+        __m256 xv = _mm256_load_ps(&x[j]);
+        __m256 xg = _mm256_setzero_ps();
+
+        for (int i = 0; i < num_of_active; i++) {
+            int k = active[i];
+            __m256 dk = _mm256_set1_ps(d[k]);
+            float *g = &w_grads[k*stride + j];
+
+            xg = _mm256_fmadd_ps(dk, _mm256_load_ps(&w[k*stride + j]), xg);
+            _mm256_store_ps(g, _mm256_fmadd_ps(dk, xv, _mm256_load_ps(g)));
+        }
 
-        _mm256_store_ps(&ov[i], _mm256_add_ps(a, b));
+        _mm256_store_ps(&x_grads[j], xg);
     }
 
     #else
 
-    for (int i = start; i < start + per_thread; i++) {
-        ov[i] = (ov[i] * val) + (av[i] * (1.0f - val));
+    for (int j = 0; j < n; j++) {
+        x_grads[j] = 0.0f;
+    }
+    for (int i = 0; i < num_of_active; i++) {
+        int k = active[i];
+        for (int j = 0; j < n; j++) {
+            x_grads[j] += d[k]*w[k*stride + j];
+            w_grads[k*stride + j] += d[k]*x[j];
+        }
     }
 
     #endif
@@ -214,6 +349,254 @@ inline __m256 inv_sqrt_plus_eps(__m256 v, float eps) {
 #endif
 
 
+struct adam_step_params
+{
+    float beta1;
+    float beta2;
+
+    //Bias corrections 1/(1 - beta^t), moments are corrected on the fly
+    float m_correction;
+    float v_correction;
+
+    float learning_rate;
+    float weight_decay;
+
+    //Changes every step, see store_moment
+    uint32_t rounding_seed;
+};
+
+
+//Adam moments are stored as bf16, upper half of float32, and updated in float32. bf16 keeps float32 exponent range,
+//which second moment needs, fp16 would underflow on squared gradients.
+#ifndef USE_BF16_MOMENTS
+    #define USE_BF16_MOMENTS 1
+#endif
+
+#if USE_BF16_MOMENTS
+typedef uint16_t moment_t;
+#else
+typedef float moment_t;
+#endif
+
+//Random bits of moment element for stochastic rounding, low half for first moment and high half for second
+inline uint32_t rounding_noise(uint32_t index, uint32_t seed)
+{
+    uint32_t x = index + seed;
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+inline float load_moment(const moment_t *m)
+{
+    #if USE_BF16_MOMENTS
+    uint32_t bits = (uint32_t)*m << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+    #else
+    return *m;
+    #endif
+}
+
+//Random low bits are added before truncating to bf16, so rounding is unbiased and updates smaller than bf16 precision
+//(1 - beta2 is 0.001) still move second moment on average
+inline void store_moment(moment_t *m, float f, uint32_t noise)
+{
+    #if USE_BF16_MOMENTS
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    *m = (bits + (noise & 0xFFFF)) >> 16;
+    #else
+    *m = f;
+    #endif
+}
+
+#if USE_AVX2
+
+inline __m256i rounding_noise(__m256i index, __m256i seed)
+{
+    __m256i x = _mm256_add_epi32(index, seed);
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x846ca68b));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    return x;
+}
+
+inline __m256i xorshift(__m256i x)
+{
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+    return x;
+}
+
+inline __m256 load_moments(const moment_t *m)
+{
+    #if USE_BF16_MOMENTS
+    __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)m));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(x, 16));
+    #else
+    return _mm256_load_ps(m);
+    #endif
+}
+
+inline void store_moments(moment_t *m, __m256 f, __m256i noise)
+{
+    #if USE_BF16_MOMENTS
+    __m256i x = _mm256_add_epi32(_mm256_castps_si256(f), _mm256_and_si256(noise, _mm256_set1_epi32(0xFFFF)));
+    x = _mm256_srli_epi32(x, 16);
+    x = _mm256_permute4x64_epi64(_mm256_packus_epi32(x, x), 0x08);
+    _mm_storeu_si128((__m128i*)m, _mm256_castsi256_si128(x));
+    #else
+    _mm256_store_ps(m, f);
+    #endif
+}
+
+#endif
+
+
+//Sums gradients of all workers for range of parameters, updates moments and applies Adam step to weights.
+//Moment decays are beta1 and beta2, except for lazily updated parameters which use beta^(skipped steps + 1).
+//Index offset is position of w[0] in its tensor and only seeds rounding noise.
+inline void adam_update_vectorized(float *w, moment_t *m, moment_t *v, const float *const *grads, int num_of_grads, int start, int end,
+                                   float m_decay, float v_decay, const adam_step_params &p, float clamp_min, float clamp_max, bool update_weights,
+                                   uint32_t index_offset = 0)
+{
+    float epsilon = 0.0000001f;
+
+    #if USE_AVX2
+
+    __m256 cmin = _mm256_set1_ps(clamp_min);
+    __m256 cmax = _mm256_set1_ps(clamp_max);
+
+    __m256 lr = _mm256_set1_ps(p.learning_rate);
+    __m256 wd = _mm256_set1_ps(p.weight_decay);
+
+    __m256 md = _mm256_set1_ps(m_decay);
+    __m256 vd = _mm256_set1_ps(v_decay);
+    __m256 mg = _mm256_set1_ps(1.0f - p.beta1);
+    __m256 vg = _mm256_set1_ps(1.0f - p.beta2);
+    __m256 mc = _mm256_set1_ps(p.m_correction);
+    __m256 vc = _mm256_set1_ps(p.v_correction);
+
+    //Noise of each lane is hashed once and then advanced with xorshift, state can't be zero
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i noise = rounding_noise(_mm256_add_epi32(_mm256_set1_epi32(index_offset + start), lanes), _mm256_set1_epi32(p.rounding_seed));
+    noise = _mm256_or_si256(noise, _mm256_set1_epi32(1));
+
+    for (int i = start; i < end; i += 8) {
+        __m256 g = _mm256_load_ps(&grads[0][i]);
+        for (int j = 1; j < num_of_grads; j++) {
+            g = _mm256_add_ps(g, _mm256_load_ps(&grads[j][i]));
+        }
+
+        __m256 m0 = _mm256_fmadd_ps(load_moments(&m[i]), md, _mm256_mul_ps(g, mg));
+        __m256 v0 = _mm256_fmadd_ps(load_moments(&v[i]), vd, _mm256_mul_ps(_mm256_mul_ps(g, g), vg));
+
+        store_moments(&m[i], m0, noise);
+        store_moments(&v[i], v0, _mm256_srli_epi32(noise, 16));
+
+        #if USE_BF16_MOMENTS
+        noise = xorshift(noise);
+        #endif
+
+        if (!update_weights) {
+            continue;
+        }
+
+        __m256 w0 = _mm256_load_ps(&w[i]);
+
+        __m256 delta = _mm256_fmadd_ps(_mm256_mul_ps(m0, mc), inv_sqrt_plus_eps(_mm256_mul_ps(v0, vc), epsilon), _mm256_mul_ps(w0, wd));
+
+        __m256 nw = _mm256_fnmadd_ps(lr, delta, w0);
+
+        nw = _mm256_min_ps(nw, cmax);
+        nw = _mm256_max_ps(nw, cmin);
+
+        _mm256_store_ps(&w[i], nw);
+    }
+
+    #else
+
+    for (int i = start; i < end; i++) {
+        float g = 0.0f;
+        for (int j = 0; j < num_of_grads; j++) {
+            g += grads[j][i];
+        }
+
+        float m0 = load_moment(&m[i])*m_decay + g*(1.0f - p.beta1);
+        float v0 = load_moment(&v[i])*v_decay + g*g*(1.0f - p.beta2);
+
+        uint32_t noise = rounding_noise(index_offset + i, p.rounding_seed);
+        store_moment(&m[i], m0, noise);
+        store_moment(&v[i], v0, noise >> 16);
+
+        if (update_weights) {
+            float delta = m0*p.m_correction / sqrt(v0*p.v_correction + epsilon) + w[i]*p.weight_decay;
+            w[i] = std::clamp(w[i] - delta*p.learning_rate, clamp_min, clamp_max);
+        }
+    }
+
+    #endif
+}
+
+
+//Adam moments of weights and biases of one layer, laid out like the weights
+template <size_t WEIGHTS, size_t BIASES>
+struct training_moments_tensor
+{
+    training_moments_tensor() {
+        weights_buffer = new moment_t[WEIGHTS + 64];
+        biases_buffer = new moment_t[BIASES + 64];
+
+        weights = align_ptr(weights_buffer);
+        biases = align_ptr(biases_buffer);
+    }
+
+    ~training_moments_tensor() {
+        delete [] weights_buffer;
+        delete [] biases_buffer;
+    }
+
+    //Zero bits are zero in bf16 as well
+    void zero() {
+        std::fill(weights, weights + WEIGHTS, moment_t(0));
+        std::fill(biases, biases + BIASES, moment_t(0));
+    }
+
+    void copy_from(const training_moments_tensor<WEIGHTS, BIASES> &other) {
+        std::copy(other.weights, other.weights + WEIGHTS, weights);
+        std::copy(other.biases, other.biases + BIASES, biases);
+    }
+
+    void save(std::ostream &stream) {
+        stream.write((char*)weights, WEIGHTS*sizeof(moment_t));
+        stream.write((char*)biases, BIASES*sizeof(moment_t));
+    }
+
+    void load(std::istream &stream) {
+        stream.read((char*)weights, WEIGHTS*sizeof(moment_t));
+        stream.read((char*)biases, BIASES*sizeof(moment_t));
+    }
+
+    size_t memory_usage() const {
+        return (WEIGHTS + BIASES)*sizeof(moment_t);
+    }
+
+    moment_t *weights;
+    moment_t *biases;
+
+    moment_t *weights_buffer;
+    moment_t *biases_buffer;
+};
+
+
 inline float sigmoid(float x)
 {
     float ex = std::exp(x);
@@ -256,6 +639,8 @@ inline float activation_func_out(float x)
 template <int INPUTS, int NEURONS, int STACK_SIZE, bool IS_OUTPUT_LAYER>
 struct training_layer_weights
 {
+    typedef training_moments_tensor<INPUTS*NEURONS*STACK_SIZE, NEURONS*STACK_SIZE> moments;
+
     training_layer_weights() {
         weights_buffer = new float[INPUTS*NEURONS*STACK_SIZE + 64];
         biases_buffer = new float[NEURONS*STACK_SIZE + 64];
@@ -364,21 +749,6 @@ struct training_layer_weights
         mult_vectorized<NEURONS*INPUTS*STACK_SIZE>(weights, weights, val, tid, tc);
     }
 
-    void mult(const training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER> &other, float val, int tid, int tc) {
-        mult_vectorized<NEURONS*STACK_SIZE>(biases, other.biases, val, tid, tc);
-        mult_vectorized<NEURONS*INPUTS*STACK_SIZE>(weights, other.weights, val, tid, tc);
-    }
-
-    void squared(const training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER> &other, int tid, int tc) {
-        mult_vectorized<NEURONS*STACK_SIZE>(biases, other.biases, other.biases, tid, tc);
-        mult_vectorized<NEURONS*INPUTS*STACK_SIZE>(weights, other.weights, other.weights, tid, tc);
-    }
-
-    void exponential_smoothing(const training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER> &other, float factor, int tid, int tc) {
-        ema_vectorized<NEURONS*STACK_SIZE>(biases, other.biases, factor, tid, tc);
-        ema_vectorized<NEURONS*INPUTS*STACK_SIZE>(weights, other.weights, factor, tid, tc);
-    }
-
     int num_of_biases() const {
         return NEURONS*STACK_SIZE;
     }
@@ -391,18 +761,10 @@ struct training_layer_weights
         return NEURONS*STACK_SIZE + (NEURONS*INPUTS*STACK_SIZE);
     }
 
-    void add(const training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER> &other, int tid, int tc) {
-        add_vectorized<NEURONS*STACK_SIZE>(biases, biases, other.biases, tid, tc);
-        add_vectorized<NEURONS*INPUTS*STACK_SIZE>(weights, weights, other.weights, tid, tc);
-    }
-
-    void rmsprop(training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER> *grad, training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER> *pg, float learning_rate, float weight_decay, int tid, int tc)
+    //Reduces gradients of all workers for this worker's shard of parameters and applies Adam update
+    void adam_update(const std::vector<const training_layer_weights<INPUTS, NEURONS, STACK_SIZE, IS_OUTPUT_LAYER>*> &grads,
+                     moments *m, moments *v, const adam_step_params &p, bool update_weights, int tid, int tc)
     {
-        float epsilon = 0.0000001f;
-
-        #if USE_AVX2
-
-
         float clamp_min = layer_quantization_clamp_min;
         float clamp_max = layer_quantization_clamp_max;
         if (IS_OUTPUT_LAYER) {
@@ -410,66 +772,28 @@ struct training_layer_weights
             clamp_max = output_quantization_clamp_max;
         }
 
-        __m256 cmin = _mm256_set1_ps(clamp_min);
-        __m256 cmax = _mm256_set1_ps(clamp_max);
-
-        __m256 lr = _mm256_set1_ps(learning_rate);
-        __m256 wd = _mm256_set1_ps(weight_decay);
-
-        int per_thread, start;
-        split_work(tid, tc, INPUTS*NEURONS*STACK_SIZE, per_thread, start);
-
-        for (int i = start; i < start + per_thread; i += 8) {
-            __m256 w = _mm256_load_ps(&weights[i]);
-            __m256 g = _mm256_load_ps(&grad->weights[i]);
-            __m256 v = _mm256_load_ps(&pg->weights[i]);
-
-            __m256 delta = _mm256_fmadd_ps(g, inv_sqrt_plus_eps(v, epsilon), _mm256_mul_ps(w, wd));
-
-            __m256 nw = _mm256_fnmadd_ps(lr, delta, w);
-
-            nw = _mm256_min_ps(nw, cmax);
-            nw = _mm256_max_ps(nw, cmin);
-
-            _mm256_store_ps(&weights[i], nw);
+        std::vector<const float*> weight_grads;
+        std::vector<const float*> bias_grads;
+        for (size_t i = 0; i < grads.size(); i++) {
+            weight_grads.push_back(grads[i]->weights);
+            bias_grads.push_back(grads[i]->biases);
         }
 
-        if (tid == 0) {
-            for (int i = 0; i < NEURONS*STACK_SIZE; i += 8) {
-
-                __m256 b = _mm256_load_ps(&biases[i]);
-                __m256 g = _mm256_load_ps(&grad->biases[i]);
-                __m256 v = _mm256_load_ps(&pg->biases[i]);
-
-                __m256 delta = _mm256_fmadd_ps(g, inv_sqrt_plus_eps(v, epsilon), _mm256_mul_ps(b, wd));
-
-                __m256 nb = _mm256_fnmadd_ps(lr, delta, b);
-
-                nb = _mm256_min_ps(nb, cmax);
-                nb = _mm256_max_ps(nb, cmin);
-
-                _mm256_store_ps(&biases[i], nb);
-            }
-        }
+        int per_thread, start;
+        split_work(tid, tc, INPUTS*NEURONS*STACK_SIZE, per_thread, start);
 
-        #else
+        adam_update_vectorized(weights, m->weights, v->weights, weight_grads.data(), weight_grads.size(), start, start + per_thread,
+                               p.beta1, p.beta2, p, clamp_min, clamp_max, update_weights);
 
-        int per_thread = INPUTS*NEURONS / tc;
-        int start = per_thread*tid;
+        split_work(tid, tc, NEURONS*STACK_SIZE, per_thread, start);
 
-        for (int i = start; i < start + per_thread; i++) {
-            weights[i] -= grad->weights[i]*learning_rate / sqrt(pg->weights[i] + epsilon);
-        }
-        if (tid == 0) {
-            for (int i = 0; i < NEURONS; i++) {
-                biases[i] -= grad->biases[i]*learning_rate / sqrt(pg->biases[i] + epsilon);
-            }
-        }
-
-        #endif
+        adam_update_vectorized(biases, m->biases, v->biases, bias_grads.data(), bias_grads.size(), start, start + per_thread,
+                               p.beta1, p.beta2, p, clamp_min, clamp_max, update_weights);
     }
 
-
+    size_t memory_usage() const {
+        return (INPUTS*NEURONS*STACK_SIZE + NEURONS*STACK_SIZE)*sizeof(float);
+    }
 
     float *weights;
     float *biases;
@@ -508,253 +832,76 @@ struct training_layer
     }
 
 
-    void update(int neuron, int bucket, float *prev_layer) {
+    //Neurons are processed in blocks sharing every loaded input vector
+    void accumulate(int bucket, const float *prev_layer, int offset, int n) {
+        constexpr int block_rows = 8;
+        constexpr int blocked = OUT - OUT % block_rows;
+        const float *w = &weights->weights[IN*OUT*bucket + offset];
 
-        #if USE_AVX2
-
-        __m256 n = _mm256_set1_ps(0.0f);
-
-        for (int j = 0; j < IN; j += 8) {
-            __m256 l0 = _mm256_load_ps(&prev_layer[j]);
-            __m256 w = _mm256_load_ps(&weights->weights[IN*OUT*bucket + neuron*IN + j]);
-
-            n = _mm256_fmadd_ps(l0, w, n);
+        for (int i = 0; i < blocked; i += block_rows) {
+            dot_rows_vectorized<block_rows>(&w[i*IN], IN, prev_layer, n, &acculumator[i]);
         }
-
-        __m128 a = _mm256_extractf128_ps(n, 0);
-        __m128 b = _mm256_extractf128_ps(n, 1);
-
-        __m128 h = _mm_hadd_ps(a, b);
-
-
-        union {
-            int i[4];
-            float f[4];
-        } data;
-
-        data.i[0] = _mm_extract_ps(h, 0);
-        data.i[1] = _mm_extract_ps(h, 1);
-        data.i[2] = _mm_extract_ps(h, 2);
-        data.i[3] = _mm_extract_ps(h, 3);
-
-        acculumator[neuron] = data.f[0] + data.f[1] + data.f[2] + data.f[3] + weights->biases[OUT*bucket + neuron];
-
-        #else
-
-        acculumator[neuron] = weights->biases[OUT*bucket + neuron];
-        for (int i = 0; i < IN; i++) {
-            acculumator[neuron] += prev_layer[i]*weights->weights[IN*OUT*bucket + neuron*IN + i];
-        }
-
-        #endif
-
-        if (IS_OUTPUT_LAYER) {
-            neurons[neuron] = activation_func_out(acculumator[neuron]);
-        } else {
-            neurons[neuron] = activation_func(acculumator[neuron]);
+        for (int i = blocked; i < OUT; i++) {
+            dot_rows_vectorized<1>(&w[i*IN], IN, prev_layer, n, &acculumator[i]);
         }
     }
 
-    void update(int neuron, int bucket, float *prev_layer0, float *prev_layer1) {
-
-        #if USE_AVX2
-
-        __m256 n = _mm256_set1_ps(0.0f);
-
-        for (int j = 0; j < IN/2; j += 8) {
-            __m256 l0 = _mm256_load_ps(&prev_layer0[j]);
-            __m256 w = _mm256_load_ps(&weights->weights[IN*OUT*bucket + neuron*IN + j]);
-
-            n = _mm256_fmadd_ps(l0, w, n);
-        }
-
-        for (int j = 0; j < IN/2; j += 8) {
-            __m256 l0 = _mm256_load_ps(&prev_layer1[j]);
-            __m256 w = _mm256_load_ps(&weights->weights[IN*OUT*bucket + neuron*IN + j + (IN/2)]);
-
-            n = _mm256_fmadd_ps(l0, w, n);
-        }
-
-        __m128 a = _mm256_extractf128_ps(n, 0);
-        __m128 b = _mm256_extractf128_ps(n, 1);
-
-        __m128 h = _mm_hadd_ps(a, b);
-
-
-        union {
-            int i[4];
-            float f[4];
-        } data;
-
-        data.i[0] = _mm_extract_ps(h, 0);
-        data.i[1] = _mm_extract_ps(h, 1);
-        data.i[2] = _mm_extract_ps(h, 2);
-        data.i[3] = _mm_extract_ps(h, 3);
-
-        acculumator[neuron] = data.f[0] + data.f[1] + data.f[2] + data.f[3] + weights->biases[OUT*bucket + neuron];
-
-        #else
-
-        acculumator[neuron] = weights->biases[OUT*bucket + neuron];
-        for (int i = 0; i < IN/2; i++) {
-            acculumator[neuron] += weights->weights[IN*OUT*bucket + neuron*IN + i]*prev_layer0[i];
-            acculumator[neuron] += weights->weights[IN*OUT*bucket + neuron*IN + i + (IN/2)]*prev_layer1[i];
-        }
-
-        #endif
-
-        if (IS_OUTPUT_LAYER) {
-            neurons[neuron] = activation_func_out(acculumator[neuron]);
-        } else {
-            neurons[neuron] = activation_func(acculumator[neuron]);
+    void activate() {
+        for (int i = 0; i < OUT; i++) {
+            if (IS_OUTPUT_LAYER) {
+                neurons[i] = activation_func_out(acculumator[i]);
+            } else {
+                neurons[i] = activation_func(acculumator[i]);
+            }
         }
     }
 
     void update(int bucket, float *prev_layer) {
         for (int i = 0; i < OUT; i++) {
-            update(i, bucket, prev_layer);
+            acculumator[i] = weights->biases[OUT*bucket + i];
         }
+        accumulate(bucket, prev_layer, 0, IN);
+        activate();
     }
 
     void update(int bucket, float *prev_layer0, float *prev_layer1) {
         for (int i = 0; i < OUT; i++) {
-            update(i, bucket, prev_layer0, prev_layer1);
+            acculumator[i] = weights->biases[OUT*bucket + i];
         }
+        accumulate(bucket, prev_layer0, 0, IN/2);
+        accumulate(bucket, prev_layer1, IN/2, IN/2);
+        activate();
     }
 
-    void back_propagate(int bucket, training_layer_weights<IN,OUT, STACK_SIZE,IS_OUTPUT_LAYER> *gradients, float *prev_layer_grads0, float *prev_layer_grads1, float *prev_layer_activations0, float *prev_layer_activations1) {
-
-        for (int i = 0; i < IN/2; i++) {
-            prev_layer_grads0[i] = 0;
-            prev_layer_grads1[i] = 0;
-        }
-
-        #if USE_AVX2
-
-
+    //Cost derivative of every neuron's input, also accumulated to bias gradients
+    void neuron_deltas(int bucket, training_layer_weights<IN,OUT, STACK_SIZE,IS_OUTPUT_LAYER> *gradients, float *deltas) {
         for (int i = 0; i < OUT; i++) {
-            //float a = neurons[i]; //Activvation
             float x = acculumator[i]; //Neurons input
             float dc = grads[i]; //cost diff
             float da = (IS_OUTPUT_LAYER ? activation_diff_out(x) : activation_diff(x)); //activation diff
 
-
-            __m256 dcda = _mm256_set1_ps(dc*da);
-
-            for (int j = 0; j < IN/2; j += 8) {
-                __m256 l0 = _mm256_load_ps(&prev_layer_activations0[j]);
-                __m256 w = _mm256_load_ps(&weights->weights[IN*OUT*bucket + i*IN + j]);
-                __m256 l0_grads = _mm256_load_ps(&prev_layer_grads0[j]);
-                __m256 g = _mm256_load_ps(&gradients->weights[IN*OUT*bucket + i*IN + j]);
-
-
-                __m256 tmp = _mm256_fmadd_ps(dcda, w, l0_grads);
-                __m256 tmp2 = _mm256_fmadd_ps(dcda, l0, g);
-
-                _mm256_store_ps(&gradients->weights[IN*OUT*bucket + i*IN + j], tmp2);
-                _mm256_store_ps(&prev_layer_grads0[j], tmp);
-            }
-            for (int j = 0; j < IN/2; j += 8) {
-                __m256 l0 = _mm256_load_ps(&prev_layer_activations1[j]);
-                __m256 w = _mm256_load_ps(&weights->weights[IN*OUT*bucket + i*IN + j + IN/2]);
-                __m256 l0_grads = _mm256_load_ps(&prev_layer_grads1[j]);
-                __m256 g = _mm256_load_ps(&gradients->weights[IN*OUT*bucket + i*IN + j + IN/2]);
-
-
-                __m256 tmp = _mm256_fmadd_ps(dcda, w, l0_grads);
-                __m256 tmp2 = _mm256_fmadd_ps(dcda, l0, g);
-
-                _mm256_store_ps(&gradients->weights[IN*OUT*bucket + i*IN + j + IN/2], tmp2);
-                _mm256_store_ps(&prev_layer_grads1[j], tmp);
-            }
-
+            deltas[i] = dc*da;
             gradients->biases[OUT*bucket + i] += dc*da;
         }
+    }
 
-        #else
-
-
-        for (int i = 0; i < OUT; i++) {
-            float x = acculumator[i];
-            float dc = grads[i];
-            float da = (IS_OUTPUT_LAYER ? activation_diff_out(x) : activation_diff(x));
-
-            for (int j = 0; j < IN/2; j++) {
-                float w = weights->weights[IN*OUT*bucket + i*IN + j];
-                float l0 = prev_layer_activations0[j];
-
-                prev_layer_grads0[j] += w*dc*da;
-                gradients->weights[IN*OUT*bucket + i*IN + j] += dc*da*l0;
-            }
-            for (int j = 0; j < IN/2; j++) {
-                float w = weights->weights[IN*OUT*bucket + i*IN + j + IN/2];
-                float l0 = prev_layer_activations1[j];
-
-                prev_layer_grads1[j] += w*dc*da;
-                gradients->weights[IN*OUT*bucket + i*IN + j + IN/2] += dc*da*l0;
-            }
-
-            gradients->biases[OUT*bucket + i] += dc*da;
-        }
+    void back_propagate(int bucket, training_layer_weights<IN,OUT, STACK_SIZE,IS_OUTPUT_LAYER> *gradients, float *prev_layer_grads0, float *prev_layer_grads1, float *prev_layer_activations0, float *prev_layer_activations1) {
+        float deltas[OUT];
+        neuron_deltas(bucket, gradients, deltas);
 
+        const float *w = &weights->weights[IN*OUT*bucket];
+        float *g = &gradients->weights[IN*OUT*bucket];
 
-        #endif
+        backprop_rows_vectorized<OUT>(w, g, IN, deltas, prev_layer_activations0, prev_layer_grads0, IN/2);
+        backprop_rows_vectorized<OUT>(w + IN/2, g + IN/2, IN, deltas, prev_layer_activations1, prev_layer_grads1, IN/2);
     }
 
     void back_propagate(int bucket, training_layer_weights<IN,OUT, STACK_SIZE,IS_OUTPUT_LAYER> *gradients, float *prev_layer_grads, float *prev_layer_activations) {
+        float deltas[OUT];
+        neuron_deltas(bucket, gradients, deltas);
 
-        for (int i = 0; i < IN; i++) {
-            prev_layer_grads[i] = 0;
-        }
-
-        #if USE_AVX2
-
-        for (int i = 0; i < OUT; i++) {
-            //float a = neurons[i]; //Activvation
-            float x = acculumator[i]; //Neurons input
-            float dc = grads[i]; //cost diff
-            float da = (IS_OUTPUT_LAYER ? activation_diff_out(x) : activation_diff(x)); //activation diff
-
-            __m256 dcda = _mm256_set1_ps(dc*da);
-
-            for (int j = 0; j < IN; j += 8) {
-                __m256 l0 = _mm256_load_ps(&prev_layer_activations[j]);
-                __m256 w = _mm256_load_ps(&weights->weights[IN*OUT*bucket + i*IN + j]);
-                __m256 l0_grads = _mm256_load_ps(&prev_layer_grads[j]);
-                __m256 g = _mm256_load_ps(&gradients->weights[IN*OUT*bucket + i*IN + j]);
-
-                __m256 tmp = _mm256_fmadd_ps(dcda, w, l0_grads);
-                __m256 tmp2 = _mm256_fmadd_ps(dcda, l0, g);
-
-                _mm256_store_ps(&prev_layer_grads[j], tmp);
-                _mm256_store_ps(&gradients->weights[IN*OUT*bucket + i*IN + j], tmp2);
-            }
-
-            gradients->biases[OUT*bucket + i] += dc*da;
-        }
-
-        #else
-
-        for (int i = 0; i < OUT; i++) {
-            //float a = neurons[i]; //Activvation
-            float x = acculumator[i]; //Neurons input
-            float dc = grads[i]; //cost diff
-            float da = (IS_OUTPUT_LAYER ? activation_diff_out(x) : activation_diff(x)); //activation diff
-
-
-            for (int j = 0; j < IN; j++) {
-                float w = weights->weights[IN*OUT*bucket + i*IN + j];
-                float l0 = prev_layer_activations[j];
-
-                prev_layer_grads[j] += w*dc*da;
-                gradients->weights[IN*OUT*bucket + i*IN + j] += dc*da*l0;
-            }
-
-            gradients->biases[OUT*bucket + i] += dc*da;
-        }
-
-
-        #endif
+        backprop_rows_vectorized<OUT>(&weights->weights[IN*OUT*bucket], &gradients->weights[IN*OUT*bucket], IN, deltas,
+                                      prev_layer_activations, prev_layer_grads, IN);
     }
 
     float *neurons;
@@ -8,6 +8,8 @@ float training_network::evaluate(const board_state &s)
     white_side.use_factorizer = use_factorizer;
     black_side.use_factorizer = use_factorizer;
 
+    invalidate_acculumators();
+
     black_side.reset();
     white_side.reset();
 
@@ -73,9 +75,6 @@ float training_network::evaluate(const training_position &tp)
     white_side.use_factorizer = use_factorizer;
     black_side.use_factorizer = use_factorizer;
 
-    black_side.reset();
-    white_side.reset();
-
     int num_of_pieces = tp.count_pieces();
     uint64_t occupation = tp.occupation;
     int index = 0;
@@ -107,6 +106,10 @@ float training_network::evaluate(const training_position &tp)
 
     bitboard non_pawn_pieces = 0;
 
+    int white_inputs[max_inputs_per_sample];
+    int black_inputs[max_inputs_per_sample];
+    int num_of_inputs = 0;
+
     for (int i = 0; i < num_of_pieces; i++) {
         p.d = tp.iterate_pieces(occupation, index, sq_index);
 
@@ -120,21 +123,28 @@ float training_network::evaluate(const training_position &tp)
         int flipped_sq_index = sq_index^56;
         int flipped_color = (color == BLACK ? WHITE : BLACK);
 
-        int white_input = encode_input_with_buckets(type, color, sq_index, white_king_sq);
-        int black_input = encode_input_with_buckets(type, flipped_color, flipped_sq_index, black_king_sq);
-
-        white_side.prefetch_input(white_input);
-        black_side.prefetch_input(black_input);
+        white_inputs[num_of_inputs] = encode_input_with_buckets(type, color, sq_index, white_king_sq);
+        black_inputs[num_of_inputs] = encode_input_with_buckets(type, flipped_color, flipped_sq_index, black_king_sq);
+        num_of_inputs++;
 
         if (use_factorizer) {
-            white_side.set_input(encode_factorizer_input(type, color, sq_index, white_king_sq));
-            black_side.set_input(encode_factorizer_input(type, flipped_color, flipped_sq_index, black_king_sq));
+            white_inputs[num_of_inputs] = encode_factorizer_input(type, color, sq_index, white_king_sq);
+            black_inputs[num_of_inputs] = encode_factorizer_input(type, flipped_color, flipped_sq_index, black_king_sq);
+            num_of_inputs++;
         }
+    }
 
-        white_side.set_input(white_input);
-        black_side.set_input(black_input);
+    if (!incremental_acculumators) {
+        invalidate_acculumators();
     }
 
+    //Sorted inputs let perspectives diff them against previous sample
+    std::sort(white_inputs, white_inputs + num_of_inputs);
+    std::sort(black_inputs, black_inputs + num_of_inputs);
+
+    white_side.set_inputs(white_inputs, num_of_inputs);
+    black_side.set_inputs(black_inputs, num_of_inputs);
+
     output_bucket = encode_output_bucket(non_pawn_pieces);
 
     white_side.update();
@@ -161,7 +171,7 @@ float training_network::evaluate(const training_position &tp)
     return output_layer.neurons[0] + psqt_output;
 }
 
-void training_network::back_propagate(training_weights &grad, float loss_delta, player_type_t stm, bool freeze_perspective)
+void training_network::back_propagate(training_gradients &grad, float loss_delta, player_type_t stm, bool freeze_perspective)
 {
     output_layer.grads[0] = loss_delta;
 
@@ -194,14 +204,27 @@ void training_network::back_propagate(training_weights &grad, float loss_delta,
     }
 }
 
+void training_weights::save(std::ostream &stream)
+{
+    perspective_weights.save(stream);
+    layer1_weights.save(stream);
+    layer2_weights.save(stream);
+    output_weights.save(stream);
+}
+
+void training_weights::load(std::istream &stream)
+{
+    perspective_weights.load(stream);
+    layer1_weights.load(stream);
+    layer2_weights.load(stream);
+    output_weights.load(stream);
+}
+
 void training_weights::save_file(std::string path)
 {
     std::ofstream file(path.c_str(), std::ios::binary);
     if (file.is_open()) {
-        perspective_weights.save(file);
-        layer1_weights.save(file);
-        layer2_weights.save(file);
-        output_weights.save(file);
+        save(file);
     }
     file.close();
 }
@@ -210,10 +233,7 @@ void training_weights::load_file(std::string path)
 {
     std::ifstream file(path.c_str(), std::ios::binary);
     if (file.is_open()) {
-        perspective_weights.load(file);
-        layer1_weights.load(file);
-        layer2_weights.load(file);
-        output_weights.load(file);
+        load(file);
     }
     file.close();
 }
@@ -17,77 +17,54 @@ struct piece;
 struct square_index;
 enum player_type_t: unsigned char;
 
-struct training_weights
+//Gradient of one worker. Perspective gradient is row sparse, layer gradients are dense.
+struct training_gradients
 {
-    training_perspective_weights<num_perspective_inputs + factorizer_inputs, num_perspective_neurons + num_perspective_psqt> perspective_weights;
+    sparse_perspective_gradient<num_perspective_inputs + factorizer_inputs, num_perspective_neurons + num_perspective_psqt> perspective_weights;
     training_layer_weights<num_perspective_neurons, layer1_neurons, layer_stack_size, false> layer1_weights;
     training_layer_weights<layer1_neurons, layer2_neurons, layer_stack_size, false> layer2_weights;
     training_layer_weights<layer2_neurons, 1, layer_stack_size, true> output_weights;
 
+    void zero() {
+        perspective_weights.zero();
 
-    void copy_from(const training_weights &other, int tid, int tc) {
-        perspective_weights.copy_from(other.perspective_weights, tid, tc);
-
-        layer1_weights.copy_from(other.layer1_weights, tid, tc);
-        layer2_weights.copy_from(other.layer2_weights, tid, tc);
-
-        output_weights.copy_from(other.output_weights, tid, tc);
-    }
-
-    void add(const training_weights &other, int tid, int tc) {
-        perspective_weights.add(other.perspective_weights, tid, tc);
-
-        layer1_weights.add(other.layer1_weights, tid, tc);
-        layer2_weights.add(other.layer2_weights, tid, tc);
+        layer1_weights.zero(0, 1);
+        layer2_weights.zero(0, 1);
 
-        output_weights.add(other.output_weights, tid, tc);
+        output_weights.zero(0, 1);
     }
 
-    void mult(float val, int tid, int tc) {
-        perspective_weights.mult(val, tid, tc);
-
-        layer1_weights.mult(val, tid, tc);
-        layer2_weights.mult(val, tid, tc);
-
-        output_weights.mult(val, tid, tc);
-    }
+    void divide(float val) {
+        float inv_val = 1.0f / val;
 
-    void mult(training_weights &other, float val, int tid, int tc) {
-        perspective_weights.mult(other.perspective_weights, val, tid, tc);
+        perspective_weights.mult(inv_val);
 
-        layer1_weights.mult(other.layer1_weights, val, tid, tc);
-        layer2_weights.mult(other.layer2_weights, val, tid, tc);
+        layer1_weights.mult(inv_val, 0, 1);
+        layer2_weights.mult(inv_val, 0, 1);
 
-        output_weights.mult(other.output_weights, val, tid, tc);
+        output_weights.mult(inv_val, 0, 1);
     }
 
-    void squared(training_weights &other, int tid, int tc) {
-        perspective_weights.squared(other.perspective_weights, tid, tc);
-
-        layer1_weights.squared(other.layer1_weights, tid, tc);
-        layer2_weights.squared(other.layer2_weights, tid, tc);
-
-        output_weights.squared(other.output_weights, tid, tc);
+    size_t memory_usage() const {
+        return perspective_weights.memory_usage() + layer1_weights.memory_usage() + layer2_weights.memory_usage() + output_weights.memory_usage();
     }
+};
 
-    void exponential_smoothing(training_weights &other, float factor, int tid, int tc) {
-        perspective_weights.exponential_smoothing(other.perspective_weights, factor, tid, tc);
-
-        layer1_weights.exponential_smoothing(other.layer1_weights, factor, tid, tc);
-        layer2_weights.exponential_smoothing(other.layer2_weights, factor, tid, tc);
-
-        output_weights.exponential_smoothing(other.output_weights, factor, tid, tc);
-    }
+struct training_weights
+{
+    training_perspective_weights<num_perspective_inputs + factorizer_inputs, num_perspective_neurons + num_perspective_psqt> perspective_weights;
+    training_layer_weights<num_perspective_neurons, layer1_neurons, layer_stack_size, false> layer1_weights;
+    training_layer_weights<layer1_neurons, layer2_neurons, layer_stack_size, false> layer2_weights;
+    training_layer_weights<layer2_neurons, 1, layer_stack_size, true> output_weights;
 
-    void divide(float val, int tid, int tc) {
-        float inv_val = 1.0f / val;
 
-        perspective_weights.mult(inv_val, tid, tc);
+    void copy_from(const training_weights &other, int tid, int tc) {
+        perspective_weights.copy_from(other.perspective_weights, tid, tc);
 
-        layer1_weights.mult(inv_val, tid, tc);
-        layer2_weights.mult(inv_val, tid, tc);
+        layer1_weights.copy_from(other.layer1_weights, tid, tc);
+        layer2_weights.copy_from(other.layer2_weights, tid, tc);
 
-        output_weights.mult(inv_val, tid, tc);
+        output_weights.copy_from(other.output_weights, tid, tc);
     }
 
     void zero(int tid, int tc) {
@@ -99,38 +76,74 @@ struct training_weights
         output_weights.zero(tid, tc);
     }
 
-
     void copy_from(const training_weights &other) {
         copy_from(other, 0, 1);
     }
 
-    void add(const training_weights &other) {
-        add(other, 0, 1);
+    void zero() {
+        zero(0, 1);
     }
 
-    void mult(float val) {
-        mult(val, 0, 1);
-    }
 
-    void squared(training_weights &other) {
-        squared(other, 0, 1);
-    }
 
-    void divide(float val) {
-        divide(val, 0, 1);
+    size_t memory_usage() const {
+        return perspective_weights.memory_usage() + layer1_weights.memory_usage() + layer2_weights.memory_usage() + output_weights.memory_usage();
     }
 
+    void save(std::ostream &stream);
+    void load(std::istream &stream);
+
+    void save_file(std::string path);
+    void load_file(std::string path);
+
+
+    void save_quantized(std::string path);
+};
+
+
+//Adam moment of training_weights, stored in moment_t
+struct training_moments
+{
+    decltype(training_weights::perspective_weights)::moments perspective_weights;
+    decltype(training_weights::layer1_weights)::moments layer1_weights;
+    decltype(training_weights::layer2_weights)::moments layer2_weights;
+    decltype(training_weights::output_weights)::moments output_weights;
+
     void zero() {
-        zero(0, 1);
+        perspective_weights.zero();
+
+        layer1_weights.zero();
+        layer2_weights.zero();
+
+        output_weights.zero();
     }
 
+    void copy_from(const training_moments &other) {
+        perspective_weights.copy_from(other.perspective_weights);
 
+        layer1_weights.copy_from(other.layer1_weights);
+        layer2_weights.copy_from(other.layer2_weights);
 
-    void save_file(std::string path);
-    void load_file(std::string path);
+        output_weights.copy_from(other.output_weights);
+    }
 
+    void save(std::ostream &stream) {
+        perspective_weights.save(stream);
+        layer1_weights.save(stream);
+        layer2_weights.save(stream);
+        output_weights.save(stream);
+    }
 
-    void save_quantized(std::string path);
+    void load(std::istream &stream) {
+        perspective_weights.load(stream);
+        layer1_weights.load(stream);
+        layer2_weights.load(stream);
+        output_weights.load(stream);
+    }
+
+    size_t memory_usage() const {
+        return perspective_weights.memory_usage() + layer1_weights.memory_usage() + layer2_weights.memory_usage() + output_weights.memory_usage();
+    }
 };
 
 
@@ -140,17 +153,26 @@ struct training_network
                                                            white_side(&w->perspective_weights),
                                                            layer1(&w->layer1_weights),
                                                            layer2(&w->layer2_weights),
-                                                           output_layer(&w->output_weights), weights(w) { use_factorizer = true;};
+                                                           output_layer(&w->output_weights), weights(w) { use_factorizer = true; incremental_acculumators = true;};
 
     float evaluate(const board_state &s);
-    float evaluate(const training_position &tp);
+
+    //Updates perspective accumulators from previous evaluated sample when possible
+    float evaluate(const training_position &tp);
+
+    //Must be called when weights change between evaluations
+    void invalidate_acculumators() {
+        white_side.invalidate();
+        black_side.invalidate();
+    }
 
-    void back_propagate(training_weights &grad, float loss_delta, player_type_t stm, bool freeze_perspective);
+    void back_propagate(training_gradients &grad, float loss_delta, player_type_t stm, bool freeze_perspective);
 
     float last_psqt_eval;
     float last_pos_eval;
 
     bool use_factorizer;
+    bool incremental_acculumators;
 
     training_perspective<num_perspective_inputs + factorizer_inputs, num_perspective_neurons, num_perspective_psqt> black_side;
     training_perspective<num_perspective_inputs + factorizer_inputs, num_perspective_neurons, num_perspective_psqt> white_side;
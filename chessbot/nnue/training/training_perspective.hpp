@@ -5,9 +5,15 @@
 #include "../nnue_defs.hpp"
 
 
+//Piece and factorizer input of every piece
+constexpr int max_inputs_per_sample = 64;
+
+
 template <int INPUTS, int NEURONS>
 struct training_perspective_weights
 {
+    typedef training_moments_tensor<(size_t)INPUTS*NEURONS, NEURONS> moments;
+
     training_perspective_weights() {
         weights_buffer = new float[INPUTS*NEURONS + 64];
         biases_buffer = new float[NEURONS + 64];
@@ -115,31 +121,6 @@ struct training_perspective_weights
         set_vectorized<NEURONS*INPUTS>(weights, 0.0f, tid, tc);
     }
 
-    void add(const training_perspective_weights<INPUTS, NEURONS> &other, int tid, int tc) {
-        add_vectorized<NEURONS>(biases, biases, other.biases, tid, tc);
-        add_vectorized<NEURONS*INPUTS>(weights, weights, other.weights, tid, tc);
-    }
-
-    void mult(float val, int tid, int tc) {
-        mult_vectorized<NEURONS>(biases, biases, val, tid, tc);
-        mult_vectorized<NEURONS*INPUTS>(weights, weights, val, tid, tc);
-    }
-
-    void mult(const training_perspective_weights<INPUTS, NEURONS> &other, float val, int tid, int tc) {
-        mult_vectorized<NEURONS>(biases, other.biases, val, tid, tc);
-        mult_vectorized<NEURONS*INPUTS>(weights, other.weights, val, tid, tc);
-    }
-
-    void squared(const training_perspective_weights<INPUTS, NEURONS> &other, int tid, int tc) {
-        mult_vectorized<NEURONS>(biases, other.biases, other.biases, tid, tc);
-        mult_vectorized<NEURONS*INPUTS>(weights, other.weights, other.weights, tid, tc);
-    }
-
-    void exponential_smoothing(const training_perspective_weights<INPUTS, NEURONS> &other, float factor, int tid, int tc) {
-        ema_vectorized<NEURONS>(biases, other.biases, factor, tid, tc);
-        ema_vectorized<NEURONS*INPUTS>(weights, other.weights, factor, tid, tc);
-    }
-
     int num_of_biases() const {
         return NEURONS;
     }
@@ -152,115 +133,156 @@ struct training_perspective_weights
         return NEURONS + quantized_perspective_pad + (num_perspective_inputs*(NEURONS + quantized_perspective_pad));
     }
 
-    void rmsprop(training_perspective_weights<INPUTS, NEURONS> *grad, training_perspective_weights<INPUTS, NEURONS> *pg, float learning_rate, float weight_decay, int tid, int tc)
+    //Adam update of single input row. Rows are updated lazily only in steps when they are active, so moments of row are
+    //first decayed for skipped steps, which is same as applying zero gradient in them. Weight updates of skipped steps are not applied.
+    void adam_update_row(int input, const float *const *grads, int num_of_grads, moments *m, moments *v,
+                         int skipped_steps, const adam_step_params &p)
     {
-        float epsilon = 0.0000001f;
+        float m_decay = std::pow(p.beta1, skipped_steps + 1);
+        float v_decay = std::pow(p.beta2, skipped_steps + 1);
 
-        #if USE_AVX2
+        size_t offset = (size_t)input*NEURONS;
 
-        __m256 cmin = _mm256_set1_ps(halfkp_quantization_clamp_min);
-        __m256 cmax = _mm256_set1_ps(halfkp_quantization_clamp_max);
-
-        __m256 psqt_cmin = _mm256_set1_ps(psqt_clamp_min);
-        __m256 psqt_cmax = _mm256_set1_ps(psqt_clamp_max);
+        adam_update_vectorized(&weights[offset], &m->weights[offset], &v->weights[offset], grads, num_of_grads, 0, num_perspective_neurons,
+                               m_decay, v_decay, p, halfkp_quantization_clamp_min, halfkp_quantization_clamp_max, true, offset);
+        adam_update_vectorized(&weights[offset], &m->weights[offset], &v->weights[offset], grads, num_of_grads, num_perspective_neurons, NEURONS,
+                               m_decay, v_decay, p, psqt_clamp_min, psqt_clamp_max, true, offset);
+    }
 
-        __m256 lr = _mm256_set1_ps(learning_rate);
-        __m256 wd = _mm256_set1_ps(weight_decay);
+    void adam_update_biases(const float *const *grads, int num_of_grads, moments *m, moments *v, const adam_step_params &p)
+    {
+        adam_update_vectorized(biases, m->biases, v->biases, grads, num_of_grads, 0, NEURONS,
+                               p.beta1, p.beta2, p, halfkp_quantization_clamp_min, halfkp_quantization_clamp_max, true);
+    }
 
-        int per_thread, start;
-        split_work(tid, tc, INPUTS*NEURONS, per_thread, start);
+    size_t memory_usage() const {
+        return ((size_t)INPUTS*NEURONS + NEURONS)*sizeof(float);
+    }
 
-        for (int i = start; i < start + per_thread; i += 8) {
-            int n = i % NEURONS;
+    void coalesce_factorizer_weights() {
+        for (size_t i = 0; i < num_of_king_buckets; i++) {
+            for (size_t j = 0; j < inputs_per_bucket; j++) {
+                for (size_t k = 0; k < NEURONS; k++) {
+                    size_t input_index = i*inputs_per_bucket + j;
+                    size_t factorizer_input_index = num_of_king_buckets*inputs_per_bucket + j;
 
-            __m256 w = _mm256_load_ps(&weights[i]);
-            __m256 g = _mm256_load_ps(&grad->weights[i]);
+                    weights[input_index*NEURONS + k] += weights[factorizer_input_index*NEURONS + k];
+                }
+            }
+        }
+        for (size_t i = 0; i < inputs_per_bucket; i++) {
+            for (size_t j = 0; j < NEURONS; j++) {
+                size_t factorizer_input_index = num_of_king_buckets*inputs_per_bucket + i;
 
-            __m256 v = _mm256_load_ps(&pg->weights[i]);
+                weights[factorizer_input_index*NEURONS + j] = 0;
+            }
+        }
+    }
 
-            __m256 delta = _mm256_fmadd_ps(g, inv_sqrt_plus_eps(v, epsilon), _mm256_mul_ps(w, wd));
 
-            __m256 nw = _mm256_fnmadd_ps(lr, delta, w);
-
-            if (n < num_perspective_neurons) {
-                nw = _mm256_min_ps(nw, cmax);
-                nw = _mm256_max_ps(nw, cmin);
-            } else {
-                nw = _mm256_min_ps(nw, psqt_cmax);
-                nw = _mm256_max_ps(nw, psqt_cmin);
-            }
+    float *weights;
+    float *biases;
 
-            _mm256_store_ps(&weights[i], nw);
-        }
+    float *weights_buffer;
+    float *biases_buffer;
+};
 
-        if (tid == 0) {
-            for (int i = 0; i < NEURONS; i += 8) {
 
-                __m256 b = _mm256_load_ps(&biases[i]);
-                __m256 g = _mm256_load_ps(&grad->biases[i]);
 
-                __m256 v = _mm256_load_ps(&pg->biases[i]);
+//Gradient of perspective weights which stores only rows of inputs that were active in batch.
+//Rows are packed in order of first use into chunks, which are allocated as number of active rows grows and reused
+//for later batches, so memory is proportional to the largest number of active inputs in a batch.
+template <int INPUTS, int NEURONS>
+struct sparse_perspective_gradient
+{
+    static constexpr int rows_per_chunk = 256;
 
-                __m256 delta = _mm256_fmadd_ps(g, inv_sqrt_plus_eps(v, epsilon), _mm256_mul_ps(b, wd));
+    sparse_perspective_gradient() {
+        biases_buffer = new float[NEURONS + 64];
+        row_slots = new int[INPUTS];
 
-                __m256 nb = _mm256_fnmadd_ps(lr, delta, b);
+        biases = align_ptr(biases_buffer);
 
-                nb = _mm256_min_ps(nb, cmax);
-                nb = _mm256_max_ps(nb, cmin);
+        std::fill(row_slots, row_slots + INPUTS, -1);
+        num_of_rows = 0;
+        set_vectorized<NEURONS>(biases, 0.0f, 0, 1);
+    }
 
-                _mm256_store_ps(&biases[i], nb);
-            }
+    ~sparse_perspective_gradient() {
+        for (float *buffer : chunk_buffers) {
+            delete [] buffer;
         }
+        delete [] biases_buffer;
+        delete [] row_slots;
+    }
 
-        #else
+    sparse_perspective_gradient(const sparse_perspective_gradient&) = delete;
+    sparse_perspective_gradient &operator=(const sparse_perspective_gradient&) = delete;
 
-        int per_thread = INPUTS*NEURONS / tc;
-        int start = per_thread*tid;
+    float *get_row(int input) {
+        int slot = row_slots[input];
+        if (slot < 0) {
+            slot = num_of_rows++;
+            row_slots[input] = slot;
+            rows.push_back(input);
 
-        for (int i = start; i < start + per_thread; i++) {
-            weights[i] -= grad->weights[i]*learning_rate / sqrt(pg->weights[i] + epsilon);
-        }
-        if (tid == 0) {
-            for (int i = 0; i < NEURONS; i++) {
-                biases[i] -= grad->biases[i]*learning_rate / sqrt(pg->biases[i] + epsilon);
+            if ((size_t)(slot / rows_per_chunk) >= chunks.size()) {
+                chunk_buffers.push_back(new float[rows_per_chunk*NEURONS + 64]);
+                chunks.push_back(align_ptr(chunk_buffers.back()));
             }
+            set_vectorized<NEURONS>(get_slot_row(slot), 0.0f, 0, 1);
         }
-
-        #endif
+        return get_slot_row(slot);
     }
 
+    //Returns nullptr when input was not active
+    const float *find_row(int input) const {
+        int slot = row_slots[input];
+        return (slot < 0 ? nullptr : get_slot_row(slot));
+    }
 
+    //Allocated memory, row chunks are kept after batch
+    size_t memory_usage() const {
+        return (chunk_buffers.size()*(rows_per_chunk*NEURONS + 64) + NEURONS + 64)*sizeof(float) +
+               (INPUTS + rows.capacity())*sizeof(int);
+    }
 
-    void coalesce_factorizer_weights() {
-        for (size_t i = 0; i < num_of_king_buckets; i++) {
-            for (size_t j = 0; j < inputs_per_bucket; j++) {
-                for (size_t k = 0; k < NEURONS; k++) {
-                    size_t input_index = i*inputs_per_bucket + j;
-                    size_t factorizer_input_index = num_of_king_buckets*inputs_per_bucket + j;
-
-                    weights[input_index*NEURONS + k] += weights[factorizer_input_index*NEURONS + k];
-                }
-            }
+    void zero() {
+        for (int i = 0; i < num_of_rows; i++) {
+            row_slots[rows[i]] = -1;
         }
-        for (size_t i = 0; i < inputs_per_bucket; i++) {
-            for (size_t j = 0; j < NEURONS; j++) {
-                size_t factorizer_input_index = num_of_king_buckets*inputs_per_bucket + i;
+        rows.clear();
+        num_of_rows = 0;
+        set_vectorized<NEURONS>(biases, 0.0f, 0, 1);
+    }
 
-                weights[factorizer_input_index*NEURONS + j] = 0;
-            }
+    void mult(float val) {
+        for (int i = 0; i < num_of_rows; i++) {
+            mult_vectorized<NEURONS>(get_slot_row(i), get_slot_row(i), val, 0, 1);
         }
+        mult_vectorized<NEURONS>(biases, biases, val, 0, 1);
     }
 
-
-    float *weights;
     float *biases;
 
-    float *weights_buffer;
+    //Input index of each packed row
+    std::vector<int> rows;
+    int num_of_rows;
+
+private:
+    float *get_slot_row(int slot) const {
+        return &chunks[slot / rows_per_chunk][(slot % rows_per_chunk)*NEURONS];
+    }
+
+    int *row_slots;
+
+    std::vector<float*> chunks;
+    std::vector<float*> chunk_buffers;
+
     float *biases_buffer;
 };
 
 
-
 template <int INPUTS, int NEURONS, int PSQT>
 struct training_perspective
 {
@@ -277,10 +299,18 @@ struct training_perspective
         acculumator = align_ptr(acculumator_buffer);
         grads = align_ptr(grads_buffer);
         active_inputs = align_ptr(active_inputs_buffer);
-        output = align_ptr(output_buffer);
+        output = align_ptr(output_buffer);
         output_grads = align_ptr(output_grads_buffer);
 
         king_bucket = -1;
+
+        num_of_active_inputs = 0;
+        acculumator_valid = false;
+        updates_since_refresh = 0;
+
+        refreshes = 0;
+        incremental_updates = 0;
+        rows_applied = 0;
     }
 
     ~training_perspective() {
@@ -314,28 +344,78 @@ struct training_perspective
     }
 
     void set_input(int index) {
-        float *w = &weights->weights[index*(NEURONS+PSQT)];
+        add_row_vectorized(acculumator, &weights->weights[index*(NEURONS+PSQT)], NEURONS+PSQT);
 
-        #if USE_AVX2
+        active_inputs[num_of_active_inputs++] = index;
+    }
 
-        for (int i = 0; i < NEURONS+PSQT; i += 8) {
-            __m256 a = _mm256_load_ps(&acculumator[i]);
-            __m256 b = _mm256_load_ps(&w[i]);
+    void add_row(int index, float sign) {
+        add_scaled_row_vectorized(acculumator, &weights->weights[index*(NEURONS+PSQT)], sign, NEURONS+PSQT);
+    }
 
-            __m256 tmp = _mm256_add_ps(a, b);
+    //Accumulator of previous sample no longer matches weights
+    void invalidate() {
+        acculumator_valid = false;
+    }
 
-            _mm256_store_ps(&acculumator[i], tmp);
+    //Sets accumulator to sorted inputs. When previous sample's accumulator is still valid and shares enough inputs, only
+    //removed and added rows are applied. Accumulator is rebuilt every max_incremental_updates to keep rounding from drifting.
+    void set_inputs(const int *inputs, int n) {
+        constexpr int max_incremental_updates = 64;
+
+        int removed[max_inputs_per_sample];
+        int added[max_inputs_per_sample];
+        int num_of_removed = 0;
+        int num_of_added = 0;
+
+        bool incremental = acculumator_valid && updates_since_refresh < max_incremental_updates;
+
+        if (incremental) {
+            int i = 0;
+            int j = 0;
+            while (i < num_of_active_inputs || j < n) {
+                if (j == n || (i < num_of_active_inputs && active_inputs[i] < inputs[j])) {
+                    removed[num_of_removed++] = active_inputs[i++];
+                } else if (i == num_of_active_inputs || inputs[j] < active_inputs[i]) {
+                    added[num_of_added++] = inputs[j++];
+                } else {
+                    i++;
+                    j++;
+                }
+            }
+            incremental = (num_of_removed + num_of_added < n);
         }
 
-        #else
+        if (incremental) {
+            for (int i = 0; i < num_of_added; i++) {
+                prefetch_input(added[i]);
+            }
+            for (int i = 0; i < num_of_removed; i++) {
+                add_row(removed[i], -1.0f);
+            }
+            for (int i = 0; i < num_of_added; i++) {
+                add_row(added[i], 1.0f);
+            }
+            std::copy(inputs, inputs + n, active_inputs);
+            num_of_active_inputs = n;
+
+            updates_since_refresh++;
+            incremental_updates++;
+            rows_applied += num_of_removed + num_of_added;
+        } else {
+            reset();
+            for (int i = 0; i < n; i++) {
+                prefetch_input(inputs[i]);
+            }
+            for (int i = 0; i < n; i++) {
+                set_input(inputs[i]);
+            }
 
-        for (int i = 0; i < NEURONS+PSQT; i++) {
-            acculumator[i] += w[i];
+            updates_since_refresh = 0;
+            refreshes++;
+            rows_applied += n;
         }
-
-        #endif
-
-        active_inputs[num_of_active_inputs++] = index;
+        acculumator_valid = true;
     }
 
 
@@ -391,7 +471,7 @@ struct training_perspective
 
     }
 
-    void back_propagate(training_perspective_weights<INPUTS, NEURONS+PSQT> *gradients) {
+    void back_propagate(sparse_perspective_gradient<INPUTS, NEURONS+PSQT> *gradients) {
 
         #if USE_AVX2
 
@@ -428,26 +508,6 @@ struct training_perspective
 
         }
 
-        for (int i = 0; i < num_of_active_inputs; i++) {
-            int input = active_inputs[i];
-
-            for (int j = 0; j < NEURONS+PSQT; j += 8) {
-                __m256 g0 = _mm256_load_ps(&grads[j]);
-                __m256 g1 = _mm256_load_ps(&gradients->weights[input*(NEURONS+PSQT) + j]);
-
-                _mm256_store_ps(&gradients->weights[input*(NEURONS+PSQT) + j], _mm256_add_ps(g0, g1));
-
-            }
-        }
-
-        for (int i = 0; i < NEURONS+PSQT; i += 8) {
-            __m256 g0 = _mm256_load_ps(&grads[i]);
-            __m256 g1 = _mm256_load_ps(&gradients->biases[i]);
-
-            _mm256_store_ps(&gradients->biases[i], _mm256_add_ps(g0, g1));
-
-        }
-
         #else
 
         for (int i = 0; i < NEURONS/2; i++) {
@@ -468,17 +528,12 @@ struct training_perspective
             grads[i] = dc*da;
         }
 
+        #endif
+
         for (int i = 0; i < num_of_active_inputs; i++) {
-            int input = active_inputs[i];
-            for (int j = 0; j < NEURONS+PSQT; j++) {
-                gradients->weights[input*(NEURONS+PSQT) + j] += grads[j];
-            }
-        }
-        for (int i = 0; i < NEURONS+PSQT; i++) {
-            gradients->biases[i] += grads[i];
+            add_row_vectorized(gradients->get_row(active_inputs[i]), grads, NEURONS+PSQT);
         }
-
-        #endif
+        add_row_vectorized(gradients->biases, grads, NEURONS+PSQT);
     }
 
     float output_sparsity() {
@@ -511,5 +566,13 @@ struct training_perspective
     int king_bucket;
     bool use_factorizer;
 
+
+    bool acculumator_valid;
+    int updates_since_refresh;
+
+    size_t refreshes;
+    size_t incremental_updates;
+    size_t rows_applied;
+
     training_perspective_weights<INPUTS, NEURONS+PSQT> *weights;
 };
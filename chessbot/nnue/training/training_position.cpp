@@ -12,6 +12,144 @@ void training_position::get_best_move(chess_move &best_move) {
 
 
 
+std::string training_position::to_fen() const
+{
+    static const char *piece_chars = " PNBRQK  pnbrqk";
+
+    char board[64] = {};
+    uint8_t squares[64] = {};
+
+    uint64_t occ = occupation;
+    int index = 0;
+    int sq_index;
+    for (int i = 0; i < count_pieces(); i++) {
+        uint8_t p = iterate_pieces(occ, index, sq_index);
+        board[sq_index] = piece_chars[p & 0xF];
+        squares[sq_index] = p & 0xF;
+    }
+
+    std::string fen;
+    for (int y = 0; y < 8; y++) {
+        int empty = 0;
+        for (int x = 0; x < 8; x++) {
+            char c = board[y*8 + x];
+            if (c == 0) {
+                empty++;
+                continue;
+            }
+            if (empty > 0) {
+                fen += (char)('0' + empty);
+                empty = 0;
+            }
+            fen += c;
+        }
+        if (empty > 0) {
+            fen += (char)('0' + empty);
+        }
+        if (y < 7) {
+            fen += '/';
+        }
+    }
+
+    fen += (get_turn() == WHITE ? " w " : " b ");
+
+    std::string castling;
+    if ((flags & CASTLE_WHITE_KSIDE) != 0) castling += 'K';
+    if ((flags & CASTLE_WHITE_QSIDE) != 0) castling += 'Q';
+    if ((flags & CASTLE_BLACK_KSIDE) != 0) castling += 'k';
+    if ((flags & CASTLE_BLACK_QSIDE) != 0) castling += 'q';
+
+    fen += (castling.empty() ? "-" : castling) + " ";
+
+    int ep_file = ((flags & EN_PASSANT_CAPTURE) != 0 ? en_passant_file(squares, get_turn()) : -1);
+    if (ep_file >= 0) {
+        fen += (char)('a' + ep_file);
+        fen += (get_turn() == WHITE ? '6' : '3');
+    } else {
+        fen += '-';
+    }
+
+    fen += " 0 1";
+
+    return fen;
+}
+
+
+void training_position::load(board_state &state) const
+{
+    state.init_clear();
+
+    uint8_t squares[64] = {};
+
+    uint64_t occ = occupation;
+    int index = 0;
+    int sq_index;
+    for (int i = 0; i < count_pieces(); i++) {
+        piece p;
+        p.d = iterate_pieces(occ, index, sq_index);
+        squares[sq_index] = p.d;
+        state.board[sq_index] = p;
+
+        if (p.get_type() == KING) {
+            if (p.get_player() == WHITE) {
+                state.white_king_square = square_index(sq_index);
+            } else {
+                state.black_king_square = square_index(sq_index);
+            }
+        }
+    }
+
+    //Side to move is the parity of the half move clock
+    state.half_move_clock = (get_turn() == WHITE ? 0 : 1);
+
+    if ((flags & CASTLE_WHITE_KSIDE) != 0) state.flags |= WHITE_KSIDE_CASTLE_VALID;
+    if ((flags & CASTLE_WHITE_QSIDE) != 0) state.flags |= WHITE_QSIDE_CASTLE_VALID;
+    if ((flags & CASTLE_BLACK_KSIDE) != 0) state.flags |= BLACK_KSIDE_CASTLE_VALID;
+    if ((flags & CASTLE_BLACK_QSIDE) != 0) state.flags |= BLACK_QSIDE_CASTLE_VALID;
+
+    int ep_file = ((flags & EN_PASSANT_CAPTURE) != 0 ? en_passant_file(squares, get_turn()) : -1);
+    if (ep_file >= 0) {
+        if (get_turn() == WHITE) {
+            state.en_passant_square.set_xy(ep_file, 2);
+            state.en_passant_target_square.set_xy(ep_file, 3);
+        } else {
+            state.en_passant_square.set_xy(ep_file, 5);
+            state.en_passant_target_square.set_xy(ep_file, 4);
+        }
+        state.flags |= EN_PASSANT_AVAILABLE;
+    }
+
+    state.recalculate_bitboards();
+    state.recalculate_hashes();
+}
+
+
+int training_position::en_passant_file(const uint8_t *squares, player_type_t turn)
+{
+    //Pushed pawn is on its fourth rank and both squares it passed are empty
+    int rank = (turn == WHITE ? 3 : 4);
+    int behind = (turn == WHITE ? -BOARD_WIDTH : BOARD_WIDTH);
+    uint8_t pushed = (turn == WHITE ? BLACK_PAWN : WHITE_PAWN);
+    uint8_t capturer = (turn == WHITE ? WHITE_PAWN : BLACK_PAWN);
+
+    int file = -1;
+    for (int x = 0; x < BOARD_WIDTH; x++) {
+        int sq = rank * BOARD_WIDTH + x;
+        if (squares[sq] != pushed || squares[sq + behind] != 0 || squares[sq + 2*behind] != 0) {
+            continue;
+        }
+        if ((x == 0 || squares[sq - 1] != capturer) && (x == BOARD_WIDTH-1 || squares[sq + 1] != capturer)) {
+            continue;
+        }
+        if (file >= 0) {
+            return -1;
+        }
+        file = x;
+    }
+    return file;
+}
+
+
 void training_position::encode_best_move(const board_state &state, const chess_move &best_move)
 {
     bm = (best_move.from.index << 10) | (best_move.to.index << 4) | best_move.promotion;
@@ -38,6 +176,7 @@ void training_position::init(const board_state &state, float wdl, int32_t score)
 
     occupation = state.pieces_by_color[0] | state.pieces_by_color[1];
 
+    uint8_t squares[64] = {};
     int write_index = 0;
 
     for (int i = 0; i < 64; i++) {
@@ -47,6 +186,7 @@ void training_position::init(const board_state &state, float wdl, int32_t score)
         }
 
         uint8_t bp = p.d & 0xF;
+        squares[i] = bp;
 
         int byte_index = write_index / 2;
         if ((write_index & 0x1) == 0) {
@@ -56,6 +196,16 @@ void training_position::init(const board_state &state, float wdl, int32_t score)
         }
         write_index++;
     }
+
+    //Rights are kept only while king and rook are home, en passant only when the capturing pawn can be found again
+    if ((state.flags & WHITE_KSIDE_CASTLE_VALID) != 0 && squares[60] == WHITE_KING && squares[63] == WHITE_ROOK) flags |= CASTLE_WHITE_KSIDE;
+    if ((state.flags & WHITE_QSIDE_CASTLE_VALID) != 0 && squares[60] == WHITE_KING && squares[56] == WHITE_ROOK) flags |= CASTLE_WHITE_QSIDE;
+    if ((state.flags & BLACK_KSIDE_CASTLE_VALID) != 0 && squares[4] == BLACK_KING && squares[7] == BLACK_ROOK) flags |= CASTLE_BLACK_KSIDE;
+    if ((state.flags & BLACK_QSIDE_CASTLE_VALID) != 0 && squares[4] == BLACK_KING && squares[0] == BLACK_ROOK) flags |= CASTLE_BLACK_QSIDE;
+
+    if ((state.flags & EN_PASSANT_AVAILABLE) != 0 && en_passant_file(squares, state.get_turn()) == state.en_passant_square.get_x()) {
+        flags |= EN_PASSANT_CAPTURE;
+    }
 }
 
 training_position::training_position(const board_state &state, chess_move bm, int32_t eval, float wdl)
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <string>
 #include "../../defs.hpp"
 #include "../../bitboard.hpp"
 
-enum training_position_flags {WHITE_TURN = 0x1, RESULT_STM_WIN = 0x1 << 1, RESULT_DRAW = 0x1 << 2};
+enum training_position_flags {WHITE_TURN = 0x1, RESULT_STM_WIN = 0x1 << 1, RESULT_DRAW = 0x1 << 2,
+                              CASTLE_WHITE_KSIDE = 0x1 << 3, CASTLE_WHITE_QSIDE = 0x1 << 4, CASTLE_BLACK_KSIDE = 0x1 << 5, CASTLE_BLACK_QSIDE = 0x1 << 6,
+                              EN_PASSANT_CAPTURE = 0x1 << 7};
 
 
 class board_state;
@@ -85,6 +88,14 @@ struct training_position
     }
 
     void get_best_move(chess_move &best_move);
+
+    //Restores pieces, side to move, castling rights and en passant. Datasets written before castling was stored load without castling rights
+    void load(board_state &state) const;
+
+    std::string to_fen() const;
+
+    //File of the only pawn the side to move can capture en passant, -1 if there is none or more than one
+    static int en_passant_file(const uint8_t *squares, player_type_t turn);
 
     uint64_t occupation;
     int16_t eval;
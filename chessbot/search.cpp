@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <iomanip>
 #include "defs.hpp"
 #include "movepicker.hpp"
 #include "movegen.hpp"
@@ -9,7 +10,11 @@
 #include "zobrist.hpp"
 #include "search_manager.hpp"
 
-searcher::searcher()
+searcher::searcher(): searcher(searcher_config())
+{
+}
+
+searcher::searcher(const searcher_config &config): transposition_table(config.transposition_table_size_MB), eval_cache(config.eval_cache_size_MB)
 {
     clear_transposition_table();
     clear_evaluation_cache();
@@ -22,28 +27,46 @@ searcher::searcher()
 
     current_cache_age = 0;
     num_of_pvs = 1;
+    speculative_eval_moves = 0;
 
     shared_nnue_weights = nnue_weights::get_shared_weights();
 
-    set_threads(DEFAULT_THREADS);
+    set_threads(config.threads);
 }
 
 searcher::searcher(const searcher &other): transposition_table(other.transposition_table), eval_cache(other.eval_cache)
 {
-    shared_nnue_weights = other.shared_nnue_weights;
+    copy_settings(other, other.number_of_helper_threads + 1);
+}
+
+searcher::searcher(const searcher &other, const searcher_config &config): transposition_table(config.transposition_table_size_MB), eval_cache(config.eval_cache_size_MB)
+{
+    clear_transposition_table();
+    clear_evaluation_cache();
+
+    copy_settings(other, config.threads);
+}
+
+void searcher::copy_settings(const searcher &other, int num_of_threads)
+{
+    {
+        std::lock_guard<std::mutex> lock(other.weights_lock);
+        shared_nnue_weights = other.pending_nnue_weights ? other.pending_nnue_weights : other.shared_nnue_weights;
+    }
 
     searching_flag = false;
     alphabeta_abort_flag = false;
     test_flag = other.test_flag;
     current_cache_age = other.current_cache_age;
     num_of_pvs = other.num_of_pvs;
+    speculative_eval_moves = other.speculative_eval_moves;
     forward_pruning = other.forward_pruning;
 
     sp = other.sp;
 
-    set_threads(other.number_of_helper_threads + 1);
+    set_threads(num_of_threads);
 
-    for (int i = 0; i < number_of_helper_threads+1; i++) {
+    for (int i = 0; i < std::min(number_of_helper_threads, other.number_of_helper_threads)+1; i++) {
         thread_datas[i]->history = other.thread_datas[i]->history;
     }
 }
@@ -80,8 +103,30 @@ void searcher::clear_history()
     }
 }
 
+void searcher::apply_pending_weights()
+{
+    std::lock_guard<std::mutex> lock(weights_lock);
+    if (!pending_nnue_weights) {
+        return;
+    }
+    shared_nnue_weights = pending_nnue_weights;
+    pending_nnue_weights = nullptr;
+
+    //Networks keep their acculumator buffers, only weight pointers are rebound
+    for (size_t i = 0; i < thread_datas.size(); i++) {
+        if (thread_datas[i]->nnue) {
+            thread_datas[i]->nnue->set_weights(shared_nnue_weights);
+        } else {
+            thread_datas[i]->nnue = std::make_shared<nnue_network>(shared_nnue_weights);
+        }
+    }
+    clear_evaluation_cache();
+}
+
 void searcher::set_threads(int num_of_threads)
 {
+    apply_pending_weights();
+
     number_of_helper_threads = std::clamp(num_of_threads-1, 0, MAX_THREADS);
 
     thread_datas.clear();
@@ -96,6 +141,43 @@ void searcher::set_transposition_table_size_MB(int size_MB)
     clear_transposition_table();
 }
 
+void searcher::set_evaluation_cache_size_MB(int size_MB)
+{
+    eval_cache.resize(size_MB);
+    clear_evaluation_cache();
+}
+
+searcher_config searcher::get_config()
+{
+    searcher_config config;
+    config.threads = number_of_helper_threads + 1;
+    config.transposition_table_size_MB = transposition_table.get_size_MB();
+    config.eval_cache_size_MB = eval_cache.get_size_MB();
+    return config;
+}
+
+searcher_memory searcher::get_memory_usage()
+{
+    searcher_memory memory;
+    memory.transposition_table = transposition_table.get_memory_usage();
+    memory.eval_cache = eval_cache.get_memory_usage();
+    memory.contexts = 0;
+    for (size_t i = 0; i < thread_datas.size(); i++) {
+        memory.contexts += sizeof(search_context) + (thread_datas[i]->nnue ? thread_datas[i]->nnue->memory_usage() : 0);
+    }
+    return memory;
+}
+
+void searcher_memory::print(const std::string &name) const
+{
+    constexpr double MB = 1024*1024;
+
+    std::cout << std::fixed << std::setprecision(1)
+              << name << ": " << total() / MB << "MB  (TT " << transposition_table / MB
+              << "MB, eval cache " << eval_cache / MB << "MB, contexts " << contexts / MB << "MB)"
+              << std::defaultfloat << std::endl;
+}
+
 
 void searcher::new_game()
 {
@@ -112,6 +194,8 @@ void searcher::search(const board_state &state, std::shared_ptr<search_manager>
         return;
     }
     searching_flag = true;
+    apply_pending_weights();
+
     manager = m;
     if (manager->tm) {
         manager->tm->test_flag = test_flag;
@@ -369,6 +453,46 @@ int32_t searcher::static_evaluation(const board_state &state, player_type_t play
     return score;
 }
 
+//Children of qsearch node are often evaluated right after each other. Their acculumators differ from parent only by
+//few updates, so evaluating best of them together lets parent acculumator and weights be read once for all.
+void searcher::speculative_evaluation(board_state &state, const scored_move_array<240> &moves, search_context &sc)
+{
+    //Picking from copy keeps order of moves identical to one search will use
+    scored_move_array<240> candidates = moves;
+
+    int num_of_children = 0;
+    uint64_t hashes[max_speculative_children];
+
+    chess_move mov;
+    while (num_of_children < speculative_eval_moves && candidates.pick(mov)) {
+        if (state.causes_check(mov, state.get_turn())) {
+            continue;
+        }
+        uint64_t next_hash = hashgen.update_hash(state.zhash, state, mov);
+
+        int32_t cached_score;
+        if (eval_cache[next_hash].probe(next_hash, cached_score)) {
+            continue;
+        }
+
+        unmake_restore restore = state.make_move(mov, next_hash);
+        bool staged = state.nnue->stage_speculative_child(state.get_turn());
+        state.unmake_move(mov, restore);
+
+        if (staged) {
+            hashes[num_of_children++] = next_hash;
+        }
+    }
+
+    int16_t evals[max_speculative_children];
+    int num_of_evals = state.nnue->evaluate_speculative_children(evals);
+
+    for (int i = 0; i < num_of_evals; i++) {
+        eval_cache[hashes[i]].store(hashes[i], evals[i]);
+    }
+    sc.stats.speculative_evals += num_of_evals;
+}
+
 int32_t searcher::alphabeta(board_state &state, int32_t alpha, int32_t beta, int depth, int ply, search_context &sc, pv_table &pv, chess_move *skip_move, node_type_t expected_node_type)
 {
     sc.stats.max_distance_to_root = std::max(sc.stats.max_distance_to_root, ply);
@@ -997,6 +1121,10 @@ int32_t searcher::quisearch(board_state &state, int32_t alpha, int32_t beta, int
         }
 
         best_score = eval;
+
+        if (speculative_eval_moves > 0 && state.nnue) {
+            speculative_evaluation(state, moves, sc);
+        }
     } else {
         //When in check, we search all move
         chess_move all_moves[240];
@@ -183,6 +183,7 @@ struct search_statistics
 
         eval_cache_hits += other.eval_cache_hits;
         eval_cache_misses += other.eval_cache_misses;
+        speculative_evals += other.speculative_evals;
 
         max_distance_to_root = std::max(max_distance_to_root, other.max_distance_to_root);
     }
@@ -193,6 +194,7 @@ struct search_statistics
 
     int64_t eval_cache_hits;
     int64_t eval_cache_misses;
+    int64_t speculative_evals;
 
     int64_t fail_high_index;
     int64_t fail_highs;
@@ -259,23 +261,69 @@ struct search_context
 };
 
 
+//Memory of a searcher. Defaults are for engine play, workers doing short fixed node searches need only a fraction.
+struct searcher_config
+{
+    searcher_config() {
+        threads = DEFAULT_THREADS;
+        transposition_table_size_MB = TT_SIZE;
+        eval_cache_size_MB = EVAL_CACHE_SIZE;
+    }
+
+    //Single thread with tables sized for positions of last few searches of given node count
+    static searcher_config for_node_limit(int nodes) {
+        searcher_config config;
+        config.transposition_table_size_MB = std::clamp((int)(((int64_t)nodes * 512) >> 20), 1, TT_SIZE);
+        config.eval_cache_size_MB = std::clamp((int)(((int64_t)nodes * 128) >> 20), 1, EVAL_CACHE_SIZE);
+        return config;
+    }
+
+    int threads;
+    int transposition_table_size_MB;
+    int eval_cache_size_MB;
+};
+
+
+struct searcher_memory
+{
+    size_t transposition_table;
+    size_t eval_cache;
+
+    //Search stacks, history tables and nnue acculumators of each thread
+    size_t contexts;
+
+    size_t total() const {
+        return transposition_table + eval_cache + contexts;
+    }
+
+    void print(const std::string &name) const;
+};
+
+
 class searcher
 {
 public:
     searcher();
+    searcher(const searcher_config &config);
     searcher(const searcher &other);
 
+    //Copies settings, weights and history of other searcher, tables are allocated empty with configured sizes
+    searcher(const searcher &other, const searcher_config &config);
+
     void search(const board_state &state, std::shared_ptr<search_manager> m);
 
+    //Weights are swapped in when next search starts, so this can be called while search is running.
     void set_shared_weights(std::shared_ptr<nnue_weights> weights) {
-        shared_nnue_weights = weights;
-        for (size_t i = 0; i < thread_datas.size(); i++) {
-            thread_datas[i]->nnue = std::make_shared<nnue_network>(shared_nnue_weights);
-        }
+        std::lock_guard<std::mutex> lock(weights_lock);
+        pending_nnue_weights = weights;
     }
 
     void new_game();
 
+    std::shared_ptr<nnue_network> get_nnue(int thread_id) {
+        return thread_datas[thread_id]->nnue;
+    }
+
     void set_multi_pv(int num) {
         num_of_pvs = num;
     }
@@ -283,6 +331,14 @@ public:
         return num_of_pvs;
     }
 
+    //Number of best qsearch moves whose static evaluation is computed in one batch at parent node. 0 disables it.
+    void set_speculative_eval_moves(int num) {
+        speculative_eval_moves = std::max(0, std::min(num, max_speculative_children));
+    }
+    int get_speculative_eval_moves() {
+        return speculative_eval_moves;
+    }
+
     void clear_transposition_table();
     void clear_evaluation_cache();
     void clear_history();
@@ -294,12 +350,20 @@ public:
 
     void set_threads(int num_of_threads);
     void set_transposition_table_size_MB(int size_MB);
+    void set_evaluation_cache_size_MB(int size_MB);
+
+    searcher_config get_config();
+    searcher_memory get_memory_usage();
 
     search_params sp;
 private:
+    void copy_settings(const searcher &other, int num_of_threads);
+
     uint64_t get_total_node_count();
 
+    void apply_pending_weights();
     int32_t static_evaluation(const board_state &state, player_type_t player, search_statistics &stats);
+    void speculative_evaluation(board_state &state, const scored_move_array<240> &moves, search_context &sc);
     void start_helper_threads(int32_t window_alpha, int32_t window_beta, int depth);
     void stop_helper_threads();
     void aspirated_search();
@@ -319,6 +383,7 @@ private:
     std::vector<std::unique_ptr<search_context>> thread_datas;
 
     int num_of_pvs;
+    int speculative_eval_moves;
     pv_table root_search_pv[MAX_MULTI_PV];
     std::mutex root_search_lock;
 
@@ -334,5 +399,8 @@ private:
     std::vector<std::pair<chess_move, int32_t>> root_moves;
 
     std::shared_ptr<nnue_weights> shared_nnue_weights;
+    std::shared_ptr<nnue_weights> pending_nnue_weights;
+    mutable std::mutex weights_lock;
+
     std::shared_ptr<search_manager> manager;
 };
@@ -37,6 +37,8 @@ uci_interface::uci_interface(std::shared_ptr<searcher> search_inst, std::shared_
     //uci_log.open("uci_log.txt");
 
     last_position_ply = 0;
+    last_info_iteration = 0;
+    depth_reached = 0;
 }
 
 uci_interface::~uci_interface()
@@ -44,6 +46,9 @@ uci_interface::~uci_interface()
     if (running) {
         stop();
     }
+    if (net_loader_thread.joinable()) {
+        net_loader_thread.join();
+    }
 
     if (uci_log.is_open()) {
         uci_log.close();
@@ -74,6 +79,9 @@ void uci_interface::stop()
     if (search_thread.joinable()) {
         search_thread.join();
     }
+    if (net_loader_thread.joinable()) {
+        net_loader_thread.join();
+    }
 }
 
 std::string uci_interface::parse_command(std::string line, int word)
@@ -90,6 +98,17 @@ void uci_interface::search_thread_entry()
     search_instance->search(game_instance->get_state(), search_man);
 }
 
+void uci_interface::net_loader_thread_entry(std::string path)
+{
+    std::shared_ptr<nnue_weights> weights = nnue_weights::get_shared_weights(path);
+    if (weights) {
+        search_instance->set_shared_weights(weights);
+        send_command("info string EvalFile " + path + " loaded");
+    } else {
+        send_command("info string EvalFile " + path + " could not be loaded, using previous network");
+    }
+}
+
 
 void uci_interface::input_loop()
 {
@@ -114,6 +133,8 @@ void uci_interface::input_loop()
 
 void uci_interface::send_command(std::string cmd)
 {
+    std::lock_guard<std::mutex> guard(send_lock);
+
     if (uci_log.is_open()) {
         uci_log << "ENG: " << cmd << "\n";
     }
@@ -145,6 +166,10 @@ void uci_interface::execute_command(std::string cmd_line)
         ss << "option name MultiPV type spin default 1 min 1 max " << MAX_MULTI_PV;
         send_command(ss.str());
 
+        ss.str(std::string());
+        ss << "option name SpeculativeEval type spin default 0 min 0 max " << max_speculative_children;
+        send_command(ss.str());
+
         ss.str(std::string());
         ss << "option name Move Overhead type spin default " << time_manager::get_default_overhead() << " min 0 max 10000";
         send_command(ss.str());
@@ -157,8 +182,16 @@ void uci_interface::execute_command(std::string cmd_line)
         ss << "option name Ponder type check default false";
         send_command(ss.str());
 
+        ss.str(std::string());
+        ss << "option name EvalFile type string default <embedded>";
+        send_command(ss.str());
+
         send_command("uciok");
     } else if (cmd == "isready") {
+        //Network loading must be finished before engine is ready
+        if (net_loader_thread.joinable()) {
+            net_loader_thread.join();
+        }
         send_command("readyok");
     } else if (cmd == "position") {
         std::vector<std::string> splitted_cmd = split_string(cmd_line, ' ');
@@ -290,10 +323,10 @@ void uci_interface::execute_command(std::string cmd_line)
             search_man->set_allowed_root_moves(search_moves);
         }
 
-        search_thread = std::thread(&uci_interface::search_thread_entry, this);
-
         last_info_iteration = 0;
         depth_reached = 0;
+
+        search_thread = std::thread(&uci_interface::search_thread_entry, this);
     } else if (cmd == "stop") {
         search_man->stop_search();
         if (search_thread.joinable()) {
@@ -339,6 +372,9 @@ void uci_interface::execute_command(std::string cmd_line)
         } else if (option_name == "MultiPV") {
             int multi_pv = atoi(option_value.c_str());
             search_instance->set_multi_pv(multi_pv);
+        } else if (option_name == "SpeculativeEval") {
+            int speculative_moves = atoi(option_value.c_str());
+            search_instance->set_speculative_eval_moves(speculative_moves);
         } else if (option_name == "UCI_ShowWDL") {
             if (option_value == "true") {
                 show_wdl = true;
@@ -354,6 +390,16 @@ void uci_interface::execute_command(std::string cmd_line)
             } else if (option_value == "false") {
                 ponder = false;
             }
+        } else if (option_name == "EvalFile") {
+            //Path can contain spaces, so take everything after value
+            size_t p = cmd_line.find(" value ");
+            std::string path = (p != std::string::npos) ? cmd_line.substr(p + 7) : std::string("");
+
+            //Load in background. Running search keeps using old network until it finishes.
+            if (net_loader_thread.joinable()) {
+                net_loader_thread.join();
+            }
+            net_loader_thread = std::thread(&uci_interface::net_loader_thread_entry, this, path);
         }
     } else {
         std::lock_guard<std::mutex> guard(non_uci_cmds_lock);
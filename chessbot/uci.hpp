@@ -66,6 +66,7 @@ private:
 
     void input_loop();
     void search_thread_entry();
+    void net_loader_thread_entry(std::string path);
 
     int last_info_iteration;
     int depth_reached;
@@ -74,6 +75,7 @@ private:
     std::atomic<bool> running;
     std::thread uci_thread;
     std::thread search_thread;
+    std::thread net_loader_thread;
 
     std::queue<std::string> non_uci_cmds;
     std::mutex non_uci_cmds_lock;
@@ -85,6 +87,7 @@ private:
     std::shared_ptr<search_manager> search_man;
 
     std::ofstream uci_log;
+    std::mutex send_lock;
 
     bool show_wdl;
     bool ponder;
@@ -10,7 +10,13 @@
 #include "misc.hpp"
 
 #include "../search_manager.hpp"
+#include "../nnue/training/training_data.hpp"
 #include "wdl_model.hpp"
+#include "opening_index.hpp"
+#include <filesystem>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 
 
@@ -42,6 +48,215 @@ bool adjucate_draw(board_state &state, int32_t &draw_adjucation_counter, int32_t
     return (draw_adjucation_counter >= config.adjucate_draw_plies_below_treshold);
 }
 
+struct datagen_game
+{
+    std::vector<training_position> positions;
+    std::string pgn;
+};
+
+
+//Workers hand finished games to writer thread through a bounded queue, so memory doesn't grow with number of games.
+//Writer appends games to numbered files and syncs them to disk every few games, data written before a crash is kept.
+struct datagen_writer
+{
+    datagen_writer(const std::string &name, const datagen_config &c);
+    ~datagen_writer();
+
+    //Blocks while queue is full
+    void push(datagen_game &&game);
+
+    //Writes queued games and closes files
+    void finish();
+
+    int get_file_number() {
+        return file_number;
+    }
+private:
+    void writer_loop();
+
+    void open_files();
+    void close_files();
+    void sync_files();
+
+    std::string file_name(int number, const std::string &extension);
+
+    std::string output_name;
+    std::string positions_extension;
+    datagen_config config;
+
+    std::unique_ptr<training_data_writer> positions_file;
+    std::ofstream pgn_file;
+    std::string pgn_file_name;
+    int file_number;
+    int games_in_file;
+    int games_since_sync;
+
+    std::thread t;
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<datagen_game> games;
+    size_t capacity;
+    bool finished;
+};
+
+
+datagen_writer::datagen_writer(const std::string &name, const datagen_config &c)
+{
+    output_name = name;
+    config = c;
+
+    positions_extension = (config.format == DATAGEN_CHAIN ? ".chain" : ".bin");
+
+    capacity = 4 * std::max(config.threads, 1);
+    finished = false;
+
+    file_number = 0;
+    open_files();
+
+    t = std::thread(&datagen_writer::writer_loop, this);
+}
+
+
+datagen_writer::~datagen_writer()
+{
+    finish();
+}
+
+
+void datagen_writer::push(datagen_game &&game)
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [this] {return games.size() < capacity;});
+        games.push_back(std::move(game));
+    }
+    not_empty.notify_one();
+}
+
+
+void datagen_writer::finish()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (finished) {
+            return;
+        }
+        finished = true;
+    }
+    not_empty.notify_one();
+    t.join();
+}
+
+
+void datagen_writer::writer_loop()
+{
+    while (true) {
+        datagen_game game;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            not_empty.wait(guard, [this] {return finished || !games.empty();});
+
+            if (games.empty()) {
+                break;
+            }
+            game = std::move(games.front());
+            games.pop_front();
+        }
+        not_full.notify_one();
+
+        if (config.games_per_file > 0 && games_in_file >= config.games_per_file) {
+            close_files();
+            open_files();
+        }
+
+        if (positions_file) {
+            for (const training_position &pos : game.positions) {
+                positions_file->add(pos);
+            }
+        }
+        if (pgn_file.is_open()) {
+            pgn_file << game.pgn << "\n";
+        }
+
+        games_in_file++;
+        games_since_sync++;
+
+        if (games_since_sync >= config.sync_games) {
+            sync_files();
+        }
+    }
+
+    close_files();
+}
+
+
+std::string datagen_writer::file_name(int number, const std::string &extension)
+{
+    return output_name + "_" + std::to_string(number) + extension;
+}
+
+
+//Skips numbers used by earlier runs
+void datagen_writer::open_files()
+{
+    do {
+        file_number++;
+    } while (std::filesystem::exists(file_name(file_number, positions_extension)) ||
+             std::filesystem::exists(file_name(file_number, ".pgn")));
+
+    if (config.format != DATAGEN_NO_POSITIONS) {
+        std::string filename = file_name(file_number, positions_extension);
+
+        positions_file = std::make_unique<training_data_writer>(filename);
+        if (!positions_file->is_open()) {
+            std::cout << "Cannot write file " << filename << std::endl;
+            positions_file.reset();
+        }
+    }
+
+    if (config.write_pgn) {
+        pgn_file_name = file_name(file_number, ".pgn");
+
+        pgn_file.open(pgn_file_name);
+        if (!pgn_file.is_open()) {
+            std::cout << "Cannot write file " << pgn_file_name << std::endl;
+        }
+    }
+
+    games_in_file = 0;
+    games_since_sync = 0;
+}
+
+
+void datagen_writer::close_files()
+{
+    sync_files();
+
+    if (positions_file) {
+        positions_file->close();
+        positions_file.reset();
+    }
+    if (pgn_file.is_open()) {
+        pgn_file.close();
+    }
+}
+
+
+void datagen_writer::sync_files()
+{
+    if (positions_file) {
+        positions_file->sync();
+    }
+    if (pgn_file.is_open()) {
+        pgn_file.flush();
+        sync_file(pgn_file_name);
+    }
+    games_since_sync = 0;
+}
+
+
+
 struct datagen_worker
 {
     datagen_worker()
@@ -60,7 +275,8 @@ struct datagen_worker
         total_opening_moves = 0;
         played_opening_moves = 0;
 
-        search = std::make_unique<searcher>();
+        writer = nullptr;
+
         sman = std::make_shared<search_manager>();
     }
 
@@ -70,24 +286,34 @@ struct datagen_worker
         t.join();
     }
 
-    void start(std::atomic<int> &games, std::shared_ptr<nnue_weights> weights, std::shared_ptr<std::vector<std::string>> openings, std::shared_ptr<cache<uint64_t, 64>> startpos_cache, datagen_config &c)
+    searcher_memory get_memory_usage()
+    {
+        return search->get_memory_usage();
+    }
+
+    void start(std::atomic<int> &games, std::shared_ptr<nnue_weights> weights, std::shared_ptr<opening_index> openings, std::shared_ptr<opening_filter> visited_openings, datagen_config &c, datagen_writer *w)
     {
         config = c;
+        writer = w;
 
-        t = std::thread(&datagen_worker::generate_loop, this, std::ref(games), weights, openings, startpos_cache);
+        search = std::make_unique<searcher>(searcher_config::for_node_limit(config.nodes));
+
+        t = std::thread(&datagen_worker::generate_loop, this, std::ref(games), weights, openings, visited_openings);
     }
 
-    std::vector<std::string> results;
     double avg_depth;
     double avg_start_pos_abs_eval;
     double avg_opening_branching_factor;
     uint64_t positions_generated;
 private:
-    void generate_loop(std::atomic<int> &games, std::shared_ptr<nnue_weights> weights, std::shared_ptr<std::vector<std::string>> openings, std::shared_ptr<cache<uint64_t, 64>> startpos_cache);
+    void generate_loop(std::atomic<int> &games, std::shared_ptr<nnue_weights> weights, std::shared_ptr<opening_index> openings, std::shared_ptr<opening_filter> visited_openings);
+
+    bool generate_game(const opening_position &opening, opening_filter &visited_openings, datagen_game &result);
 
-    std::string generate_game(const std::string &opening_fen, std::shared_ptr<cache<uint64_t, 64>> &startpos_cache);
+    void get_positions(const opening_position &start_position, const std::vector<chess_move> &moves, const std::vector<int32_t> &scores, game_win_type_t game_result, std::vector<training_position> &positions);
 
     std::unique_ptr<searcher> search;
+    datagen_writer *writer;
     std::shared_ptr<search_manager> sman;
 
     game_state game;
@@ -105,7 +331,7 @@ private:
 };
 
 
-void datagen_worker::generate_loop(std::atomic<int> &games, std::shared_ptr<nnue_weights> weights, std::shared_ptr<std::vector<std::string>> openings, std::shared_ptr<cache<uint64_t, 64>> startpos_cache)
+void datagen_worker::generate_loop(std::atomic<int> &games, std::shared_ptr<nnue_weights> weights, std::shared_ptr<opening_index> openings, std::shared_ptr<opening_filter> visited_openings)
 {
     std::srand((size_t)time(NULL) + worker_id);
 
@@ -113,19 +339,41 @@ void datagen_worker::generate_loop(std::atomic<int> &games, std::shared_ptr<nnue
     search->forward_pruning = config.forward_pruning;
 
     while (games > 0) {
-        std::string game_pgn = generate_game((*openings)[rand()%openings->size()], startpos_cache);
-        if (game_pgn.length() > 0) {
-            results.push_back(game_pgn);
+        datagen_game game;
+        if (generate_game((*openings)[rand()%openings->size()], *visited_openings, game)) {
+            writer->push(std::move(game));
             games--;
         }
     }
 }
 
 
-std::string datagen_worker::generate_game(const std::string &s_fen, std::shared_ptr<cache<uint64_t, 64>> &startpos_cache)
+//Replays game from opening and keeps searched positions the same way convert_training_data would
+void datagen_worker::get_positions(const opening_position &start_position, const std::vector<chess_move> &moves, const std::vector<int32_t> &scores, game_win_type_t game_result, std::vector<training_position> &positions)
+{
+    float wdl = 0.5f;
+    if (game_result == WHITE_WIN) {
+        wdl = 1.0f;
+    } else if (game_result == BLACK_WIN) {
+        wdl = 0.0f;
+    }
+
+    board_state state;
+    start_position.load(state);
+
+    for (size_t i = 0; i < moves.size(); i++) {
+        if (!training_data_utility::is_filtered_position(state, moves[i])) {
+            positions.emplace_back(state, moves[i], wdl_model::normalize_score(state, scores[i]), wdl);
+        }
+        state.make_move(moves[i]);
+    }
+}
+
+
+bool datagen_worker::generate_game(const opening_position &opening, opening_filter &visited_openings, datagen_game &result)
 {
     game.reset();
-    game.get_state().load_fen(s_fen);
+    opening.load(game.get_state());
     search->new_game();
 
     game_win_type_t game_result = NO_WIN;
@@ -136,9 +384,10 @@ std::string datagen_worker::generate_game(const std::string &s_fen, std::shared_
 
     double total_depth = 0;
 
-    std::string opening_fen = "";
+    bool opening_finished = false;
+    opening_position start_position;
     std::vector<chess_move> moves_played;
-    std::vector<pgn_comment> comments;
+    std::vector<int32_t> scores;
 
     while (true) {
         if (random_moves > 0) {
@@ -179,17 +428,13 @@ std::string datagen_worker::generate_game(const std::string &s_fen, std::shared_
                 total_opening_moves += acceptable_moves.size();
             }
         } else {
-            if (opening_fen == "") {
-                if (config.filter_dublicate_openings) {
-                    uint64_t zhash = game.get_state().zhash;
-
-                    if ((*startpos_cache)[zhash] == zhash) {
-                        break;
-                    }
-                    (*startpos_cache)[zhash] = zhash;
+            if (!opening_finished) {
+                if (config.filter_dublicate_openings && visited_openings.test_and_set(game.get_state().zhash)) {
+                    break;
                 }
 
-                opening_fen = game.get_state().generate_fen();
+                start_position = opening_position(game.get_state());
+                opening_finished = true;
             }
 
             sman->prepare_depth_nodes_search(config.depth, config.nodes);
@@ -220,7 +465,7 @@ std::string datagen_worker::generate_game(const std::string &s_fen, std::shared_
                     first_move_abs_eval_sum += (double)std::abs(score);
                     num_of_first_moves += 1;
                 }
-                comments.push_back({(int)moves_played.size(), std::to_string(score)});
+                scores.push_back(score);
                 moves_played.push_back(mov);
             }
 
@@ -252,54 +497,96 @@ std::string datagen_worker::generate_game(const std::string &s_fen, std::shared_
 
         positions_generated += moves_played.size();
 
-        std::vector<pgn_tag> tags = {{"FEN", opening_fen}};
-
-        if (game_result == DRAW) {
-            tags.push_back({"Result", "1/2-1/2"});
-        } else {
-            tags.push_back({"Result", (game_result == WHITE_WIN ? "1-0" : "0-1")});
+        if (config.format != DATAGEN_NO_POSITIONS) {
+            get_positions(start_position, moves_played, scores, game_result, result.positions);
         }
 
-        return pgn_parser::generate_pgn(tags, moves_played, opening_fen, &comments);
+        if (config.write_pgn) {
+            board_state start_state;
+            start_position.load(start_state);
+            std::string opening_fen = start_state.generate_fen();
+
+            std::vector<pgn_tag> tags = {{"FEN", opening_fen}};
+
+            if (game_result == DRAW) {
+                tags.push_back({"Result", "1/2-1/2"});
+            } else {
+                tags.push_back({"Result", (game_result == WHITE_WIN ? "1-0" : "0-1")});
+            }
+
+            std::vector<pgn_comment> comments;
+            for (size_t i = 0; i < scores.size(); i++) {
+                comments.push_back({(int)i, std::to_string(scores[i])});
+            }
+
+            result.pgn = pgn_parser::generate_pgn(tags, moves_played, opening_fen, &comments);
+        }
+        return true;
     }
 
-    return "";
+    return false;
 }
 
 
-void training_datagen::datagen(std::string output_file, datagen_config &config)
+
+
+
+void training_datagen::datagen(std::string output_name, datagen_config &config)
 {
     std::cout << std::endl << "Selfplaying\nThreads: " << config.threads
                            << "\nMin depth: " << config.depth
                            << "\nMin nodes: " << config.nodes
-                           << "\nOutput file: " << output_file << std::endl;
+                           << "\nOutput: " << output_name << std::endl;
+
+    datagen_writer writer(output_name, config);
 
+    std::cout << "Positions: " << (config.format == DATAGEN_NO_POSITIONS ? "none" : (config.format == DATAGEN_CHAIN ? "chain" : "bin")) << std::endl;
+    std::cout << "PGN: " << (config.write_pgn ? "yes" : "no") << std::endl;
+    std::cout << "First file: " << output_name << "_" << writer.get_file_number() << std::endl;
+    std::cout << "Games per file: " << config.games_per_file << std::endl;
 
-    auto startpos_cache = std::make_shared<cache<uint64_t, 64>>();
 
     auto weights = nnue_weights::get_shared_weights(); //Less L3 cache pressure when workers use shared weights
 
-    auto openings = std::make_shared<std::vector<std::string>>();
+    auto openings = std::make_shared<opening_index>();
 
     //Load opening suite
     if (config.opening_suite != "") {
-        *openings = load_opening_suite(config.opening_suite);
+        openings->load(config.opening_suite);
     } else {
-        openings->push_back("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+        openings->load_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    }
+
+    if (openings->size() == 0) {
+        std::cout << "Error: no opening positions" << std::endl;
+        return;
+    }
+
+    //Openings played by earlier runs of the same dataset are skipped too
+    auto visited_openings = std::make_shared<opening_filter>();
+    if (config.filter_dublicate_openings) {
+        visited_openings->open(output_name + ".openings", config.opening_filter_MB);
     }
 
     std::cout << "Opening suite: " << config.opening_suite << std::endl;
     std::cout << "Opening positions: " << openings->size() << std::endl;
     std::cout << "Multi PV opening: " << config.multi_pv_opening << std::endl;
     std::cout << "Opening moves: " << config.opening_moves << std::endl;
+    if (config.filter_dublicate_openings) {
+        std::cout << "Visited openings: " << visited_openings->get_count() << " (" << output_name << ".openings)" << std::endl;
+    }
 
     std::vector<datagen_worker> workers(config.threads);
     std::atomic<int> agames = config.games;
 
     for (int i = 0; i < config.threads; i++) {
-        workers[i].start(agames, weights, openings, startpos_cache, config);
+        workers[i].start(agames, weights, openings, visited_openings, config, &writer);
     }
 
+    searcher_memory memory = workers[0].get_memory_usage();
+    memory.print("Searcher memory per worker");
+    std::cout << "Searcher memory total: " << memory.total() * config.threads / (1024*1024) << "MB" << std::endl;
+
     int prev_positions = 0;
 
     int prev_games_left = agames;
@@ -380,16 +667,12 @@ void training_datagen::datagen(std::string output_file, datagen_config &config)
     std::cout << std::endl;
 
 
-    std::stringstream ss;
     for (int i = 0; i < config.threads; i++) {
         workers[i].wait();
-
-        for (int j = 0; j < workers[i].results.size(); j++) {
-            ss << workers[i].results[j] << "\n";
-        }
     }
 
-    pgn_parser::write_text_file(output_file, ss.str());
+    writer.finish();
+    visited_openings->sync();
 }
 
 
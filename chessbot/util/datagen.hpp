@@ -2,6 +2,8 @@
 
 #include <string>
 
+enum datagen_format {DATAGEN_NO_POSITIONS, DATAGEN_BIN, DATAGEN_CHAIN};
+
 struct datagen_config
 {
     int threads;
@@ -11,6 +13,7 @@ struct datagen_config
     bool forward_pruning;
     bool multi_pv_opening;
     bool filter_dublicate_openings;
+    int opening_filter_MB;  //Size of <output_name>.openings when it's created
     int opening_moves;
     std::string opening_suite;
 
@@ -22,10 +25,20 @@ struct datagen_config
     int adjucate_draw_min_plies;
     int adjucate_draw_cp_treshold;
     int adjucate_draw_plies_below_treshold;
+
+    //Training positions are written as .bin or .chain, PGN text with evals as comments is optional
+    datagen_format format;
+    bool write_pgn;
+
+    //Output is split to numbered files, files are synced to disk every sync_games games
+    int games_per_file;
+    int sync_games;
 };
 
 
 struct training_datagen
 {
-    static void datagen(std::string output_file, datagen_config &config);
+    //Writes <output_name>_<n>.bin or .chain and <output_name>_<n>.pgn. Numbering continues after existing files,
+    //so interrupted run can be restarted with same name.
+    static void datagen(std::string output_name, datagen_config &config);
 };
@@ -2,8 +2,26 @@
 #include <fstream>
 #include <cmath>
 #include "pgn_parser.hpp"
+#include "pgn_reader.hpp"
 #include "../search_manager.hpp"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+void sync_file(const std::string &path)
+{
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
 int play_game_pair(searcher &s0, searcher &s1, const std::string &opening_fen, int base_time, int time_inc, bool s0_playing_black, match_stats &stats)
 {
     game_state game;
@@ -98,45 +116,42 @@ std::vector<std::string> load_opening_suite(std::string filename)
 
 
 
-void iterate_pgn_positions(const std::string &pgn_text, std::function<void(const board_state &state, chess_move next_mov, game_win_type_t game_result, std::string *comment)> callback)
+void iterate_pgn_positions(std::string_view pgn_text, std::function<void(const board_state &state, chess_move next_mov, game_win_type_t game_result, std::string *comment)> callback)
 {
-    std::vector<std::string> games = pgn_parser::parse_games(pgn_text);
+    pgn_reader reader(pgn_text);
 
     board_state state;
+    std::string comment;
 
-    for (const std::string &game : games) {
+    std::string_view game;
+    while (reader.next_game(game)) {
 
-        std::vector<pgn_tag> tags = pgn_parser::parse_tags(game);
-        std::vector<pgn_comment> comments;
+        std::string_view startpos = pgn_reader::get_tag(game, "FEN");
+        game_win_type_t game_result = pgn_reader::parse_result(pgn_reader::get_tag(game, "Result"));
 
-        std::string startpos = pgn_parser::get_tag_value(tags, "FEN");
-        std::string result = pgn_parser::get_tag_value(tags, "Result");
-
-        std::vector<chess_move> moves = pgn_parser::parse_moves(game, startpos, &comments);
-
-        if (startpos == "") {
+        if (startpos.empty()) {
             state.set_initial_state();
         } else {
-            state.load_fen(startpos);
-        }
-
-        game_win_type_t game_result = DRAW;
-        if (result == "1-0") {
-            game_result = WHITE_WIN;
-        } else if (result == "0-1") {
-            game_result = BLACK_WIN;
+            state.load_fen(std::string(startpos));
         }
 
-        int comment_index = 0;
+        //Moves are resolved and played while tokenizing, nothing of the game is copied except comments
+        pgn_move_tokenizer tokenizer(game);
 
-        for (size_t i = 0; i < moves.size(); i++) {
-            chess_move mov = moves[i];
+        while (tokenizer.next()) {
+            chess_move mov = pgn_parser::parse_san(state, tokenizer.san);
 
-            if (comment_index < comments.size() && comments[comment_index].pos == i) {
+            if (!mov.valid()) {
+                std::cout << "Illegal move!" << std::endl;
+                std::cout << "Position FEN: " << state.generate_fen() << std::endl;
+                std::cout << "Token: " << tokenizer.san << std::endl;
+                break;
+            }
 
-                callback(state, mov, game_result, &comments[comment_index].comment);
+            if (tokenizer.has_comment) {
+                comment.assign(tokenizer.comment);
 
-                comment_index++;
+                callback(state, mov, game_result, &comment);
             } else {
                 callback(state, mov, game_result, nullptr);
             }
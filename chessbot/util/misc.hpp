@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <functional>
+#include <string_view>
 #include "../game.hpp"
 #include "../search.hpp"
 
@@ -50,7 +51,10 @@ struct match_stats
 
 std::vector<std::string> load_opening_suite(std::string filename);
 
+//Flushes written data of file to disk, file has to be flushed from stream buffers first
+void sync_file(const std::string &path);
+
 int play_game_pair(searcher &s0, searcher &s1, const std::string &opening_fen, int base_time, int time_inc, bool s0_playing_black, match_stats &stats);
 
 
-void iterate_pgn_positions(const std::string &pgn_text, std::function<void(const board_state &state, chess_move next_mov, game_win_type_t game_result, std::string *comment)> callback);
+void iterate_pgn_positions(std::string_view pgn_text, std::function<void(const board_state &state, chess_move next_mov, game_win_type_t game_result, std::string *comment)> callback);
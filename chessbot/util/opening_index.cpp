@@ -0,0 +1,401 @@
+#include "opening_index.hpp"
+
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+
+#include "misc.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+constexpr uint32_t opening_index_magic = 0x58444E4F;   //"ONDX"
+constexpr uint32_t opening_filter_magic = 0x544C464F;  //"OFLT"
+constexpr uint32_t opening_index_version = 2;
+constexpr uint32_t opening_filter_version = 1;
+
+static_assert(sizeof(opening_position) == 32);
+
+
+opening_position::opening_position(const board_state &state)
+{
+    occupation = 0;
+    std::memset(packed_pieces, 0, sizeof(packed_pieces));
+
+    int index = 0;
+    for (int sq = 0; sq < BOARD_SQUARES; sq++) {
+        piece p = state.get_square(sq);
+        if (p.get_type() == EMPTY) {
+            continue;
+        }
+        occupation |= (uint64_t)0x1 << sq;
+
+        if ((index & 0x1) == 0) {
+            packed_pieces[index/2] |= p.d;
+        } else {
+            packed_pieces[index/2] |= p.d << 4;
+        }
+        index += 1;
+    }
+
+    flags = state.flags & (WHITE_QSIDE_CASTLE_VALID | WHITE_KSIDE_CASTLE_VALID | BLACK_QSIDE_CASTLE_VALID | BLACK_KSIDE_CASTLE_VALID | EN_PASSANT_AVAILABLE);
+    en_passant_square = ((flags & EN_PASSANT_AVAILABLE) != 0 ? state.en_passant_square.index : 0);
+    half_move_clock = state.half_move_clock;
+    std::memset(padding, 0, sizeof(padding));
+}
+
+
+//Restores pieces, castling, en passant and fifty move counter. board_state has no full move number, so none is stored
+void opening_position::load(board_state &state) const
+{
+    state.init_clear();
+
+    uint64_t occ = occupation;
+    for (int index = 0; occ != 0; index++) {
+        int sq = bit_scan_forward_clear(occ);
+
+        piece p;
+        p.d = (packed_pieces[index/2] >> ((index & 0x1) * 4)) & 0xF;
+        state.board[sq] = p;
+
+        if (p.get_type() == KING) {
+            if (p.get_player() == WHITE) {
+                state.white_king_square = square_index(sq);
+            } else {
+                state.black_king_square = square_index(sq);
+            }
+        }
+    }
+
+    state.flags = flags;
+    state.half_move_clock = half_move_clock;
+
+    if ((flags & EN_PASSANT_AVAILABLE) != 0) {
+        state.en_passant_square = square_index(en_passant_square);
+        if (state.en_passant_square.get_y() == 2) {
+            state.en_passant_target_square.set_xy(state.en_passant_square.get_x(), 3);
+        } else if (state.en_passant_square.get_y() == 5) {
+            state.en_passant_target_square.set_xy(state.en_passant_square.get_x(), 4);
+        }
+    }
+
+    state.recalculate_bitboards();
+    state.recalculate_hashes();
+}
+
+
+
+struct opening_index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_of_positions;
+
+    //Index is rebuilt when these don't match the suite
+    uint64_t suite_size;
+    int64_t suite_time;
+};
+
+static bool get_suite_identity(const std::string &suite_file, uint64_t &size, int64_t &time)
+{
+    std::error_code ec;
+    size = std::filesystem::file_size(suite_file, ec);
+    if (ec) {
+        return false;
+    }
+    time = std::filesystem::last_write_time(suite_file, ec).time_since_epoch().count();
+    return !ec;
+}
+
+
+opening_index::~opening_index()
+{
+    unmap();
+}
+
+
+bool opening_index::load(const std::string &suite_file)
+{
+    unmap();
+
+    std::string index_file = suite_file + ".idx";
+
+    if (map(suite_file, index_file)) {
+        return true;
+    }
+
+    if (!build(suite_file, index_file)) {
+        return false;
+    }
+
+    if (map(suite_file, index_file)) {
+        buffer = std::vector<opening_position>();
+        return true;
+    }
+
+    //Index couldn't be written, use parsed positions for this run
+    positions = buffer.data();
+    num_of_positions = buffer.size();
+    return true;
+}
+
+
+void opening_index::load_fen(const std::string &fen)
+{
+    unmap();
+
+    board_state state;
+    state.load_fen(fen);
+
+    buffer = {opening_position(state)};
+    positions = buffer.data();
+    num_of_positions = buffer.size();
+}
+
+
+bool opening_index::build(const std::string &suite_file, const std::string &index_file)
+{
+    std::ifstream file(suite_file);
+    if (!file.is_open()) {
+        std::cout << "Error: can't open opening suite: " << suite_file << std::endl;
+        return false;
+    }
+
+    std::cout << "Building opening index " << index_file << "... " << std::flush;
+
+    board_state state;
+    std::string line;
+
+    buffer.clear();
+    while (std::getline(file, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        state.load_fen(line);
+        buffer.emplace_back(state);
+    }
+    file.close();
+
+    std::cout << buffer.size() << " positions" << std::endl;
+
+    opening_index_header header;
+    header.magic = opening_index_magic;
+    header.version = opening_index_version;
+    header.num_of_positions = buffer.size();
+
+    if (!get_suite_identity(suite_file, header.suite_size, header.suite_time)) {
+        return true;
+    }
+
+    std::string tmp_file = index_file + ".tmp";
+    {
+        std::ofstream out(tmp_file, std::ios::binary);
+        if (!out.is_open()) {
+            std::cout << "Error: can't write opening index: " << index_file << std::endl;
+            return true;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(opening_position));
+    }
+    sync_file(tmp_file);
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_file, index_file, ec);
+
+    return true;
+}
+
+
+bool opening_index::map(const std::string &suite_file, const std::string &index_file)
+{
+    opening_index_header expected;
+    if (!get_suite_identity(suite_file, expected.suite_size, expected.suite_time)) {
+        return false;
+    }
+
+    opening_index_header header;
+    {
+        std::ifstream file(index_file, std::ios::binary);
+        if (!file.is_open() || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return false;
+        }
+    }
+
+    if (header.magic != opening_index_magic || header.version != opening_index_version ||
+        header.suite_size != expected.suite_size || header.suite_time != expected.suite_time) {
+        return false;
+    }
+
+    size_t size = sizeof(header) + header.num_of_positions * sizeof(opening_position);
+
+    std::error_code ec;
+    if (std::filesystem::file_size(index_file, ec) != size || ec) {
+        return false;
+    }
+
+#ifdef __linux__
+    int fd = open(index_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    mapping = p;
+    mapping_size = size;
+    positions = reinterpret_cast<const opening_position*>(static_cast<const char*>(p) + sizeof(header));
+#else
+    buffer.resize(header.num_of_positions);
+    std::ifstream file(index_file, std::ios::binary);
+    file.seekg(sizeof(header));
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(opening_position))) {
+        return false;
+    }
+    positions = buffer.data();
+#endif
+
+    num_of_positions = header.num_of_positions;
+    return true;
+}
+
+
+void opening_index::unmap()
+{
+#ifdef __linux__
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+#endif
+    mapping = nullptr;
+    mapping_size = 0;
+    positions = nullptr;
+    num_of_positions = 0;
+}
+
+
+
+//Hash of the initial position. Filter can't be reused if zobrist keys change
+static uint64_t get_zobrist_check()
+{
+    board_state state;
+    state.set_initial_state();
+    return state.zhash;
+}
+
+
+opening_filter::~opening_filter()
+{
+    sync();
+
+#ifdef __linux__
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+#endif
+}
+
+
+bool opening_filter::open(const std::string &filename, int size_MB)
+{
+    size_t num_of_words = std::max((size_t)size_MB, (size_t)1) * 1024 * 1024 / sizeof(uint64_t);
+    size_t size = sizeof(header) + num_of_words * sizeof(uint64_t);
+
+    bool persistent = false;
+
+#ifdef __linux__
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            //Existing filter keeps its size, new one is created sparse
+            if ((size_t)st.st_size > sizeof(header)) {
+                size = st.st_size;
+            } else if (ftruncate(fd, size) != 0) {
+                size = 0;
+            }
+
+            if (size > 0) {
+                void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED) {
+                    mapping = p;
+                    mapping_size = size;
+                    head = static_cast<header*>(p);
+                    persistent = true;
+                }
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    if (!persistent) {
+        std::cout << "Error: can't map opening filter " << filename << ", openings are filtered only in this run" << std::endl;
+        buffer.assign(size / sizeof(uint64_t), 0);
+        head = reinterpret_cast<header*>(buffer.data());
+    }
+
+    bits = reinterpret_cast<uint64_t*>(head + 1);
+
+    bool valid = (head->magic == opening_filter_magic && head->version == opening_filter_version &&
+                  head->num_of_words == (size - sizeof(header)) / sizeof(uint64_t));
+
+    if (valid && head->zobrist_check != get_zobrist_check()) {
+        std::cout << "Zobrist keys changed, opening filter " << filename << " is reset" << std::endl;
+        valid = false;
+    }
+
+    if (!valid) {
+        std::memset(static_cast<void*>(head), 0, size);
+        head->magic = opening_filter_magic;
+        head->version = opening_filter_version;
+        head->zobrist_check = get_zobrist_check();
+        head->num_of_words = (size - sizeof(header)) / sizeof(uint64_t);
+        head->count = 0;
+    }
+
+    return persistent;
+}
+
+
+//Blocked filter: all probes of an opening are in one word, so test and set is a single atomic or
+bool opening_filter::test_and_set(uint64_t zhash)
+{
+    uint64_t h = zhash * 0x9E3779B97F4A7C15ULL;
+    uint64_t mask = ((uint64_t)1 << ((h >> 40) & 63)) | ((uint64_t)1 << ((h >> 46) & 63)) |
+                    ((uint64_t)1 << ((h >> 52) & 63)) | ((uint64_t)1 << (h >> 58));
+
+    uint64_t *word = &bits[zhash % head->num_of_words];
+    uint64_t previous = __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+
+    if ((previous & mask) == mask) {
+        return true;
+    }
+
+    __atomic_fetch_add(&head->count, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+
+uint64_t opening_filter::get_count() const
+{
+    return (head ? __atomic_load_n(&head->count, __ATOMIC_RELAXED) : 0);
+}
+
+
+void opening_filter::sync()
+{
+#ifdef __linux__
+    if (mapping) {
+        msync(mapping, mapping_size, MS_SYNC);
+    }
+#endif
+}
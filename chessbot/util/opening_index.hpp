@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "../state.hpp"
+
+
+//Opening position packed like training_position, so workers can set up the board without parsing FEN
+struct opening_position
+{
+    opening_position() {}
+    opening_position(const board_state &state);
+
+    void load(board_state &state) const;
+
+    uint64_t occupation;
+    uint8_t packed_pieces[16];
+    uint16_t flags;            //Castling and en passant flags of board_state
+    uint16_t half_move_clock;  //As in board_state, parity is side to move
+    uint8_t en_passant_square;
+    uint8_t padding[3];
+};
+
+
+//Opening suite pre-parsed to <suite>.idx. Index is rebuilt when the suite changes and mapped into memory on later runs
+struct opening_index
+{
+    opening_index() {}
+    ~opening_index();
+
+    opening_index(const opening_index&) = delete;
+    opening_index &operator=(const opening_index&) = delete;
+
+    bool load(const std::string &suite_file);
+
+    //Single position index, used when there is no opening suite
+    void load_fen(const std::string &fen);
+
+    const opening_position &operator [] (size_t index) const {
+        return positions[index];
+    }
+
+    size_t size() const {
+        return num_of_positions;
+    }
+
+private:
+    bool build(const std::string &suite_file, const std::string &index_file);
+    bool map(const std::string &suite_file, const std::string &index_file);
+    void unmap();
+
+    const opening_position *positions = nullptr;
+    size_t num_of_positions = 0;
+
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    std::vector<opening_position> buffer;
+};
+
+
+//Bloom filter of visited openings in a file shared by all runs writing to the same dataset.
+//Workers test and set it without locks, a false positive only skips an opening that wasn't played yet.
+struct opening_filter
+{
+    opening_filter() {}
+    ~opening_filter();
+
+    opening_filter(const opening_filter&) = delete;
+    opening_filter &operator=(const opening_filter&) = delete;
+
+    //Opens existing filter or creates one of size_MB. Filter is kept in memory if file can't be mapped
+    bool open(const std::string &filename, int size_MB);
+
+    //Marks opening as visited, returns true if it was visited before
+    bool test_and_set(uint64_t zhash);
+
+    //Number of distinct openings inserted over all runs
+    uint64_t get_count() const;
+
+    void sync();
+
+private:
+    struct header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t zobrist_check;
+        uint64_t num_of_words;
+        uint64_t count;
+        uint64_t reserved[4];
+    };
+
+    header *head = nullptr;
+    uint64_t *bits = nullptr;
+
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    std::vector<uint64_t> buffer;
+};
@@ -1,37 +1,142 @@
 #include <sstream>
+#include <chrono>
+#include <iomanip>
+#include <memory>
 
 #include "pgn_parser.hpp"
 #include "../state.hpp"
 #include "../movegen.hpp"
+#include "pgn_reader.hpp"
 
-size_t find_end_of_parentheses(size_t pos, char start_symbol, char end_symbol, const std::string &str, bool debug = false)
+chess_move pgn_parser::parse_san(const board_state &state, std::string_view san)
 {
-    int c = (str[pos] == start_symbol);
-    while (c > 0 && pos+1 < str.length()) {
-        pos++;
-        if (str[pos] == start_symbol) {
-            c++;
-        } else if (str[pos] == end_symbol) {
-            c--;
+    //Check marks and annotations don't affect the move
+    while (!san.empty() && std::string_view("+#!? \r\n\t").find(san.back()) != std::string_view::npos) {
+        san.remove_suffix(1);
+    }
+
+    if (san.size() >= 3 && (san[0] == 'O' || san[0] == '0')) {
+        return parse_san_by_legal_moves(state, std::string(san));
+    }
+
+    static const std::string_view pieces = "NBRQK";
+    static const piece_type_t piece_types[5] = {KNIGHT, BISHOP, ROOK, QUEEN, KING};
+
+    piece_type_t promotion = EMPTY;
+    if (!san.empty() && pieces.find(san.back()) < 4) {
+        promotion = piece_types[pieces.find(san.back())];
+        san.remove_suffix(1);
+        if (!san.empty() && san.back() == '=') {
+            san.remove_suffix(1);
         }
     }
-    return pos;
-}
 
-size_t match_str(size_t pos, const std::string &str, const std::string &token)
-{
-    size_t matching_chars = 0;
-    for (size_t i = 0; i < token.length() && pos + i < str.length(); i++) {
-        if (token[i] == str[pos + i]) {
-            matching_chars++;
-        } else {
+    if (san.size() < 2) {
+        return chess_move::null_move();
+    }
+
+    int to_x = san[san.size()-2] - 'a';
+    int to_y = '8' - san[san.size()-1];
+    if (to_x < 0 || to_x > 7 || to_y < 0 || to_y > 7) {
+        return chess_move::null_move();
+    }
+    san.remove_suffix(2);
+
+    piece_type_t piece_type = PAWN;
+    if (!san.empty() && pieces.find(san[0]) != std::string_view::npos) {
+        piece_type = piece_types[pieces.find(san[0])];
+        san.remove_prefix(1);
+    }
+
+    //Disambiguation and capture marks in any order, e.g. "exd5", "Nbd2", "R1xe4", "Qh4xe1"
+    bitboard from_mask = ~(uint64_t)0;
+    bool is_capture = false;
+    for (char c : san) {
+        if (c >= 'a' && c <= 'h') {
+            from_mask &= (uint64_t)0x0101010101010101 << (c - 'a');
+        } else if (c >= '1' && c <= '8') {
+            from_mask &= (uint64_t)0xFF << (('8' - c) * 8);
+        } else if (c == 'x') {
+            is_capture = true;
+        } else if (c != '-') {
+            return chess_move::null_move();
+        }
+    }
+
+    player_type_t turn = state.get_turn();
+    bool color = (turn == BLACK);
+
+    square_index to_sq(to_x, to_y);
+    bitboard to_bb = (uint64_t)0x1 << to_sq.index;
+    bitboard occupation = state.pieces_by_color[0] | state.pieces_by_color[1];
+
+    if ((state.pieces_by_color[color] & to_bb) != 0) {
+        return chess_move::null_move();
+    }
+
+    //Squares from which own pieces of the type reach the target square
+    bitboard own = state.bitboards[piece_type][color] & from_mask;
+    bitboard candidates = 0;
+
+    switch (piece_type) {
+        case KNIGHT: candidates = bitboard_utils.knight_attack(to_sq.index, own); break;
+        case BISHOP: candidates = bitboard_utils.bishop_attack(to_sq.index, occupation, own); break;
+        case ROOK:   candidates = bitboard_utils.rook_attack(to_sq.index, occupation, own); break;
+        case QUEEN:  candidates = bitboard_utils.queen_attack(to_sq.index, occupation, own); break;
+        case KING:   candidates = bitboard_utils.king_attack(to_sq.index, own); break;
+        default: {
+            bool en_passant = (to_sq == state.en_passant_square && (state.flags & EN_PASSANT_AVAILABLE) != 0);
+            bool target_occupied = ((occupation & to_bb) != 0);
+
+            if (is_capture || from_mask != ~(uint64_t)0) {
+                if (target_occupied || en_passant) {
+                    candidates = bitboard_utils.pawn_attack(to_sq.index, ~(uint64_t)0, !color, own, 0);
+                }
+            } else if (!target_occupied) {
+                //White pawns move towards lower y
+                int dir = (color ? -8 : 8);
+                int from = to_sq.index + dir;
+                int double_push_y = (color ? 3 : 4);
+
+                if (from >= 0 && from < 64) {
+                    bitboard from_bb = (uint64_t)0x1 << from;
+                    if ((own & from_bb) != 0) {
+                        candidates = from_bb;
+                    } else if ((occupation & from_bb) == 0 && to_y == double_push_y) {
+                        candidates = own & ((uint64_t)0x1 << (from + dir));
+                    }
+                }
+            }
+
+            if (to_y == (color ? 7 : 0)) {
+                promotion = (promotion == EMPTY ? QUEEN : promotion);
+            } else {
+                promotion = EMPTY;
+            }
             break;
         }
     }
-    return (matching_chars == token.length() ? matching_chars : 0);
-}
 
-chess_move pgn_parser::parse_san(const board_state &state, std::string san)
+    if (piece_type != PAWN) {
+        promotion = EMPTY;
+    }
+
+    while (candidates != 0) {
+        chess_move mov;
+        mov.from = square_index(bit_scan_forward_clear(candidates));
+        mov.to = to_sq;
+        mov.promotion = promotion;
+        mov.encoded_pieces = move_generator::encode_move_pieces(state, mov);
+
+        if (!state.causes_check(mov, turn)) {
+            return mov;
+        }
+    }
+
+    return chess_move::null_move();
+}
+
+chess_move pgn_parser::parse_san_by_legal_moves(const board_state &state, std::string san)
 {
     san.erase(std::remove_if(san.begin(), san.end(), [](unsigned char c) { return !std::isprint(c); }), san.end());
 
@@ -143,92 +248,35 @@ chess_move pgn_parser::parse_san(const board_state &state, std::string san)
 }
 
 std::vector<chess_move> pgn_parser::parse_moves(const std::string &pgn_text, std::string startpos, std::vector<pgn_comment> *comments)
-{
-    std::vector<chess_move> moves;
-
-    board_state state;
-    if (startpos == "") {
-        state.set_initial_state();
-    } else {
-        state.load_fen(startpos);
-    }
-
-
-    static const std::string game_end_tokens[4] = {"*", "1-0", "0-1", "1/2-1/2"};
-
-    for (size_t i = 0; i < pgn_text.size(); i++) {
-        bool game_end = false;
-        for (int j = 0; j < 4; j++) {
-            if (match_str(i, pgn_text, game_end_tokens[j]) > 0) {
-                game_end = true;
-                break;
-            }
-        }
-        if (game_end) {
-            break;
-        }
-
-        char end_symbol = '\0';
-        if (pgn_text[i] == '[') end_symbol = ']';
-        else if (pgn_text[i] == '(') end_symbol = ')';
-        else if (pgn_text[i] == ';') end_symbol = '\n';
-        if (end_symbol != '\0') {
-            i = find_end_of_parentheses(i, pgn_text[i], end_symbol, pgn_text);
-            continue;
-        }
-
-        if (pgn_text[i] == '{') {
-            size_t comment_end = find_end_of_parentheses(i, '{', '}', pgn_text);
-
-            if (comments != nullptr) {
-                comments->push_back({(int)moves.size(), pgn_text.substr(i+1, comment_end-i-1)});
-            }
-
-            i = comment_end;
-
-            continue;
-        }
-
-        if (pgn_text[i] == ' ' || pgn_text[i] == '\r' || pgn_text[i] == '\n') {
-            continue;
-        }
-
-        size_t token_end = i;
-        while (token_end < pgn_text.size() &&
-               pgn_text[token_end] != ' ' &&
-               pgn_text[token_end] != '{' &&
-               pgn_text[token_end] != '\r' &&
-               pgn_text[token_end] != '\n' &&
-               pgn_text[token_end] != ' ') {
-            token_end++;
-        }
-
-        std::string token = pgn_text.substr(i, token_end - i);
-
-        i = token_end - 1;
-
-
-        size_t last_dot = token.rfind('.');
-        if (last_dot != std::string::npos) {
-            token = token.substr(last_dot+1, token.length() - last_dot - 1);
-        }
-
-        if (token[0] == '$') {
-            continue;
-        }
-
-        chess_move mov = parse_san(state, token);
-
-        if (mov.valid()) {
-            state.make_move(mov);
-            moves.push_back(mov);
-        } else {
-            std::cout << "Illegal move!" << std::endl;
-            std::cout << "Position FEN: " << state.generate_fen() << std::endl;
-            std::cout << "Token: " << token << std::endl;
-            break;
-        }
-    }
+{
+    std::vector<chess_move> moves;
+
+    board_state state;
+    if (startpos == "") {
+        state.set_initial_state();
+    } else {
+        state.load_fen(startpos);
+    }
+
+    pgn_move_tokenizer tokenizer(pgn_text);
+
+    while (tokenizer.next()) {
+        if (comments != nullptr && tokenizer.has_comment) {
+            comments->push_back({(int)moves.size(), std::string(tokenizer.comment)});
+        }
+
+        chess_move mov = parse_san(state, tokenizer.san);
+
+        if (mov.valid()) {
+            state.make_move(mov);
+            moves.push_back(mov);
+        } else {
+            std::cout << "Illegal move!" << std::endl;
+            std::cout << "Position FEN: " << state.generate_fen() << std::endl;
+            std::cout << "Token: " << tokenizer.san << std::endl;
+            break;
+        }
+    }
 
     return moves;
 }
@@ -239,68 +287,27 @@ std::vector<std::string> pgn_parser::parse_games(const std::string &pgn_text)
 {
     std::vector<std::string> games;
 
-    static const std::string end_tokens[4] = {"*", "1-0", "0-1", "1/2-1/2"};
-
-    size_t game_start = 0;
-    for (size_t i = 0; i < pgn_text.length(); i++) {
-        char end_symbol = '\0';
-        if (pgn_text[i] == '[') end_symbol = ']';
-        if (pgn_text[i] == '(') end_symbol = ')';
-        if (pgn_text[i] == '{') end_symbol = '}';
-        if (pgn_text[i] == ';') end_symbol = '\n';
-        if (end_symbol != '\0') {
-            i = find_end_of_parentheses(i, pgn_text[i], end_symbol, pgn_text);
-        }
-        size_t end_token_match = 0;
-        for (int j = 0; j < 4 && end_token_match == 0; j++) {
-            end_token_match = match_str(i, pgn_text, end_tokens[j]);
-        }
-        if (end_token_match > 0) {
-            i += end_token_match+1;
-            games.push_back(pgn_text.substr(game_start, i - game_start));
-            game_start = i;
-        }
+    pgn_reader reader(pgn_text);
+
+    std::string_view game;
+    while (reader.next_game(game)) {
+        games.emplace_back(game);
     }
 
     return games;
-}
-
+}
+
 
 std::vector<pgn_tag> pgn_parser::parse_tags(const std::string &pgn_text)
 {
     std::vector<pgn_tag> tags;
 
-    for (size_t i = 0; i < pgn_text.length(); i++) {
-        if (pgn_text[i] != '[') {
-            continue;
-        }
-        size_t end_of_parenthesis = find_end_of_parentheses(i, '[', ']', pgn_text);
-
-        std::string tag_str = pgn_text.substr(i+1, end_of_parenthesis - i - 1);
-
-        std::string tag_name = "";
-        std::string tag_value = "";
-
-        size_t space = tag_str.find(' ');
-        if (space != std::string::npos) {
-            tag_name = tag_str.substr(0, space);
-        }
-
-
-        size_t value_start = tag_str.find('"');
-        if (value_start != std::string::npos) {
-            size_t value_end = tag_str.find('"', value_start+1);
-            if (value_end != std::string::npos) {
-                tag_value = tag_str.substr(value_start+1, value_end - value_start - 1);
-            }
-        }
-
-        tags.push_back(std::make_pair(tag_name, tag_value));
-
-        i = end_of_parenthesis;
+    size_t pos = 0;
+    std::string_view tag_name, tag_value;
+    while (pgn_reader::next_tag(pgn_text, pos, tag_name, tag_value)) {
+        tags.emplace_back(tag_name, tag_value);
     }
 
-
     return tags;
 }
 
@@ -536,6 +543,73 @@ int pgn_parser::write_text_file(std::string path, const std::string &text)
 }
 
 
+void pgn_parser::benchmark(const std::vector<std::string> &files)
+{
+    std::vector<std::unique_ptr<pgn_file>> pgns;
+    size_t bytes = 0;
+
+    for (const std::string &filename : files) {
+        std::unique_ptr<pgn_file> pgn = std::make_unique<pgn_file>(filename);
+        if (!pgn->is_open()) {
+            std::cout << "Cannot read file " << filename << std::endl;
+            continue;
+        }
+        bytes += pgn->get_text().size();
+        pgns.push_back(std::move(pgn));
+    }
 
+    //First pass only splits games, the others replay every move with one of the SAN resolvers
+    static const char *pass_names[3] = {"split", "attack tables", "legal moves"};
+
+    for (int pass = 0; pass < 3; pass++) {
+        size_t games = 0;
+        size_t positions = 0;
+        size_t illegal = 0;
+
+        board_state state;
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+
+        for (const auto &pgn : pgns) {
+            pgn_reader reader(pgn->get_text());
+
+            std::string_view game;
+            while (reader.next_game(game)) {
+                games++;
+                if (pass == 0) {
+                    continue;
+                }
+
+                std::string_view startpos = pgn_reader::get_tag(game, "FEN");
+                if (startpos.empty()) {
+                    state.set_initial_state();
+                } else {
+                    state.load_fen(std::string(startpos));
+                }
+
+                pgn_move_tokenizer tokenizer(game);
+                while (tokenizer.next()) {
+                    chess_move mov = (pass == 1 ? parse_san(state, tokenizer.san) : parse_san_by_legal_moves(state, std::string(tokenizer.san)));
+                    if (!mov.valid()) {
+                        illegal++;
+                        break;
+                    }
+                    state.make_move(mov);
+                    positions++;
+                }
+            }
+        }
 
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
 
+        std::cout << std::left << std::setw(14) << pass_names[pass] << std::right
+                  << games << " games  " << positions << " positions  "
+                  << (size_t)(games / seconds) << " games/s  "
+                  << (size_t)(positions / seconds / 1000) << " KPos/s  "
+                  << (size_t)(bytes / seconds / (1024*1024)) << " MB/s";
+        if (illegal > 0) {
+            std::cout << "  " << illegal << " illegal moves";
+        }
+        std::cout << std::endl;
+    }
+}
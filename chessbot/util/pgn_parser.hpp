@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <tuple>
 
 #include "../state.hpp"
@@ -17,7 +18,10 @@ struct pgn_comment
 
 struct pgn_parser
 {
-    static chess_move parse_san(const board_state &state, std::string san);
+    //Resolves the move with attack tables, only candidate moves are checked for legality
+    static chess_move parse_san(const board_state &state, std::string_view san);
+    //Reference implementation matching against all legal moves
+    static chess_move parse_san_by_legal_moves(const board_state &state, std::string san);
 
 
     static std::vector<std::string> parse_games(const std::string &pgn_text);
@@ -31,4 +35,7 @@ struct pgn_parser
 
     static std::string read_text_file(std::string path);
     static int write_text_file(std::string path, const std::string &text);
+
+    //Games and positions per second for splitting, parsing and SAN resolving
+    static void benchmark(const std::vector<std::string> &files);
 };
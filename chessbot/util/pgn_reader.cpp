@@ -0,0 +1,273 @@
+#include <fstream>
+
+#include "pgn_reader.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+pgn_file::pgn_file(const std::string &path)
+{
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        opened = true;
+        size = st.st_size;
+
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(p);
+                mapped = true;
+            } else {
+                opened = false;
+                size = 0;
+            }
+        }
+    }
+    close(fd);
+
+    if (opened) {
+        return;
+    }
+#endif
+
+    std::ifstream file(path, std::ios::binary);
+    if (file.is_open()) {
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        opened = true;
+    }
+}
+
+pgn_file::~pgn_file()
+{
+#ifdef __linux__
+    if (mapped) {
+        munmap(const_cast<char*>(data), size);
+    }
+#endif
+}
+
+
+
+inline bool is_pgn_whitespace(char c)
+{
+    return (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+}
+
+inline bool is_pgn_token_end(char c)
+{
+    return (is_pgn_whitespace(c) || c == '{' || c == '(' || c == ')' || c == '[' || c == ';');
+}
+
+//Returns position after the block starting at pos. Only variations nest
+size_t skip_pgn_block(std::string_view text, size_t pos)
+{
+    char c = text[pos];
+    size_t end = std::string_view::npos;
+
+    if (c == '{') {
+        end = text.find('}', pos + 1);
+    } else if (c == '[') {
+        end = text.find(']', pos + 1);
+    } else if (c == ';') {
+        end = text.find('\n', pos + 1);
+    } else if (c == '(') {
+        int depth = 1;
+        for (end = pos + 1; end < text.size(); end++) {
+            if (text[end] == '{' || text[end] == ';') {
+                end = skip_pgn_block(text, end) - 1;
+            } else if (text[end] == '(') {
+                depth++;
+            } else if (text[end] == ')' && --depth == 0) {
+                break;
+            }
+        }
+    }
+
+    return (end < text.size() ? end + 1 : text.size());
+}
+
+size_t find_pgn_token_end(std::string_view text, size_t pos)
+{
+    while (pos < text.size() && !is_pgn_token_end(text[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+
+bool pgn_reader::is_result_token(std::string_view token)
+{
+    return (token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*");
+}
+
+game_win_type_t pgn_reader::parse_result(std::string_view result)
+{
+    if (result == "1-0") {
+        return WHITE_WIN;
+    } else if (result == "0-1") {
+        return BLACK_WIN;
+    }
+    return DRAW;
+}
+
+
+bool pgn_reader::next_game(std::string_view &game)
+{
+    while (pos < text.size() && is_pgn_whitespace(text[pos])) {
+        pos++;
+    }
+
+    size_t game_start = pos;
+
+    while (pos < text.size()) {
+        char c = text[pos];
+
+        if (is_pgn_whitespace(c) || c == ')') {
+            pos++;
+        } else if (c == '{' || c == '[' || c == '(' || c == ';') {
+            pos = skip_pgn_block(text, pos);
+        } else {
+            size_t token_end = find_pgn_token_end(text, pos);
+            std::string_view token = text.substr(pos, token_end - pos);
+            pos = token_end;
+
+            if (is_result_token(token)) {
+                game = text.substr(game_start, pos - game_start);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+bool pgn_reader::next_tag(std::string_view game, size_t &pos, std::string_view &tag_name, std::string_view &tag_value)
+{
+    while (pos < game.size() && is_pgn_whitespace(game[pos])) {
+        pos++;
+    }
+    if (pos >= game.size() || game[pos] != '[') {
+        return false;
+    }
+
+    size_t tag_end = game.find(']', pos);
+    if (tag_end == std::string_view::npos) {
+        tag_end = game.size();
+    }
+
+    std::string_view tag = game.substr(pos + 1, tag_end - pos - 1);
+    pos = tag_end + 1;
+
+    tag_name = tag.substr(0, std::min(tag.find(' '), tag.size()));
+    tag_value = std::string_view();
+
+    size_t value_start = tag.find('"');
+    if (value_start != std::string_view::npos) {
+        size_t value_end = tag.find('"', value_start + 1);
+        if (value_end != std::string_view::npos) {
+            tag_value = tag.substr(value_start + 1, value_end - value_start - 1);
+        }
+    }
+
+    return true;
+}
+
+bool pgn_reader::find_tag(std::string_view game, std::string_view tag_name, std::string_view &tag_value)
+{
+    size_t pos = 0;
+    std::string_view name, value;
+    while (next_tag(game, pos, name, value)) {
+        if (name == tag_name) {
+            tag_value = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string_view pgn_reader::get_tag(std::string_view game, std::string_view tag_name)
+{
+    std::string_view tag_value;
+    find_tag(game, tag_name, tag_value);
+    return tag_value;
+}
+
+
+
+pgn_move_tokenizer::pgn_move_tokenizer(std::string_view game) : text(game)
+{
+    std::string_view name, value;
+    while (pgn_reader::next_tag(text, pos, name, value)) {
+    }
+}
+
+bool pgn_move_tokenizer::next()
+{
+    has_comment = false;
+    comment = std::string_view();
+
+    while (pos < text.size()) {
+        char c = text[pos];
+
+        if (is_pgn_whitespace(c) || c == ')') {
+            pos++;
+            continue;
+        }
+
+        if (c == '{') {
+            size_t comment_end = skip_pgn_block(text, pos);
+            if (!has_comment) {
+                size_t length = comment_end - pos - 1 - (text[comment_end - 1] == '}');
+                comment = text.substr(pos + 1, length);
+                has_comment = true;
+            }
+            pos = comment_end;
+            continue;
+        }
+
+        if (c == '(' || c == '[' || c == ';') {
+            pos = skip_pgn_block(text, pos);
+            continue;
+        }
+
+        size_t token_end = find_pgn_token_end(text, pos);
+        std::string_view token = text.substr(pos, token_end - pos);
+        pos = token_end;
+
+        if (pgn_reader::is_result_token(token)) {
+            pos = text.size();
+            break;
+        }
+
+        //Move numbers may be attached to the move ("12.e4", "12...e5")
+        size_t last_dot = token.rfind('.');
+        if (last_dot != std::string_view::npos) {
+            token.remove_prefix(last_dot + 1);
+        }
+
+        if (token.empty() || token[0] == '$' || token.find_first_not_of("0123456789") == std::string_view::npos) {
+            continue;
+        }
+
+        san = token;
+        return true;
+    }
+
+    has_comment = false;
+    return false;
+}
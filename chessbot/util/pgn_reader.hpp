@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "../game.hpp"
+
+
+//Read-only view of a whole PGN file. Mapped into memory where available, read into a buffer otherwise
+struct pgn_file
+{
+    pgn_file(const std::string &path);
+    ~pgn_file();
+
+    pgn_file(const pgn_file&) = delete;
+    pgn_file &operator=(const pgn_file&) = delete;
+
+    bool is_open() const {
+        return opened;
+    }
+
+    std::string_view get_text() const {
+        return std::string_view(data, size);
+    }
+
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    bool opened = false;
+    bool mapped = false;
+
+    std::string buffer;
+};
+
+
+//Splits PGN text into games. Games are views into the text, which must outlive the reader
+struct pgn_reader
+{
+    pgn_reader(std::string_view text) : text(text) {}
+
+    //Returns false when no complete game (ending with a result token) remains
+    bool next_game(std::string_view &game);
+
+    size_t get_position() const {
+        return pos;
+    }
+
+    static bool find_tag(std::string_view game, std::string_view tag_name, std::string_view &tag_value);
+    static std::string_view get_tag(std::string_view game, std::string_view tag_name);
+
+    //Iterates [Name "Value"] pairs at the start of the game
+    static bool next_tag(std::string_view game, size_t &pos, std::string_view &tag_name, std::string_view &tag_value);
+
+    static game_win_type_t parse_result(std::string_view result);
+    static bool is_result_token(std::string_view token);
+
+private:
+    std::string_view text;
+    size_t pos = 0;
+};
+
+
+//Yields SAN tokens of a game's main line. Tags, move numbers, NAGs and variations are skipped
+struct pgn_move_tokenizer
+{
+    pgn_move_tokenizer(std::string_view game);
+
+    bool next();
+
+    std::string_view san;
+
+    //First {comment} between the previous move and this one
+    std::string_view comment;
+    bool has_comment = false;
+
+private:
+    std::string_view text;
+    size_t pos = 0;
+};
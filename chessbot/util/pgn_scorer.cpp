@@ -3,15 +3,27 @@
 #include <filesystem>
 #include <chrono>
 #include <sstream>
+#include <iomanip>
 
 #include "../search_manager.hpp"
 #include "pgn_parser.hpp"
+#include "pgn_reader.hpp"
+#include "wdl_model.hpp"
+#include "../nnue/training/training_position.hpp"
 
 
-pgn_scorer_pool::pgn_scorer_pool(int num_of_threads, int nodes_per_position)
+pgn_scorer_pool::pgn_scorer_pool(int num_of_threads, int nodes_per_position, const std::string &output_file)
 {
-    running = true;
+    finished = false;
     total_pgns = 0;
+    scored_pgns = 0;
+
+    capacity = 4 * std::max(num_of_threads, 1);
+
+    output.open(output_file);
+    if (!output.is_open()) {
+        std::cout << "Cannot open file " << output_file << std::endl;
+    }
 
     for (int i = 0; i < num_of_threads; i++) {
         workers.push_back(std::thread(&pgn_scorer_pool::worker_thread, this, nodes_per_position));
@@ -19,17 +31,35 @@ pgn_scorer_pool::pgn_scorer_pool(int num_of_threads, int nodes_per_position)
 }
 
 pgn_scorer_pool::~pgn_scorer_pool() {
-    running = false;
-    for (auto &t : workers) {
-        t.join();
+    finish();
+}
+
+void pgn_scorer_pool::add_pgn(std::string pgn)
+{
+    {
+        std::unique_lock<std::mutex> lock(queue_lock);
+        not_full.wait(lock, [this] {return pgn_queue.size() < capacity;});
+        pgn_queue.push_back(std::move(pgn));
+        total_pgns += 1;
     }
+    not_empty.notify_one();
 }
 
-void pgn_scorer_pool::add_pgn(const std::string &str)
+void pgn_scorer_pool::finish()
 {
-    std::lock_guard<std::mutex> lock(queue_lock);
-    total_pgns += 1;
-    pgn_queue.push(str);
+    {
+        std::lock_guard<std::mutex> lock(queue_lock);
+        if (finished) {
+            return;
+        }
+        finished = true;
+    }
+    not_empty.notify_all();
+
+    for (auto &t : workers) {
+        t.join();
+    }
+    output.close();
 }
 
 int pgn_scorer_pool::pgns_queued() {
@@ -41,32 +71,18 @@ int pgn_scorer_pool::get_total_pgns() {
     return total_pgns;
 }
 
-std::string pgn_scorer_pool::get_result()
-{
-    std::lock_guard<std::mutex> lock(results_lock);
-
-    std::stringstream ss;
-
-    for (const std::string &r : results) {
-        ss << r << "\n\n";
-    }
-
-    return ss.str();
+int pgn_scorer_pool::get_scored_pgns() {
+    return scored_pgns;
 }
 
 void pgn_scorer_pool::worker_thread(int nodes_per_position)
 {
     std::shared_ptr<search_manager> search_man = std::make_shared<search_manager>();
 
-    searcher search_instance;
-
-    while (running) {
-        std::string pgn_text;
-        if (!pop_pgn_queue(pgn_text)) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
+    searcher search_instance(searcher_config::for_node_limit(nodes_per_position));
 
+    std::string pgn_text;
+    while (pop_pgn_queue(pgn_text)) {
         std::vector<pgn_tag> tags = pgn_parser::parse_tags(pgn_text);
         std::string startpos = pgn_parser::get_tag_value(tags, "FEN");
         std::vector<chess_move> moves = pgn_parser::parse_moves(pgn_text, startpos);
@@ -93,29 +109,36 @@ void pgn_scorer_pool::worker_thread(int nodes_per_position)
         }
 
 
+        std::string scored_pgn = pgn_parser::generate_pgn(tags, moves, startpos, &comments);
         {
-            std::lock_guard<std::mutex> lock(results_lock);
-            results.push_back(pgn_parser::generate_pgn(tags, moves, startpos, &comments));
+            std::lock_guard<std::mutex> lock(output_lock);
+            output << scored_pgn << "\n\n";
         }
+        scored_pgns += 1;
     }
 }
 
 bool pgn_scorer_pool::pop_pgn_queue(std::string &pgn)
 {
-    std::lock_guard<std::mutex> lock(queue_lock);
-    if (pgn_queue.empty()) {
-        return false;
+    {
+        std::unique_lock<std::mutex> lock(queue_lock);
+        not_empty.wait(lock, [this] {return finished || !pgn_queue.empty();});
+
+        if (pgn_queue.empty()) {
+            return false;
+        }
+        pgn = std::move(pgn_queue.front());
+        pgn_queue.pop_front();
     }
-    pgn = pgn_queue.front();
-    pgn_queue.pop();
+    not_full.notify_one();
     return true;
 }
 
 
-bool filter_game(const std::vector<pgn_tag> &tags, float max_elo_diff, float min_elo)
+bool filter_game(std::string_view game, float max_elo_diff, float min_elo)
 {
-    int white_elo = atoi(pgn_parser::get_tag_value(tags, "WhiteElo").c_str());
-    int black_elo = atoi(pgn_parser::get_tag_value(tags, "BlackElo").c_str());
+    int white_elo = std::atoi(std::string(pgn_reader::get_tag(game, "WhiteElo")).c_str());
+    int black_elo = std::atoi(std::string(pgn_reader::get_tag(game, "BlackElo")).c_str());
 
     if (white_elo < min_elo || black_elo < min_elo) {
         return true;
@@ -130,46 +153,249 @@ bool filter_game(const std::vector<pgn_tag> &tags, float max_elo_diff, float min
 
 void pgn_scorer::create_dataset(const std::string &pgn_folder, std::string output_file, float max_elo_diff, float min_elo, int nodes)
 {
+    int threads = std::max((int)std::thread::hardware_concurrency(), 1);
 
-    std::cout << "Reading PGNs... ";
+    pgn_scorer_pool scorer(threads, nodes, output_file);
 
-    pgn_scorer_pool scorer(16, nodes);
+    auto last_report = std::chrono::steady_clock::now();
+    auto report = [&] () {
+        std::cout << "\rAnalyzing games " << scorer.get_scored_pgns() << "/" << scorer.get_total_pgns() << "   " << std::flush;
+        last_report = std::chrono::steady_clock::now();
+    };
 
+    //Games are queued while the files are read, workers start scoring right away
     for (const auto& entry : std::filesystem::directory_iterator(pgn_folder)) {
         std::string filename = entry.path().string();
         std::string extension = entry.path().extension().string();
 
-        if (extension == ".pgn") {
-            std::string pgn_text = pgn_parser::read_text_file(filename);
+        if (extension != ".pgn") {
+            continue;
+        }
 
-            std::vector<std::string> games = pgn_parser::parse_games(pgn_text);
+        pgn_file pgn(filename);
+        pgn_reader reader(pgn.get_text());
 
-            for (auto game : games) {
-                std::vector<pgn_tag> tags = pgn_parser::parse_tags(game);
+        std::string_view game;
+        while (reader.next_game(game)) {
+            if (filter_game(game, max_elo_diff, min_elo)) {
+                continue;
+            }
 
-                if (filter_game(tags, max_elo_diff, min_elo)) {
-                    continue;
-                }
+            scorer.add_pgn(std::string(game));
 
-                scorer.add_pgn(game);
+            if (std::chrono::steady_clock::now() - last_report > std::chrono::seconds(1)) {
+                report();
             }
         }
     }
 
-    std::cout << "done." << std::endl;
+    while (scorer.get_scored_pgns() < scorer.get_total_pgns()) {
+        report();
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    scorer.finish();
+
+    report();
+    std::cout << std::endl << "All games analyzed!" << std::endl;
+}
+
+
 
-    int queued_pgns = scorer.pgns_queued();
-    int total_pgns = scorer.get_total_pgns();
-    while (queued_pgns > 0) {
-        std::cout << "\rAnalyzing games " << (total_pgns-queued_pgns) << "/" << total_pgns << "   " << std::flush;
+//Tracks which chunks are written. Everything below the lowest unfinished chunk can be skipped on resume
+struct rescore_progress
+{
+    rescore_progress(size_t num_of_chunks, size_t first_chunk) : done(num_of_chunks, false) {
+        completed = first_chunk;
+        std::fill(done.begin(), done.begin() + first_chunk, true);
+    }
 
-        queued_pgns = scorer.pgns_queued();
+    void chunk_done(size_t chunk) {
+        std::lock_guard<std::mutex> guard(lock);
+        done[chunk] = true;
+        while (completed < done.size() && done[completed]) {
+            completed++;
+        }
+    }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    size_t get_completed() {
+        std::lock_guard<std::mutex> guard(lock);
+        return completed;
     }
 
-    std::cout << "All games analyzed!" << std::endl;
+private:
+    std::mutex lock;
+    std::vector<bool> done;
+    size_t completed;
+};
 
 
-    pgn_parser::write_text_file(output_file, scorer.get_result());
+//Progress file holds dataset size, search limits and number of finished chunks
+static size_t read_rescore_progress(const std::string &path, size_t num_of_positions, int depth, int nodes)
+{
+    std::ifstream file(path);
+    size_t positions = 0, chunks = 0;
+    int progress_depth = 0, progress_nodes = 0;
+    if (!(file >> positions >> progress_depth >> progress_nodes >> chunks) ||
+        positions != num_of_positions || progress_depth != depth || progress_nodes != nodes) {
+        return 0;
+    }
+    return chunks;
+}
+
+static void write_rescore_progress(const std::string &path, size_t num_of_positions, int depth, int nodes, size_t chunks)
+{
+    {
+        std::ofstream file(path + ".tmp");
+        file << num_of_positions << " " << depth << " " << nodes << " " << chunks << std::endl;
+    }
+    sync_file(path + ".tmp");
+    std::filesystem::rename(path + ".tmp", path);
+}
+
+
+void pgn_scorer::rescore_dataset(const std::string &input_file, const std::string &output_file, int depth, int nodes, int threads)
+{
+    //Small chunks keep workers evenly loaded until the end of the run
+    constexpr size_t chunk_size = 256;
+
+    std::error_code ec;
+    size_t file_size = std::filesystem::file_size(input_file, ec);
+    if (ec) {
+        std::cout << "Cannot read file " << input_file << std::endl;
+        return;
+    }
+
+    size_t num_of_positions = file_size / sizeof(training_position);
+    size_t num_of_chunks = (num_of_positions + chunk_size - 1) / chunk_size;
+
+    std::string progress_file = output_file + ".rescore";
+    size_t first_chunk = read_rescore_progress(progress_file, num_of_positions, depth, nodes);
+
+    if (first_chunk > 0) {
+        std::cout << "Resuming from position " << std::min(first_chunk * chunk_size, num_of_positions) << std::endl;
+    } else if (!std::filesystem::equivalent(input_file, output_file, ec)) {
+        std::filesystem::copy_file(input_file, output_file, std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            std::cout << "Cannot write file " << output_file << std::endl;
+            return;
+        }
+    }
+
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    rescore_progress progress(num_of_chunks, first_chunk);
+
+    std::atomic<size_t> next_chunk = first_chunk;
+    std::atomic<size_t> positions_done = 0;
+    std::atomic<int> workers_running = threads;
+
+    auto rescore_chunks = [&] () {
+        searcher search_instance(searcher_config::for_node_limit(nodes));
+        std::shared_ptr<search_manager> search_man = std::make_shared<search_manager>();
+
+        std::fstream file(output_file, std::ios::in | std::ios::out | std::ios::binary);
+        std::vector<training_position> positions(chunk_size);
+        board_state state;
+
+        while (file.good()) {
+            size_t chunk = next_chunk++;
+            if (chunk >= num_of_chunks) {
+                break;
+            }
+
+            size_t first = chunk * chunk_size;
+            size_t count = std::min(chunk_size, num_of_positions - first);
+
+            file.seekg(first * sizeof(training_position));
+            file.read((char*)positions.data(), count * sizeof(training_position));
+
+            //Fresh tables per chunk so the result doesn't depend on which worker took it
+            search_instance.new_game();
+            search_instance.clear_transposition_table();
+            search_instance.clear_evaluation_cache();
+
+            for (size_t i = 0; i < count; i++) {
+                positions[i].load(state);
+
+                search_man->prepare_depth_nodes_search(depth, nodes);
+                search_instance.search(state, search_man);
+
+                positions[i].eval = wdl_model::normalize_score(state, search_man->get_evaluation());
+                positions_done++;
+            }
+
+            file.seekp(first * sizeof(training_position));
+            file.write((const char*)positions.data(), count * sizeof(training_position));
+            file.flush();
+
+            if (file.good()) {
+                progress.chunk_done(chunk);
+            }
+        }
+
+        if (!file.good()) {
+            std::cout << "Cannot write file " << output_file << std::endl;
+        }
+        workers_running--;
+    };
+
+    std::cout << "Rescoring " << num_of_positions << " positions with " << threads << " threads, depth " << depth << " nodes " << nodes << std::endl;
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(rescore_chunks);
+    }
+
+    size_t positions_before = std::min(first_chunk * chunk_size, num_of_positions);
+    size_t saved_chunks = first_chunk;
+
+    auto save_progress = [&] () {
+        size_t completed = progress.get_completed();
+        if (completed > saved_chunks) {
+            //Positions have to be on disk before the progress file claims them
+            sync_file(output_file);
+            write_rescore_progress(progress_file, num_of_positions, depth, nodes, completed);
+            saved_chunks = completed;
+        }
+    };
+
+    auto report = [&] () {
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+        size_t done = positions_before + positions_done;
+        double pos_per_second = positions_done / std::max(seconds, 1e-3);
+        std::cout << "\rPositions: " << done << "/" << num_of_positions
+                  << "   " << std::fixed << std::setprecision(1) << 100.0 * done / std::max(num_of_positions, (size_t)1) << "%"
+                  << "   " << (size_t)pos_per_second << " pos/s"
+                  << "   ETA " << (size_t)((num_of_positions - done) / std::max(pos_per_second, 1e-3)) << "s   "
+                  << std::defaultfloat << std::flush;
+    };
+
+    auto last_save = std::chrono::high_resolution_clock::now();
+    while (workers_running > 0) {
+        report();
+        if (std::chrono::high_resolution_clock::now() - last_save > std::chrono::seconds(30)) {
+            save_progress();
+            last_save = std::chrono::high_resolution_clock::now();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    for (std::thread &t : workers) {
+        t.join();
+    }
+    report();
+    std::cout << std::endl;
+
+    if (progress.get_completed() == num_of_chunks) {
+        sync_file(output_file);
+        std::filesystem::remove(progress_file, ec);
+        std::cout << "Rescoring done." << std::endl;
+    } else {
+        save_progress();
+        std::cout << "Rescoring stopped at chunk " << progress.get_completed() << "/" << num_of_chunks << ", run again to continue." << std::endl;
+    }
 }
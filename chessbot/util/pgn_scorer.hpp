@@ -1,9 +1,11 @@
 #pragma once
 
 #include <iostream>
+#include <fstream>
 #include <thread>
 #include <mutex>
-#include <queue>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 #include <atomic>
 #include "../state.hpp"
@@ -11,36 +13,50 @@
 
 
 
+//Scores queued games on worker threads and appends them to the output file as they finish
 struct pgn_scorer_pool
 {
-    pgn_scorer_pool(int num_of_threads, int nodes_per_position);
+    pgn_scorer_pool(int num_of_threads, int nodes_per_position, const std::string &output_file);
 
     ~pgn_scorer_pool();
 
-    void add_pgn(const std::string &str);
+    //Blocks while queue is full
+    void add_pgn(std::string pgn);
+
+    //Scores remaining games and closes the output
+    void finish();
 
     int pgns_queued();
 
     int get_total_pgns();
+    int get_scored_pgns();
 
-    std::string get_result();
+private:
     void worker_thread(int nodes_per_position);
 
-private:
+    //Blocks until a game is available, returns false once finished and empty
     bool pop_pgn_queue(std::string &pgn);
 
     std::vector<std::thread> workers;
     std::mutex queue_lock;
-    std::mutex results_lock;
-    std::queue<std::string> pgn_queue;
-    std::vector<std::string> results;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<std::string> pgn_queue;
+    size_t capacity;
+    bool finished;
 
-    std::atomic<bool> running;
+    std::mutex output_lock;
+    std::ofstream output;
 
-    int total_pgns;
+    std::atomic<int> total_pgns;
+    std::atomic<int> scored_pgns;
 };
 
 namespace pgn_scorer
 {
     void create_dataset(const std::string &pgn_folder, std::string output_file, float max_elo_diff, float min_elo, int nodes);
+
+    //Searches every position of a .bin dataset again to at least depth and nodes, and replaces the evals. Output may be the
+    //input file. Finished chunks are recorded next to the output so an interrupted run continues where it stopped
+    void rescore_dataset(const std::string &input_file, const std::string &output_file, int depth, int nodes, int threads = 0);
 }
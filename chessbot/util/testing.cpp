@@ -53,8 +53,9 @@ struct test_worker
 
     void start(std::atomic<int> &games, int time, int time_inc, searcher &s00, searcher &s10, std::shared_ptr<std::vector<std::string>> opening_suite)
     {
-        s0 = std::make_unique<searcher>(s00);
-        s1 = std::make_unique<searcher>(s10);
+        //Tables are not copied, each game pair starts a new game anyway
+        s0 = std::make_unique<searcher>(s00, s00.get_config());
+        s1 = std::make_unique<searcher>(s10, s10.get_config());
 
         t = std::thread(&test_worker::play, this, std::ref(games), time, time_inc, opening_suite);
     }
@@ -153,6 +154,14 @@ int testing_utility::test(int games, int time, int time_inc, searcher &s0, searc
         workers[i].start(agames, time, time_inc, s0, s1, openings);
     }
 
+    if (!silent && threads > 0) {
+        searcher_memory m0 = s0.get_memory_usage();
+        searcher_memory m1 = s1.get_memory_usage();
+        m0.print("Searcher 0 memory per worker");
+        m1.print("Searcher 1 memory per worker");
+        std::cout << "Searcher memory total: " << (m0.total() + m1.total()) * threads / (1024*1024) << "MB" << std::endl;
+    }
+
     double s0_depth, s1_depth, s0_nps, s1_nps, elo;
     int wins, draws, losses;
 
@@ -2,17 +2,20 @@
 #include <iostream>
 #include <array>
 #include <filesystem>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include "pgn_parser.hpp"
+#include "pgn_reader.hpp"
 #include "misc.hpp"
+#include "../nnue/training/training_data.hpp"
 
 
 
 typedef std::array<double, 8> win_rate_model_params;
 
-typedef std::tuple<int32_t, int32_t, float> wdl_model_data_point;
-typedef std::vector<wdl_model_data_point> wdl_model_dataset;
-
 
 
 int32_t eval_scaling_factor = 707;
@@ -120,144 +123,313 @@ double log_loss_derivate(double truth, double prediction)
 }
 
 
-std::pair<wdl_model_dataset, wdl_model_dataset> load_wdl_model_dataset(std::string dataset_folder, int valid_size)
+void wdl_histogram::add(int32_t material, int32_t eval, float wdl)
 {
-    wdl_model_dataset data_train;
-    wdl_model_dataset data_valid;
-
-    srand(123);
+    //Model is fitted over bucket evals, results outside the range would be misplaced in edge buckets
+    if (is_mate_score(eval) || eval < -max_eval || eval > max_eval) {
+        return;
+    }
 
-    for (const auto& entry : std::filesystem::directory_iterator(dataset_folder)) {
-        if (entry.path().extension().string() == ".pgn") {
+    material = std::clamp(material, 0, max_material);
+    int eval_bucket = (eval + max_eval + eval_bucket_size/2) / eval_bucket_size;
 
-            iterate_pgn_positions(pgn_parser::read_text_file(entry.path().string()),
-                                  [&] (const board_state &state,
-                                       chess_move bm,
-                                       game_win_type_t game_result,
-                                       std::string *comment) {
+    bucket &b = buckets[material * num_of_eval_buckets + eval_bucket];
+    if (wdl == 1.0f) {
+        b.wins++;
+    } else if (wdl == 0.0f) {
+        b.losses++;
+    } else {
+        b.draws++;
+    }
+}
 
-                                      int32_t material = get_material(state);
-                                      int32_t eval = std::atoi(comment->c_str());
+void wdl_histogram::merge(const wdl_histogram &other)
+{
+    for (size_t i = 0; i < buckets.size(); i++) {
+        buckets[i].wins += other.buckets[i].wins;
+        buckets[i].draws += other.buckets[i].draws;
+        buckets[i].losses += other.buckets[i].losses;
+    }
+}
 
+uint64_t wdl_histogram::get_total() const
+{
+    uint64_t total = 0;
+    for (const bucket &b : buckets) {
+        total += b.total();
+    }
+    return total;
+}
 
-                                      float wdl = 0.0f;
-                                      if ((state.get_turn() == WHITE && game_result == WHITE_WIN) ||
-                                          (state.get_turn() == BLACK && game_result == BLACK_WIN)) {
-                                          wdl = 1.0f;
-                                      }
 
-                                      data_train.push_back({material, eval, wdl});
-                                  });
-        }
+//Header holds table dimensions so histograms of another layout are rejected
+bool wdl_histogram::save(const std::string &filename) const
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
     }
 
-    for (int i = 0; i < valid_size; i++) {
-        int r = rand() % data_train.size();
+    int32_t header[4] = {max_material, max_eval, eval_bucket_size, num_of_eval_buckets};
+    file.write((const char*)header, sizeof(header));
+    file.write((const char*)buckets.data(), buckets.size() * sizeof(bucket));
+
+    return file.good();
+}
 
-        data_valid.push_back(data_train[r]);
+bool wdl_histogram::load(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
 
-        std::swap(data_train[data_train.size()-1], data_train[r]);
-        data_train.pop_back();
+    int32_t header[4] = {};
+    file.read((char*)header, sizeof(header));
+    if (header[0] != max_material || header[1] != max_eval || header[2] != eval_bucket_size || header[3] != num_of_eval_buckets) {
+        return false;
     }
+    file.read((char*)buckets.data(), buckets.size() * sizeof(bucket));
 
-    return {data_train, data_valid};
+    return file.good();
 }
 
 
-void wdl_model::fit_model(std::string dataset_folder)
+
+int32_t get_material(const training_position &pos)
 {
-    constexpr int data_valid_size = 10000;
+    static const int piece_values[8] = {0, 1, 3, 3, 5, 9, 0, 0};
 
-    auto [data_train, data_valid] = load_wdl_model_dataset(dataset_folder, data_valid_size);
+    int material = 0;
 
-    std::cout << "Train set size: " << data_train.size() << std::endl;
-    std::cout << "Valid set size: " << data_valid.size() << std::endl;
+    uint64_t occupation = pos.occupation;
+    int index = 0;
+    int sq_index;
+    for (int i = 0; i < pos.count_pieces(); i++) {
+        piece p;
+        p.d = pos.iterate_pieces(occupation, index, sq_index);
+        material += piece_values[p.get_type()];
+    }
 
-    win_rate_model_params params =
-                                {0.0, 0.0, 0.0, 1.0,
-                                 0.0, 0.0, 0.0, 1.0};
+    return material;
+}
 
 
-    win_rate_model_params best_params;
+void wdl_model::build_histogram(const std::vector<std::string> &directories, wdl_histogram &histogram, int threads)
+{
+    std::vector<std::string> pgn_files;
+    for (const std::string &directory : directories) {
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            if (entry.path().extension().string() == ".pgn") {
+                pgn_files.push_back(entry.path().string());
+            }
+        }
+    }
 
-    double best_cost = std::numeric_limits<double>::max();
-    int best_params_iteration = 0;
+    data_reader reader(directories);
+    reader.set_access_pattern(data_reader::ACCESS_SEQUENTIAL);
 
-    srand(time(NULL));
+    //Binary datasets hold evals of normalize_score, as written by datagen and convert_training_data, converted back to
+    //search score scale for the model. Shards converted before conversion used normalize_score were scaled by a factor
+    //fitted per PGN file and would skew the histogram, convert them again or use their PGN files.
+    auto add_position = [] (wdl_histogram &h, const training_position &pos) {
+        int32_t eval = pos.get_eval();
+        if (!is_mate_score(eval)) {
+            eval = (eval * eval_scaling_factor) / 400;
+        }
+        h.add(get_material(pos), eval, pos.get_wdl_relative_to_stm());
+    };
+
+    //Work items are ranges of bin shards, chain blocks and pgn files
+    constexpr size_t range_size = 1 << 20;
+
+    struct work_item
+    {
+        int type;
+        size_t index;
+        size_t first;
+    };
+    std::vector<work_item> work;
+
+    for (size_t i = 0; i < reader.get_num_of_shards(); i++) {
+        size_t shard_size = reader.get_shard<training_position>(i).size();
+        for (size_t first = 0; first < shard_size; first += range_size) {
+            work.push_back({0, i, first});
+        }
+    }
+    for (size_t i = 0; i < reader.get_num_of_chain_blocks(); i++) {
+        work.push_back({1, i, 0});
+    }
+    for (size_t i = 0; i < pgn_files.size(); i++) {
+        work.push_back({2, i, 0});
+    }
 
-    for (int i = 0; i < 8; i++) {
-        params[i] += (static_cast<float>(rand() & 0xFFFF) / 0xFFFF) * 0.2 - 0.1f;
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
     }
+    threads = std::min(threads, std::max((int)work.size(), 1));
 
-    double learning_rate = 0.0001f;
+    std::vector<wdl_histogram> histograms(threads);
+    std::atomic<size_t> next_item = 0;
+    std::atomic<size_t> items_done = 0;
 
-    int iterations = 0;
-    while (true) {
-        for (auto [material, eval, truth] : data_train) {
-            if (is_mate_score(eval)) {
-                continue;
+    auto build = [&] (wdl_histogram &h) {
+        std::vector<training_position> positions;
+        while (true) {
+            size_t item = next_item++;
+            if (item >= work.size()) {
+                break;
             }
+            const work_item &w = work[item];
+
+            if (w.type == 0) {
+                auto shard = reader.get_shard<training_position>(w.index);
+                const training_position *last = std::min(shard.first + w.first + range_size, shard.last);
+                for (const training_position *pos = shard.first + w.first; pos < last; pos++) {
+                    add_position(h, *pos);
+                }
+            } else if (w.type == 1) {
+                positions.clear();
+                reader.decode_chain_block(w.index, positions);
+                for (const training_position &pos : positions) {
+                    add_position(h, pos);
+                }
+            } else {
+                pgn_file pgn(pgn_files[w.index]);
+                iterate_pgn_positions(pgn.get_text(), [&] (const board_state &state, chess_move bm, game_win_type_t game_result, std::string *comment) {
+                    //Positions without eval comment are not scored
+                    if (!comment) {
+                        return;
+                    }
+
+                    float wdl = 0.5f;
+                    if (game_result == WHITE_WIN) {
+                        wdl = (state.get_turn() == WHITE ? 1.0f : 0.0f);
+                    } else if (game_result == BLACK_WIN) {
+                        wdl = (state.get_turn() == BLACK ? 1.0f : 0.0f);
+                    }
+                    h.add(get_material(state), std::atoi(comment->c_str()), wdl);
+                });
+            }
+            items_done++;
+        }
+    };
 
-            win_rate_model_params gradient = {0, 0, 0, 0,
-                                              0, 0, 0, 0};
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(build, std::ref(histograms[i]));
+    }
 
-            double prediction = win_rate_model(material, eval, params);
+    while (items_done < work.size()) {
+        std::cout << "\rBuilding histogram " << items_done << "/" << work.size() << "   " << std::flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
 
-            win_rate_model_backprop(material, eval, params, gradient, log_loss_derivate(truth, prediction));
+    for (int i = 0; i < threads; i++) {
+        workers[i].join();
+        histogram.merge(histograms[i]);
+    }
+    std::cout << "\rBuilding histogram " << items_done << "/" << work.size() << std::endl;
+    std::cout << "Positions: " << histogram.get_total() << std::endl;
+}
 
-            for (int i = 0; i < 8 && iterations > 0; i++) {
-                params[i] -= learning_rate*gradient[i];
-            }
-        }
 
+void wdl_model::fit_model(std::string dataset)
+{
+    wdl_histogram histogram;
 
-        for (int i = data_train.size() - 1; i > 0; --i) {
-            uint32_t r = (rand() << 16) | (rand() & 0xFFFF);
-            int j = r % (i+1);
+    if (std::filesystem::is_directory(dataset)) {
+        build_histogram({dataset}, histogram);
+    } else if (!histogram.load(dataset)) {
+        std::cout << "Cannot read histogram " << dataset << std::endl;
+        return;
+    }
 
-            std::swap(data_train[i], data_train[j]);
-        }
+    fit_model(histogram);
+}
 
 
+//Full batch Adam over the histogram. Every bucket is one data point weighted by its position count
+void wdl_model::fit_model(const wdl_histogram &histogram)
+{
+    double total = (double)histogram.get_total();
+    if (total == 0) {
+        std::cout << "Empty dataset" << std::endl;
+        return;
+    }
+
+    auto evaluate = [&] (win_rate_model_params &params, win_rate_model_params *gradient) {
         double loss = 0;
-        for (auto [material, eval, truth] : data_valid) {
-            if (is_mate_score(eval)) {
-                continue;
+        for (int material = 0; material <= wdl_histogram::max_material; material++) {
+            for (int i = 0; i < wdl_histogram::num_of_eval_buckets; i++) {
+                const wdl_histogram::bucket &b = histogram.get(material, i);
+                if (b.total() == 0) {
+                    continue;
+                }
+                int32_t eval = wdl_histogram::get_bucket_eval(i);
+                double wins = (double)b.wins;
+                double others = (double)(b.draws + b.losses);
+
+                double prediction = win_rate_model(material, eval, params);
+
+                loss += wins*log_loss(1.0, prediction) + others*log_loss(0.0, prediction);
+
+                if (gradient) {
+                    double error = (wins*log_loss_derivate(1.0, prediction) + others*log_loss_derivate(0.0, prediction)) / total;
+                    win_rate_model_backprop(material, eval, params, *gradient, error);
+                }
             }
+        }
+        return loss / total;
+    };
 
-            double prediction = win_rate_model(material, eval, params);
+    //Start from the current model
+    win_rate_model_params params = win_rate_params;
+    win_rate_model_params best_params = params;
+    win_rate_model_params m = {}, v = {};
 
-            loss += log_loss(truth, prediction);
-        }
+    double best_cost = evaluate(params, nullptr);
+    int best_params_iteration = 0;
 
-        double cost = loss / data_valid.size();
+    std::cout << "Initial cost: " << best_cost << std::endl;
 
+    double learning_rate = 0.01;
+    constexpr double beta1 = 0.9, beta2 = 0.999;
 
-        if (cost < best_cost) {
+    for (int iterations = 1; iterations <= 20000 && learning_rate > 1e-6; iterations++) {
+        win_rate_model_params gradient = {};
+
+        double cost = evaluate(params, &gradient);
+
+        if (cost < best_cost - 1e-9) {
             best_cost = cost;
             best_params = params;
             best_params_iteration = iterations;
+        } else if (iterations - best_params_iteration > 50) {
+            params = best_params;
+            m = {};
+            v = {};
+            learning_rate *= 0.25;
+            best_params_iteration = iterations;
+            continue;
+        }
 
-            //std::cout << "New best" << std::endl;
-        } else {
-
-            if (std::abs(best_params_iteration - iterations) > 5) {
-                params = best_params;
-                learning_rate = learning_rate*0.25f;
+        for (int i = 0; i < 8; i++) {
+            m[i] = beta1*m[i] + (1.0 - beta1)*gradient[i];
+            v[i] = beta2*v[i] + (1.0 - beta2)*gradient[i]*gradient[i];
 
-                //std::cout << "Reducing learning rate" << std::endl;
-            }
+            double m_hat = m[i] / (1.0 - std::pow(beta1, iterations));
+            double v_hat = v[i] / (1.0 - std::pow(beta2, iterations));
 
-            if (std::abs(best_params_iteration - iterations) > 20) {
-                break;
-            }
+            params[i] -= learning_rate * m_hat / (std::sqrt(v_hat) + 1e-12);
         }
 
-        std::cout << "Iteration: " << iterations << "  cost: " << cost << std::endl;
-
-        iterations += 1;
+        if (iterations % 500 == 0) {
+            std::cout << "Iteration: " << iterations << "  cost: " << best_cost << std::endl;
+        }
     }
 
+    std::cout << "Cost: " << best_cost << std::endl;
     std::cout << "{" << best_params[0] << ", " << best_params[1] << ", " << best_params[2] << ", " << best_params[3] << "," << std::endl;
     std::cout        << best_params[4] << ", " << best_params[5] << ", " << best_params[6] << ", " << best_params[7] << "};" << std::endl;
 }
@@ -1,11 +1,62 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "../state.hpp"
 
+
+//Game result counts over (material, eval bucket). Model fitting only needs this table, not the positions
+struct wdl_histogram
+{
+    static constexpr int max_material = 78;
+    static constexpr int max_eval = 2000;
+    static constexpr int eval_bucket_size = 10;
+    static constexpr int num_of_eval_buckets = 2*max_eval/eval_bucket_size + 1;
+
+    struct bucket
+    {
+        uint64_t wins = 0;
+        uint64_t draws = 0;
+        uint64_t losses = 0;
+
+        uint64_t total() const {
+            return wins + draws + losses;
+        }
+    };
+
+    wdl_histogram() : buckets((max_material + 1) * num_of_eval_buckets) {}
+
+    //Eval in search score scale and wdl relative to side to move. Mate scores and evals beyond max_eval are not counted
+    void add(int32_t material, int32_t eval, float wdl);
+    void merge(const wdl_histogram &other);
+
+    const bucket &get(int material, int eval_bucket) const {
+        return buckets[material * num_of_eval_buckets + eval_bucket];
+    }
+
+    static int32_t get_bucket_eval(int eval_bucket) {
+        return eval_bucket * eval_bucket_size - max_eval;
+    }
+
+    uint64_t get_total() const;
+
+    bool save(const std::string &filename) const;
+    bool load(const std::string &filename);
+
+private:
+    std::vector<bucket> buckets;
+};
+
+
 namespace wdl_model
 {
-    void fit_model(std::string dataset_folder);
+    //Streams .bin and .chain shards and scored .pgn files of the directories into histogram. Shard evals are expected
+    //in normalize_score scale
+    void build_histogram(const std::vector<std::string> &directories, wdl_histogram &histogram, int threads = 0);
+
+    //Dataset is a histogram file or a directory of positions
+    void fit_model(std::string dataset);
+    void fit_model(const wdl_histogram &histogram);
 
     void get_wdl(const board_state &state, int32_t search_score, float &win_p, float &draw_p, float &loss_p);
 
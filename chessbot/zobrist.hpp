@@ -194,6 +194,14 @@ public:
         }
         return (h ^ turn_xor);
     }
+
+    uint64_t get_piece_hash(int sq, uint8_t p) const {
+        return table_xor[sq][p];
+    }
+
+    uint64_t get_turn_hash() const {
+        return turn_xor;
+    }
 private:
     uint64_t turn_xor;
     uint64_t castling_xor[4];
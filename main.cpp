@@ -92,10 +92,11 @@ void datagen()
     config.forward_pruning = true;
     config.multi_pv_opening = true;
     config.opening_moves = 8;
-    config.games = 32000;
+    config.games = 32000*1000;
     config.opening_suite = "tuning/UHO_4060_v4.epd";
     config.threads = 28;
     config.filter_dublicate_openings = true;
+    config.opening_filter_MB = 256;
     config.adjucate_wins = true;
     config.adjucate_win_cp_treshold = 1200;
     config.adjucate_win_min_plies = 40;
@@ -105,22 +106,15 @@ void datagen()
     config.adjucate_draw_plies_below_treshold = 10;
     config.adjucate_draw_cp_treshold = 50;
 
-    int filenum = 0;
-    while (filenum < 1000) {
-        filenum++;
+    config.format = DATAGEN_CHAIN;
+    config.write_pgn = false;
+    config.games_per_file = 32000;
+    config.sync_games = 256;
 
-        std::stringstream ss;
-        ss << folder << "/nodes" << config.nodes / 1000 << "k_" << config.games << "_" << filenum << ".pgn";
+    std::stringstream ss;
+    ss << folder << "/nodes" << config.nodes / 1000 << "k_" << config.games_per_file;
 
-        std::string filename = ss.str();
-
-        std::ifstream file(filename);
-        if (file.is_open()) {
-            file.close();
-            continue;
-        }
-        training_datagen::datagen(filename, config);
-    }
+    training_datagen::datagen(ss.str(), config);
 }
 
 